@@ -20,6 +20,11 @@
  *
  * Speed changes are only effective after a reset.
  *
+ * When compiled with FAST_PRESETS defined (`make FAST_PRESETS=1'), the
+ * speeds are 25, 35, 45 and 60 wpm instead, for fast operators and
+ * machine-sent traffic, and the debounce time is scaled with the dot
+ * time.
+ *
  * Copyright (c) 2018 Edgar Bonet Orozco.
  * This file is part of tiny-morse-decoder, licensed under the terms of
  * the MIT license. See file LICENSE for details.
@@ -39,10 +44,17 @@
 #define TX_PIN   PB2
 
 /* Available keying rates in words per minute. */
-#define KEY_RATE_0  5
-#define KEY_RATE_1  8
-#define KEY_RATE_2 12
-#define KEY_RATE_3 18
+#ifdef FAST_PRESETS
+#  define KEY_RATE_0 25
+#  define KEY_RATE_1 35
+#  define KEY_RATE_2 45
+#  define KEY_RATE_3 60
+#else
+#  define KEY_RATE_0  5
+#  define KEY_RATE_1  8
+#  define KEY_RATE_2 12
+#  define KEY_RATE_3 18
+#endif
 
 /* Baud rate of the serial data output. */
 #define BAUD_RATE 9600
@@ -66,7 +78,18 @@
 #define TIMER_TOP ((int)((float)F_CPU/8/BAUD_RATE+0.5) - 1)
 #define TIC_FREQ ((float)F_CPU/8/(TIMER_TOP+1))           // in Hz
 #define DOT_TIME(rate) ((uint16_t)(1.2/(rate)*TIC_FREQ))  // in tics
-#define DEBOUNCE_TIME  ((uint16_t)(0.01*TIC_FREQ+0.5))    // in tics
+#ifdef FAST_PRESETS
+/*
+ * At 60 wpm, a dot lasts only 20 ms, and a fixed 10 ms debounce time
+ * would eat half the margin between dots and dashes. The debounce time
+ * is instead an eighth of the dot time, 2.5 ms at 60 wpm, a little less
+ * than the 15% of a dot that 10 ms makes at 18 wpm. delay_1u is defined
+ * below.
+ */
+#  define DEBOUNCE_TIME (delay_1u >> 3)                   // in tics
+#else
+#  define DEBOUNCE_TIME ((uint16_t)(0.01*TIC_FREQ+0.5))  // in tics
+#endif
 
 
 /***********************************************************************
@@ -226,11 +249,15 @@ static edge_t get_edge(void)
 typedef enum {NO_SYMBOL, DOT, DASH, END_OF_CHAR, END_OF_WORD} symbol_t;
 
 /*
- * Return the next detected symbol, if any, NO_SYMBOL otherwise.
+ * Return the next detected symbol, if any, NO_SYMBOL otherwise, given
+ * the thresholds of 2 and 3 time units.
  *
- * This is also a finite-state machine described in internals.md.
+ * This is also a finite-state machine described in internals.md. It is
+ * always inlined in decode_loop(), such that the thresholds can be
+ * constants. The state is shared by all the copies.
  */
-static symbol_t tokenize(edge_t edge)
+static inline __attribute__((always_inline))
+symbol_t tokenize_with(edge_t edge, uint16_t two_units, uint16_t three_units)
 {
     static enum {
         INTERWORD, SHORT, LONG, INTERELEMENT, INTERCHARACTER
@@ -241,13 +268,13 @@ static symbol_t tokenize(edge_t edge)
         case INTERWORD:
             if (edge == FALL) {
                 state = SHORT;
-                timeout = now + delay_2u;
+                timeout = now + two_units;
             }
             break;
         case SHORT:
             if (edge == RISE) {
                 state = INTERELEMENT;
-                timeout = now + delay_2u;
+                timeout = now + two_units;
                 return DOT;
             } else if (expired(now, timeout)) {
                 state = LONG;
@@ -256,24 +283,24 @@ static symbol_t tokenize(edge_t edge)
         case LONG:
             if (edge == RISE) {
                 state = INTERELEMENT;
-                timeout = now + delay_2u;
+                timeout = now + two_units;
                 return DASH;
             }
             break;
         case INTERELEMENT:
             if (edge == FALL) {
                 state = SHORT;
-                timeout = now + delay_2u;
+                timeout = now + two_units;
             } else if (expired(now, timeout)) {
                 state = INTERCHARACTER;
-                timeout = now + delay_3u;
+                timeout = now + three_units;
                 return END_OF_CHAR;
             }
             break;
         case INTERCHARACTER:
             if (edge == FALL) {
                 state = SHORT;
-                timeout = now + delay_2u;
+                timeout = now + two_units;
             } else if (expired(now, timeout)) {
                 state = INTERWORD;
                 return END_OF_WORD;
@@ -377,6 +404,18 @@ static void init_uart()
  */
 static volatile int16_t uart_shift_register;
 
+#ifdef PACKED_OUTPUT
+#define TX_QUEUE 4  // bytes waiting for the UART, a power of two
+
+/*
+ * Bytes of the frame waiting for the UART. Only the main program moves
+ * tx_head, and only the ISR moves tx_tail.
+ */
+static uint8_t tx_queue[TX_QUEUE];
+static volatile uint8_t tx_head;
+static uint8_t tx_tail;
+#endif
+
 ISR(TIM0_COMPB_vect)
 {
     /*
@@ -396,6 +435,17 @@ ISR(TIM0_COMPB_vect)
     /* Shift. */
     shift_register >>= 1;
 
+#ifdef PACKED_OUTPUT
+    /*
+     * Frames are binary, and may contain NUL and 0x80: test the whole
+     * shift register, and move on to the next queued byte, if any,
+     * once the stop bit is out.
+     */
+    if (shift_register == 0 && tx_tail != tx_head)
+        shift_register = (0x0100 | tx_queue[tx_tail++ % TX_QUEUE]) << 1;
+    if (shift_register == 0)
+        TIMSK0 &= ~_BV(OCIE0B);
+#else
     /*
      * If we are done, disable the interrupt. As a micro-optimization,
      * we test only the low byte of the shift register. Note that this
@@ -404,6 +454,7 @@ ISR(TIM0_COMPB_vect)
      */
     if ((uint8_t) shift_register == 0)
         TIMSK0 &= ~_BV(OCIE0B);
+#endif
 
     uart_shift_register = shift_register;
 }
@@ -421,6 +472,104 @@ static void uart_putchar(char c)
     TIMSK0 |= _BV(OCIE0B);  // enable the interrupt
 }
 
+#ifdef PACKED_OUTPUT
+
+
+/***********************************************************************
+ * Packed output.
+ *
+ * Characters are packed four per three bytes as 6-bit symbols, and sent
+ * as soon as they fill a byte, in frames that end after FRAME_IDLE tics
+ * without a character. See internals.md for the format, and
+ * tools/unpack-output.c for the decoding.
+ */
+
+#define SYNC_BYTE 0xff
+#define OUTPUT_CHANNEL 0  // 0 to 6, tags the frames of this decoder
+#define END_SYMBOL 60     // closes a frame
+#define FRAME_IDLE 28800  // 3 s, must be below 32768
+
+static bool frame_open;
+static uint16_t frame_deadline;  // when to close the open frame
+static uint16_t packed_bits;     // symbol bits not sent yet
+static uint8_t packed_count;     // number of such bits
+
+/*
+ * Send a byte, or queue it if the UART is busy. The queue never holds
+ * more than the header and time delta of a frame, plus a byte of
+ * symbols: the next character comes at least three dot times later.
+ */
+static void queue_byte(uint8_t byte)
+{
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        if (TIMSK0 & _BV(OCIE0B))
+            tx_queue[tx_head++ % TX_QUEUE] = byte;
+        else
+            uart_putchar(byte);
+    }
+}
+
+/*
+ * Append a symbol to the frame, least significant bit first, and send
+ * the bytes it completes. As all symbols but END_SYMBOL are below 60,
+ * and END_SYMBOL is only followed by cleared bits, the packed bytes are
+ * never 0xff, which leaves SYNC_BYTE free for framing.
+ */
+static void put_symbol(uint8_t symbol)
+{
+    packed_bits |= symbol << packed_count;
+    packed_count += 6;
+    if (packed_count >= 8) {
+        queue_byte(packed_bits);
+        packed_bits >>= 8;
+        packed_count -= 8;
+    }
+}
+
+/* Send a character, opening a frame if needed. */
+static void packed_putchar(char c)
+{
+    uint16_t now = tics();
+
+    if (!frame_open) {
+        static uint16_t last_frame_time;
+
+        /*
+         * Time since the previous frame, in units of 256 tics (26.7 ms),
+         * modulo the 6.8 s period of tics(). 255 is reserved for sync.
+         */
+        uint8_t delta = (uint16_t)(now - last_frame_time) >> 8;
+        if (delta == SYNC_BYTE)
+            delta--;
+        last_frame_time = now;
+
+        queue_byte(SYNC_BYTE);
+        queue_byte(OUTPUT_CHANNEL << 4);
+        queue_byte(delta);
+        frame_open = true;
+    }
+    put_symbol(c == '_' ? 59 : c - ' ');
+    frame_deadline = now + FRAME_IDLE;
+}
+
+/*
+ * Called when no character was decoded: close the frame once the line
+ * has been idle for FRAME_IDLE, which also sends the last bits of its
+ * final character.
+ */
+static void packed_idle(void)
+{
+    if (frame_open && expired(tics(), frame_deadline)) {
+        put_symbol(END_SYMBOL);
+        if (packed_count)
+            queue_byte(packed_bits);
+        packed_bits = 0;
+        packed_count = 0;
+        frame_open = false;
+    }
+}
+#endif  // PACKED_OUTPUT
+
 
 /***********************************************************************
  * Main program.
@@ -443,6 +592,52 @@ static void invite(void)
     }
 }
 
+/*
+ * Decode forever, given the thresholds of 2 and 3 time units. This is
+ * always inlined, such that the copies below get the thresholds as
+ * constants.
+ */
+static inline __attribute__((always_inline, noreturn))
+void decode_loop(uint16_t two_units, uint16_t three_units)
+{
+    for (;;) {
+        edge_t edge = get_edge();
+        symbol_t sym = tokenize_with(edge, two_units, three_units);
+        char c = decode(sym);
+#ifdef PACKED_OUTPUT
+        if (c)
+            packed_putchar(c);
+        else
+            packed_idle();
+#else
+        if (c)
+            uart_putchar(c);
+#endif
+    }
+}
+
+#ifdef SPECIALIZED_TOKENIZER
+
+/*
+ * One copy of the main loop per speed, with the thresholds of the
+ * tokenizer as immediate operands rather than loaded from RAM. main()
+ * jumps once into the copy matching the selected speed. See internals.md
+ * for the trade-off.
+ */
+#define DECODE_LOOP(n) \
+    static void __attribute__((noreturn)) decode_loop_##n(void) \
+    { \
+        decode_loop(2 * DOT_TIME(KEY_RATE_##n), \
+                3 * DOT_TIME(KEY_RATE_##n)); \
+    }
+
+DECODE_LOOP(0)
+DECODE_LOOP(1)
+DECODE_LOOP(2)
+DECODE_LOOP(3)
+
+#endif
+
 int main(void)
 {
     /* Set the clock prescaler to 1. */
@@ -459,11 +654,14 @@ int main(void)
     set_delays();
     sei();
     invite();
-    for (;;) {
-        edge_t edge = get_edge();
-        symbol_t sym = tokenize(edge);
-        char c = decode(sym);
-        if (c)
-            uart_putchar(c);
+#ifdef SPECIALIZED_TOKENIZER
+    switch (PINB & 0x03) {  // as in set_delays(), order of dot_times[]
+        case 0: decode_loop_3();
+        case 1: decode_loop_2();
+        case 2: decode_loop_1();
+        default: decode_loop_0();
     }
+#else
+    decode_loop(delay_2u, delay_3u);
+#endif
 }
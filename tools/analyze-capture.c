@@ -0,0 +1,432 @@
+/*
+ * Analyze a logic analyzer capture of a running decoder: measure the
+ * latency from the key to the serial output, the timing of the serial
+ * output, and the bouncing of the key.
+ *
+ * The capture holds the key pin (PB4) and the serial output (PB2). It
+ * is either a VCD file, as written by sigrok, simavr and most logic
+ * analyzer programs, or a raw binary file with one byte per sample, one
+ * bit per channel, as written by `sigrok-cli -O binary'.
+ *
+ * The serial output is decoded as 9600/8N1 frames. Every byte is paired
+ * with the key presses since the previous byte, and its latency is
+ * measured from the last release of the key, i.e. the end of the last
+ * element of the character. Given the keying speed, the latency is
+ * compared to the one expected from the firmware timing: the character
+ * is sent 2 units after the release is debounced, and the space between
+ * words 5 units after. The debounce time is that of the firmware, which
+ * depends on the speed when built with FAST_PRESETS, unless given.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#include "host-decoder.h"
+
+#define BAUD_RATE 9600
+#define BIT_TIME (1.0 / BAUD_RATE)  // in seconds
+
+/* Transitions of one channel. */
+typedef struct {
+    bool initial;   // level before the first transition
+    double *times;  // in seconds
+    size_t count, capacity;
+} channel_t;
+
+static channel_t key, tx;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: analyze-capture [options] capture.vcd\n"
+        "       analyze-capture -r rate [options] capture.bin\n"
+        "Options:\n"
+        "  -k chan  key channel: name in a VCD file (default: PB4),\n"
+        "           bit number in a binary file (default: 0)\n"
+        "  -t chan  serial output channel (default: PB2, or 1)\n"
+        "  -r rate  sample rate of a binary file, in Hz\n"
+        "  -w wpm   keying speed, to compare the latencies with the "
+            "expected ones\n"
+        "  -d ms    debounce time (default: as the firmware at that speed)"
+            "\n");
+    exit(EXIT_FAILURE);
+}
+
+static void add_transition(channel_t *c, double t)
+{
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? 2 * c->capacity : 1024;
+        c->times = realloc(c->times, c->capacity * sizeof *c->times);
+        if (!c->times) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->times[c->count++] = t;
+}
+
+/* Level of the channel right after transition i. */
+static bool level_after(const channel_t *c, size_t i)
+{
+    return c->initial ^ !(i & 1);
+}
+
+/* Level of the channel after all the transitions so far. */
+static bool current_level(const channel_t *c)
+{
+    return c->count ? level_after(c, c->count - 1) : c->initial;
+}
+
+
+/***********************************************************************
+ * Reading the captures.
+ */
+
+/* Read the tokens of a VCD section up to $end. Returns their number. */
+static int read_section(FILE *f, char tokens[][64], int max)
+{
+    char token[64];
+    int n = 0;
+    while (fscanf(f, "%63s", token) == 1 && strcmp(token, "$end") != 0)
+        if (n < max)
+            strcpy(tokens[n++], token);
+    return n;
+}
+
+/*
+ * Read a VCD file. The file is read as a sequence of whitespace
+ * separated tokens, as a timestamp and several value changes may share
+ * a line. Only the scalar value changes of the two channels are used.
+ * Returns false on error.
+ */
+static bool read_vcd(FILE *f, const char *key_name, const char *tx_name)
+{
+    char token[64], tokens[5][64], key_id[64] = "", tx_id[64] = "";
+    double timescale = 1e-9, t = 0;
+    bool key_set = false, tx_set = false;
+    while (fscanf(f, "%63s", token) == 1) {
+        if (strcmp(token, "$timescale") == 0) {
+            int n = read_section(f, tokens, 2);
+            char unit[8];
+            double value;
+            if ((n == 2 && sscanf(tokens[0], "%lf", &value) == 1
+                        && sscanf(tokens[1], "%7s", unit) == 1)
+                    || (n == 1 && sscanf(tokens[0], "%lf%7s", &value, unit)
+                        == 2)) {
+                static const char *units[] = {"s", "ms", "us", "ns", "ps",
+                        "fs"};
+                for (int i = 0; i < 6; i++)
+                    if (strcmp(unit, units[i]) == 0)
+                        timescale = value * pow(1e-3, i);
+            }
+        } else if (strcmp(token, "$var") == 0) {
+            // $var type size id name [range] $end
+            if (read_section(f, tokens, 5) >= 4
+                    && strcmp(tokens[1], "1") == 0) {
+                if (strcmp(tokens[3], key_name) == 0)
+                    strcpy(key_id, tokens[2]);
+                if (strcmp(tokens[3], tx_name) == 0)
+                    strcpy(tx_id, tokens[2]);
+            }
+        } else if (strcmp(token, "$dumpvars") == 0
+                || strcmp(token, "$dumpall") == 0
+                || strcmp(token, "$dumpon") == 0
+                || strcmp(token, "$dumpoff") == 0
+                || strcmp(token, "$end") == 0) {
+            continue;  // the value changes they hold are read as usual
+        } else if (token[0] == '$') {
+            read_section(f, tokens, 0);  // $comment, $date, $scope...
+        } else if (token[0] == '#') {
+            t = strtod(token + 1, NULL) * timescale;
+        } else if (token[0] == 'b' || token[0] == 'B' || token[0] == 'r'
+                || token[0] == 'R') {
+            if (fscanf(f, "%63s", token) != 1)  // vector: skip its id
+                break;
+        } else if (token[0] == '0' || token[0] == '1') {
+            bool level = token[0] == '1';
+            channel_t *c = strcmp(token + 1, key_id) == 0 ? &key
+                    : strcmp(token + 1, tx_id) == 0 ? &tx : NULL;
+            if (!c)
+                continue;
+            bool *set = c == &key ? &key_set : &tx_set;
+            if (!*set) {  // initial value
+                c->initial = level;
+                *set = true;
+            } else if (level != current_level(c)) {
+                add_transition(c, t);
+            }
+        }
+    }
+    if (!key_id[0] || !tx_id[0]) {
+        fprintf(stderr, "Channel %s not found in the VCD file.\n",
+                key_id[0] ? tx_name : key_name);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Scan a binary capture, one byte per sample. The samples where
+ * neither channel changes are skipped 64 bytes at a time, with SSE2
+ * when available.
+ */
+static void read_binary(const uint8_t *p, size_t n, double rate,
+        int key_bit, int tx_bit)
+{
+    uint8_t mask = 1 << key_bit | 1 << tx_bit;
+    uint8_t previous = p[0] & mask;
+    key.initial = previous >> key_bit & 1;
+    tx.initial = previous >> tx_bit & 1;
+    size_t i = 1;
+    while (i < n) {
+#ifdef __SSE2__
+        __m128i m = _mm_set1_epi8(mask), fill = _mm_set1_epi8(previous);
+        for (; i + 64 <= n; i += 64) {
+            const __m128i *q = (const __m128i *) (p + i);
+            __m128i same = _mm_and_si128(
+                    _mm_and_si128(
+                        _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128(q), m),
+                            fill),
+                        _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128(q + 1),
+                            m), fill)),
+                    _mm_and_si128(
+                        _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128(q + 2),
+                            m), fill),
+                        _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128(q + 3),
+                            m), fill)));
+            if (_mm_movemask_epi8(same) != 0xffff)
+                break;
+        }
+#endif
+        /* Look for the changes in the next block, sample by sample. */
+        size_t end = i + 64 < n ? i + 64 : n;
+        for (; i < end; i++) {
+            uint8_t sample = p[i] & mask;
+            uint8_t changes = sample ^ previous;
+            if (!changes)
+                continue;
+            if (changes >> key_bit & 1)
+                add_transition(&key, i / rate);
+            if (changes >> tx_bit & 1)
+                add_transition(&tx, i / rate);
+            previous = sample;
+        }
+    }
+}
+
+
+/***********************************************************************
+ * Analysis.
+ */
+
+/* Statistics of a series of values. */
+typedef struct {
+    unsigned long n;
+    double sum, sum2, min, max;
+} stats_t;
+
+static void stats_add(stats_t *s, double x)
+{
+    if (s->n == 0 || x < s->min) s->min = x;
+    if (s->n == 0 || x > s->max) s->max = x;
+    s->n++;
+    s->sum += x;
+    s->sum2 += x * x;
+}
+
+static void stats_print(const char *name, const stats_t *s, double scale,
+        const char *unit)
+{
+    if (!s->n) {
+        fprintf(stderr, "%-22s -\n", name);
+        return;
+    }
+    double mean = s->sum / s->n;
+    double sd = sqrt(fmax(s->sum2 / s->n - mean * mean, 0));
+    fprintf(stderr, "%-22s n = %-8lu mean %9.3f  sd %8.3f  min %9.3f  "
+            "max %9.3f %s\n", name, s->n, mean * scale, sd * scale,
+            s->min * scale, s->max * scale, unit);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *key_name = NULL, *tx_name = NULL;
+    double sample_rate = 0, rate = 0, debounce = 0;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "k:t:r:w:d:")) != -1) {
+        switch (opt) {
+            case 'k': key_name = optarg; break;
+            case 't': tx_name = optarg; break;
+            case 'r': sample_rate = atof(optarg); break;
+            case 'w': rate = atof(optarg); break;
+            case 'd': debounce = atof(optarg) * 1e-3; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || sample_rate < 0 || debounce < 0
+            || (rate && !decoder_rate_valid(rate)))
+        usage();
+    if (!debounce)
+        debounce = (rate ? DEBOUNCE_TIME_FOR(DOT_TIME(rate))
+                : DEBOUNCE_TIME) / TIC_FREQ;
+    const char *file_name = argv[optind];
+
+    /* Read the capture. */
+    if (sample_rate) {
+        int key_bit = key_name ? atoi(key_name) : 0;
+        int tx_bit = tx_name ? atoi(tx_name) : 1;
+        if (key_bit < 0 || key_bit > 7 || tx_bit < 0 || tx_bit > 7
+                || key_bit == tx_bit)
+            usage();
+        int fd = open(file_name, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(file_name);
+            return EXIT_FAILURE;
+        }
+        if (st.st_size == 0)
+            return EXIT_SUCCESS;
+        const uint8_t *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                fd, 0);
+        if (p == MAP_FAILED) {
+            perror(file_name);
+            return EXIT_FAILURE;
+        }
+        madvise((void *) p, st.st_size, MADV_SEQUENTIAL);
+        read_binary(p, st.st_size, sample_rate, key_bit, tx_bit);
+    } else {
+        FILE *f = fopen(file_name, "r");
+        if (!f) {
+            perror(file_name);
+            return EXIT_FAILURE;
+        }
+        if (!read_vcd(f, key_name ? key_name : "PB4",
+                tx_name ? tx_name : "PB2"))
+            return EXIT_FAILURE;
+        fclose(f);
+    }
+
+    /*
+     * Key: the line is low when the key is down. A release followed by
+     * a press within the debounce time is a bounce.
+     */
+    stats_t bounces = {0}, marks = {0};
+    unsigned long glitches = 0;
+    for (size_t i = 0; i < key.count; i++) {
+        bool press = !level_after(&key, i);
+        double next = i + 1 < key.count ? key.times[i+1] : INFINITY;
+        double length = next - key.times[i];
+        if (!press && length < debounce)
+            stats_add(&bounces, length);
+        if (press && isfinite(length)) {
+            stats_add(&marks, length);
+            if (length < debounce)
+                glitches++;
+        }
+    }
+
+    /*
+     * Serial output. Every frame starts with a falling edge while the
+     * line is idle. The bits are sampled in their middle, and the
+     * transitions within the frame are compared to the ideal bit
+     * boundaries.
+     */
+    printf("# time       char  presses  latency_ms  excess_ms\n");
+    stats_t latency_char = {0}, latency_space = {0}, excess = {0};
+    stats_t bit_error = {0};
+    double sum_kt = 0, sum_kk = 0;  // for the bit time estimate
+    unsigned long frames = 0, framing_errors = 0;
+    size_t k = 0;                   // next key transition
+    size_t presses = 0;
+    double last_release = NAN;
+    double u = rate ? DOT_TIME(rate) / TIC_FREQ : 0;
+    for (size_t i = 0; i < tx.count; ) {
+        if (level_after(&tx, i)) {  // not a start bit
+            i++;
+            continue;
+        }
+        double start = tx.times[i];
+        int byte = 0;
+        size_t j = i;
+        bool level = false;
+        for (int bit = 0; bit < 10; bit++) {
+            double middle = start + (bit + 0.5) * BIT_TIME;
+            while (j + 1 < tx.count && tx.times[j+1] <= middle) {
+                j++;
+                level = level_after(&tx, j);
+                double offset = tx.times[j] - start;
+                double n = round(offset / BIT_TIME);
+                stats_add(&bit_error, offset - n * BIT_TIME);
+                sum_kt += n * offset;
+                sum_kk += n * n;
+            }
+            if (bit >= 1 && bit <= 8)
+                byte |= level << (bit - 1);
+            else if (level != (bit == 9))
+                goto framing_error;
+        }
+        frames++;
+
+        /* Pair it with the key presses since the previous byte. */
+        while (k < key.count && key.times[k] < start) {
+            bool press = !level_after(&key, k);
+            double next = k + 1 < key.count ? key.times[k+1] : INFINITY;
+            if (press && (k == 0 || key.times[k] - key.times[k-1]
+                    >= debounce))  // not after a bounce
+                presses++;
+            else if (next - key.times[k] >= debounce)
+                last_release = key.times[k];
+            k++;
+        }
+        double latency = start - last_release;
+        printf("%-12.6f  %c   %7zu  %10.3f", start,
+                byte >= ' ' && byte < 127 ? byte : '?', presses,
+                latency * 1e3);
+        stats_add(byte == ' ' ? &latency_space : &latency_char, latency);
+        if (rate) {
+            double expected = debounce + (byte == ' ' ? 5 : 2) * u;
+            printf("  %9.3f", (latency - expected) * 1e3);
+            stats_add(&excess, latency - expected);
+        }
+        putchar('\n');
+        presses = 0;
+        i = j + 1;
+        continue;
+    framing_error:
+        framing_errors++;
+        i = j + 1;
+    }
+
+    /* Summary. */
+    fprintf(stderr, "key: %zu transitions, %lu presses shorter than the "
+            "debounce time\n", key.count, glitches);
+    stats_print("key marks", &marks, 1e3, "ms");
+    stats_print("key bounces", &bounces, 1e3, "ms");
+    fprintf(stderr, "serial: %lu frames, %lu framing errors\n", frames,
+            framing_errors);
+    stats_print("bit timing error", &bit_error, 1e6, "us");
+    if (sum_kk)
+        fprintf(stderr, "%-22s %.1f bauds (%+.2f%%)\n", "measured rate",
+                sum_kk / sum_kt, (sum_kk / sum_kt / BAUD_RATE - 1) * 100);
+    stats_print("latency, characters", &latency_char, 1e3, "ms");
+    stats_print("latency, spaces", &latency_space, 1e3, "ms");
+    if (rate)
+        stats_print("excess latency", &excess, 1e3, "ms");
+    return EXIT_SUCCESS;
+}
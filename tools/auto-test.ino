@@ -4,6 +4,24 @@
  * Connect to the ATtiny and see the diagnostic information sent to
  * the serial monitor at 9600/8N1.
  *
+ * With MEASUREMENT_MODE set to 1, this instead measures the latency and
+ * the error rate of the decoder while sweeping the keying speed around
+ * each preset, and prints them as tables. The measurement is set by the
+ * constants below:
+ *   SWEEP_SPAN      the speed goes from (1 - SWEEP_SPAN) to
+ *                   (1 + SWEEP_SPAN) times the preset...
+ *   SWEEP_STEP      ...by steps of SWEEP_STEP times the preset
+ *   JITTERS         the sweep is repeated for every jitter of this list:
+ *                   each duration is multiplied by a random factor in
+ *                   [1 - jitter, 1 + jitter]
+ *   CHARS_PER_STEP  random characters sent at every step
+ *
+ * With STREAMING_MODE set to 1, this plays key events streamed by the
+ * computer (see stream-trace.c), and reports what the ATtiny sends
+ * back. In this mode, the serial port is needed for talking to the
+ * computer, so PB2 is connected to pin 12 rather than to RX. This mode
+ * needs an ATmega328P-based Arduino, like the Uno.
+ *
  * Connections:
  *   Arduino  ATtiny
  *     GND --- GND
@@ -27,8 +45,36 @@ const uint8_t SPEED_SELECT_PINS[2] = {8, 9};
 const uint8_t KEY_PIN = 10;
 const uint8_t RESET_PIN = 11;
 
-/* Selectable keying rates. */
+/*
+ * Selectable keying rates. Set FAST_PRESETS to 1 for a firmware built
+ * with FAST_PRESETS.
+ */
+#define FAST_PRESETS 0
+#if FAST_PRESETS
+const uint8_t KEY_RATES[4] = {25, 35, 45, 60};
+#else
 const uint8_t KEY_RATES[4] = {5, 8, 12, 18};
+#endif
+
+/* Measurement mode, see above. */
+#define MEASUREMENT_MODE 0
+const float SWEEP_SPAN = 0.4;
+const float SWEEP_STEP = 0.1;
+const float JITTERS[] = {0.1};
+const int CHARS_PER_STEP = 20;
+
+/* Timing of the decoder, in its own tics of 1/9600 s. */
+const float TIC = 1e6 / 9600;         // in us
+const float FRAME_TICS = 9.5;         // until the RX interrupt
+
+/* Streaming mode. */
+#define STREAMING_MODE 0
+const uint32_t STREAM_BAUD_RATE = 500000;
+const uint8_t STREAM_RX_PIN = 12;     // PB4 of the Uno
+const uint32_t STREAM_LEAD = 100000;  // in us
+#define STREAM_QUEUE 128              // key events
+const uint8_t STREAM_CREDIT = 63;     // bytes, what the RX buffer holds
+#define STREAM_EDGES 64               // transitions of PB2
 
 /*
  * The ATtiny is controlled in an "open drain" mode, by grounding and
@@ -42,8 +88,17 @@ const uint8_t KEY_RATES[4] = {5, 8, 12, 18};
 #define FLOAT  INPUT
 #define openDrainWrite(pin, value) pinMode((pin), (value))
 
+#if STREAMING_MODE
+static void stream_setup();
+static void stream_loop();
+#endif
+
 void setup()
 {
+#if STREAMING_MODE
+    stream_setup();
+    return;
+#endif
     Serial.begin(9600);
     Serial.println();
     pinMode(0, INPUT_PULLUP);  // pullup on RX
@@ -90,8 +145,449 @@ static bool test(const raw_code_t *character, uint8_t dot_time)
     return true;
 }
 
+#if MEASUREMENT_MODE
+
+/* Debounce time, given the dot time of the preset, as in the firmware. */
+static uint16_t debounce_tics(uint16_t dot_tics)
+{
+#if FAST_PRESETS
+    return dot_tics >> 3;
+#else
+    (void) dot_tics;
+    return 96;
+#endif
+}
+
+/*
+ * Characters sent and not received yet, oldest first, with the time of
+ * their last release of the key.
+ */
+#define PENDING 8  // a power of two
+static struct {
+    char c;
+    uint32_t release;
+} pending[PENDING];
+static uint8_t pending_head, pending_tail;
+
+/* Results of the current step. */
+static struct {
+    uint32_t timeout;  // for a character to be received
+    uint16_t errors, timeouts, extra, received;
+    uint32_t latency_min, latency_max;
+    float latency_sum;
+} stats;
+
+/*
+ * Match the received bytes to the characters sent, oldest first, and
+ * count the characters that are no longer expected. A byte that comes
+ * while no character is pending is extra.
+ */
+static void check_received()
+{
+    uint32_t now = micros();
+    while (pending_tail != pending_head
+            && now - pending[pending_tail % PENDING].release
+                >= stats.timeout) {
+        stats.timeouts++;
+        pending_tail++;
+    }
+    while (Serial.available()) {
+        char c = Serial.read();
+        if (pending_tail == pending_head) {
+            stats.extra++;
+            continue;
+        }
+        uint8_t tail = pending_tail++ % PENDING;
+        if (c != pending[tail].c)
+            stats.errors++;
+        uint32_t latency = now - pending[tail].release;
+        stats.received++;
+        stats.latency_sum += latency;
+        if (latency < stats.latency_min) stats.latency_min = latency;
+        if (latency > stats.latency_max) stats.latency_max = latency;
+    }
+}
+
+/* Wait until micros() reaches `t', while checking the received bytes. */
+static void wait_until(uint32_t t)
+{
+    while ((int32_t) (micros() - t) < 0)
+        check_received();
+}
+
+/* Random factor in [1 - jitter, 1 + jitter]. */
+static float random_factor(float jitter)
+{
+    return 1 + jitter * random(-1000, 1001) / 1000.0;
+}
+
+/*
+ * Send a character in Morse, with a dot time in microseconds and random
+ * jitter, starting at time `t'. Returns the time of the last release.
+ */
+static uint32_t send_jittered(const char *code, float dot_time,
+        float jitter, uint32_t t)
+{
+    for (const char *p = code; *p; p++) {
+        wait_until(t);
+        openDrainWrite(KEY_PIN, GROUND);
+        t += (*p == '-' ? 3 : 1) * dot_time * random_factor(jitter);
+        wait_until(t);
+        openDrainWrite(KEY_PIN, FLOAT);
+        if (p[1])
+            t += dot_time * random_factor(jitter);  // interelement gap
+    }
+    return t;
+}
+
+/*
+ * Send random characters at the given keying rate, and print a line of
+ * the table: the number of characters sent, wrongly decoded, not
+ * decoded at all, and of extra bytes received, then the latency from
+ * the last release of the key to the reception of the byte, and the
+ * clock error of the decoder deduced from it.
+ *
+ * The characters are sent on their own schedule, whatever the decoder
+ * does, and the bytes received are matched to them as they come.
+ */
+static void measure(uint8_t preset, float key_rate, float jitter)
+{
+    float dot_time = 1.2e6 / key_rate;  // in us
+    uint16_t preset_dot_tics = 1.2 / preset * 9600;
+    float expected = (debounce_tics(preset_dot_tics) + 2 * preset_dot_tics
+            + FRAME_TICS)
+            * TIC;
+    stats = {};
+    stats.timeout = 2 * expected;
+    stats.latency_min = UINT32_MAX;
+    pending_head = pending_tail = 0;
+
+    while (Serial.read() != -1) ;
+    uint32_t t = micros() + 10 * dot_time;
+    uint32_t release = t;
+    for (int i = 0; i < CHARS_PER_STEP; i++) {
+        const raw_code_t *character = &raw_code[random(RAW_CODE_LENGTH)];
+        release = send_jittered(character->code, dot_time, jitter, t);
+        if ((uint8_t) (pending_head - pending_tail) == PENDING) {
+            stats.timeouts++;  // no room to wait for the oldest
+            pending_tail++;
+        }
+        pending[pending_head % PENDING].c = character->c;
+        pending[pending_head % PENDING].release = release;
+        pending_head++;
+        t = release + 3 * dot_time * random_factor(jitter);
+    }
+
+    /*
+     * The last characters either come or time out, before the word
+     * space does. That one is not counted.
+     */
+    wait_until(release + stats.timeout);
+    check_received();
+    delay(10 * dot_time / 1000);
+    while (Serial.read() != -1) ;
+
+    Serial.print(preset);
+    Serial.print(' ');
+    Serial.print(key_rate);
+    Serial.print(' ');
+    Serial.print(jitter);
+    Serial.print(' ');
+    Serial.print(CHARS_PER_STEP);
+    Serial.print(' ');
+    Serial.print(stats.errors);
+    Serial.print(' ');
+    Serial.print(stats.timeouts);
+    Serial.print(' ');
+    Serial.print(stats.extra);
+    if (stats.received) {
+        float mean = stats.latency_sum / stats.received;
+        Serial.print(' ');
+        Serial.print(stats.latency_min);
+        Serial.print(' ');
+        Serial.print(mean, 0);
+        Serial.print(' ');
+        Serial.print(stats.latency_max);
+        Serial.print(' ');
+        Serial.print(expected, 0);
+        Serial.print(' ');
+        Serial.print((expected / mean - 1) * 100);
+    } else {
+        Serial.print(" - - - - -");
+    }
+    Serial.println();
+}
+
+#endif
+
+#if STREAMING_MODE
+
+/*
+ * Streaming mode. The computer sends commands, one per line:
+ *   "S i"  select the speed i (0 to 3) and reset the ATtiny
+ *   "D n"  key down for n microseconds
+ *   "U n"  key up for n microseconds
+ *   "E"    end of the key events
+ * The key events are queued, and played back to back, the first one
+ * starting STREAM_LEAD after the reset. For flow control, the commands
+ * are only read from the serial port while there is room in the queue,
+ * the Arduino sends "+n" every time it has read n bytes, and the
+ * computer should never have more than STREAM_CREDIT bytes in flight,
+ * which is what the 64-byte RX buffer of Serial holds. When the queue
+ * runs dry, the key is released and "# end" is sent, or "# underrun"
+ * if it was before the "E" command: the events sent after that are
+ * ignored.
+ *
+ * The bytes sent by the ATtiny are reported as "time byte" lines, with
+ * the time of their start bit in microseconds since the start of the
+ * first event, as in the capture files of replay-serial.c. Other
+ * messages start with '#'.
+ *
+ * Timer 1 counts half microseconds. The key line is switched by its
+ * output compare interrupt, and the transitions of PB2 are timestamped
+ * by a pin change interrupt, then decoded in the main loop. Both
+ * interrupts are short, so the timing is accurate to a few
+ * microseconds. The key line is PB2 of the Uno (pin 10), and is
+ * switched through DDRB for speed.
+ */
+
+static uint32_t key_queue[STREAM_QUEUE];  // durations, bit 31: key down
+static volatile uint8_t key_head, key_tail;
+static volatile bool key_running;
+static uint32_t key_due;                  // end of the current event
+static uint32_t origin;                   // start of the first event
+static bool streaming;
+static bool stream_complete;              // "E" received
+
+static volatile uint32_t edge_time[STREAM_EDGES];
+static volatile uint8_t edge_level[STREAM_EDGES];
+static volatile uint8_t edge_head, edge_tail;
+
+static volatile uint16_t overflows;
+
+/* Timer 1 time, extended to 32 bits. Call with interrupts disabled. */
+static uint32_t ticks()
+{
+    uint16_t low = TCNT1, high = overflows;
+    if ((TIFR1 & _BV(TOV1)) && low < 0x8000)
+        high++;
+    return (uint32_t) high << 16 | low;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+    overflows++;
+}
+
+/* Start the key events that are due. */
+ISR(TIMER1_COMPB_vect)
+{
+    for (;;) {
+        while ((int32_t) (ticks() - key_due) >= 0) {
+            if (key_head == key_tail) {  // ran dry
+                DDRB &= ~_BV(2);
+                TIMSK1 &= ~_BV(OCIE1B);
+                key_running = false;
+                return;
+            }
+            uint32_t event = key_queue[key_tail % STREAM_QUEUE];
+            key_tail++;
+            if (event >> 31)
+                DDRB |= _BV(2);
+            else
+                DDRB &= ~_BV(2);
+            key_due += event & 0x7fffffff;
+        }
+        OCR1B = key_due;
+        if ((int32_t) (ticks() - key_due) < 0)
+            break;  // not missed while setting OCR1B
+    }
+}
+
+/* Timestamp the transitions of the ATtiny's serial output. */
+ISR(PCINT0_vect)
+{
+    uint32_t t = ticks();
+    uint8_t head = edge_head;
+    if ((uint8_t) (head - edge_tail) < STREAM_EDGES) {
+        edge_time[head % STREAM_EDGES] = t;
+        edge_level[head % STREAM_EDGES] = PINB >> 4 & 1;
+        edge_head = head + 1;
+    }
+}
+
+/* Serial receiver, working from the timestamped transitions. */
+static struct {
+    bool level, receiving;
+    uint32_t start;     // of the start bit being received
+    uint8_t bit_count;  // bits sampled so far, start bit included
+    uint16_t bits;      // sampled bits, LSB first
+} rx = {true, false, 0, 0, 0};
+
+/*
+ * Sample, in the middle of each bit, the bits due by time `t', and
+ * report the byte when the stop bit is reached. The bits last
+ * 2e6/9600 = 1250/6 ticks.
+ */
+static void rx_sample(uint32_t t)
+{
+    while (rx.receiving) {
+        uint32_t middle = rx.start + (2 * rx.bit_count + 1) * 625UL / 6;
+        if ((int32_t) (middle - t) > 0)
+            return;
+        rx.bits |= (uint16_t) rx.level << rx.bit_count;
+        if (++rx.bit_count == 10) {
+            rx.receiving = false;
+            if ((rx.bits & 1) == 0 && (rx.bits & 0x200)) {
+                Serial.print((int32_t) (rx.start - origin) / 2);
+                Serial.print(' ');
+                Serial.println(rx.bits >> 1 & 0xff);
+            } else {
+                Serial.println("# framing error");
+            }
+        }
+    }
+}
+
+static void rx_edge(uint32_t t, bool level)
+{
+    rx_sample(t);
+    rx.level = level;
+    if (!level && !rx.receiving) {  // start bit
+        rx.receiving = true;
+        rx.start = t;
+        rx.bit_count = 0;
+        rx.bits = 0;
+    }
+}
+
+/* Select a speed and reset the ATtiny, then wait for the key events. */
+static void stream_start(uint8_t rate_index)
+{
+    cli();
+    TIMSK1 &= ~_BV(OCIE1B);
+    key_head = key_tail = 0;
+    sei();
+    openDrainWrite(KEY_PIN, FLOAT);
+    openDrainWrite(SPEED_SELECT_PINS[0], rate_index&1 ? GROUND : FLOAT);
+    openDrainWrite(SPEED_SELECT_PINS[1], rate_index&2 ? GROUND : FLOAT);
+    openDrainWrite(RESET_PIN, GROUND);
+    delay(1);
+    openDrainWrite(RESET_PIN, FLOAT);
+    rx.receiving = false;
+    cli();
+    origin = key_due = ticks() + 2 * STREAM_LEAD;
+    OCR1B = key_due;
+    TIFR1 = _BV(OCF1B);
+    TIMSK1 |= _BV(OCIE1B);
+    key_running = true;
+    sei();
+    streaming = true;
+    stream_complete = false;
+    Serial.print("# ready ");
+    Serial.println(STREAM_CREDIT);
+}
+
+/* Execute a command line from the computer. */
+static void stream_command(const char *line)
+{
+    uint32_t n = strtoul(line + 1, NULL, 10);
+    switch (line[0]) {
+        case 'S':
+            if (n < 4)
+                stream_start(n);
+            break;
+        case 'E':
+            stream_complete = true;
+            break;
+        case 'D':
+        case 'U':
+            if (!streaming)
+                break;
+            if (n > 0x3fffffff)
+                n = 0x3fffffff;
+            if ((uint8_t) (key_head - key_tail) >= STREAM_QUEUE) {
+                Serial.println("# overflow");
+                break;
+            }
+            key_queue[key_head % STREAM_QUEUE] = 2 * n
+                    | (uint32_t) (line[0] == 'D') << 31;
+            key_head++;
+            break;
+    }
+}
+
+static void stream_setup()
+{
+    Serial.begin(STREAM_BAUD_RATE);
+    pinMode(STREAM_RX_PIN, INPUT_PULLUP);
+    cli();
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11);  // clock / 8: half microseconds
+    TIMSK1 = _BV(TOIE1);
+    PCMSK0 = _BV(PCINT4);
+    PCICR |= _BV(PCIE0);
+    sei();
+    Serial.println("# streaming mode");
+}
+
+static void stream_loop()
+{
+    static char line[16];
+    static uint8_t length;
+    static uint8_t read_count;  // bytes, since the last report
+
+    /* Commands, as long as the queue has room for one more event. */
+    while (Serial.available()
+            && (uint8_t) (key_head - key_tail) < STREAM_QUEUE) {
+        char c = Serial.read();
+        read_count++;
+        if (c == '\n') {
+            line[length] = '\0';
+            stream_command(line);
+            if (line[0] == 'S')
+                read_count = 0;  // the credit starts with "# ready"
+            length = 0;
+        } else if (length < sizeof line - 1) {
+            line[length++] = c;
+        }
+    }
+
+    cli();
+    bool running = key_running;
+    uint32_t now = ticks();
+    sei();
+
+    /* Output of the ATtiny. */
+    while (edge_tail != edge_head) {
+        uint8_t tail = edge_tail;
+        rx_edge(edge_time[tail % STREAM_EDGES],
+                edge_level[tail % STREAM_EDGES]);
+        edge_tail = tail + 1;
+    }
+    rx_sample(now);
+
+    /* Flow control, and the end once all the output is reported. */
+    if (read_count) {
+        Serial.print('+');
+        Serial.println(read_count);
+        read_count = 0;
+    }
+    if (streaming && !running) {
+        Serial.print(stream_complete ? "# end " : "# underrun ");
+        Serial.println((int32_t) (now - origin) / 2);
+        streaming = false;
+    }
+}
+
+#endif
+
 void loop()
 {
+#if STREAMING_MODE
+    stream_loop();
+    return;
+#endif
     static uint8_t rate_index = 0;
     uint8_t key_rate = KEY_RATES[rate_index];
     uint8_t dot_time = (1200 + key_rate/2) / key_rate;
@@ -113,6 +609,16 @@ void loop()
     openDrainWrite(RESET_PIN, FLOAT);
     delay(100 + 10*dot_time);  // wait for the invitation
 
+#if MEASUREMENT_MODE
+    Serial.println("# preset_wpm wpm jitter chars errors timeouts extra "
+            "latency_min_us latency_mean_us latency_max_us expected_us "
+            "clock_error_pct");
+    for (size_t j = 0; j < sizeof JITTERS / sizeof JITTERS[0]; j++)
+        for (float k = -SWEEP_SPAN; k <= SWEEP_SPAN + 0.001;
+                k += SWEEP_STEP)
+            measure(key_rate, key_rate * (1 + k), JITTERS[j]);
+    Serial.println();
+#else
     /* Send the whole code. */
     Serial.println("Sending all known characters:");
     Serial.flush();
@@ -140,6 +646,7 @@ void loop()
     }
     Serial.println();
     Serial.println();
+#endif
 
     /* Next time try a different keying rate. */
     rate_index = (rate_index + 1) % 4;
@@ -0,0 +1,229 @@
+/*
+ * Batch decoding of key durations, for processing long logs offline.
+ *
+ * The input is an array of the durations, in tics, of the successive
+ * key states: mark (key down), space, mark, space... The output is the
+ * same text host-decoder.h would produce, tic by tic, from the same key
+ * states. This works because, for a given keying rate, the state
+ * machines of the edge detector and the tokenizer reduce to a few
+ * comparisons of each duration with a fixed threshold:
+ *
+ *   - a space no longer than the debounce time is a bounce: it does not
+ *     separate the marks around it
+ *   - a mark is a dash if the tokenizer's SHORT timeout expires before
+ *     the release is reported, a debounce time later: mark > 2u - D
+ *   - a space ends the character if it exceeds the INTERELEMENT
+ *     timeout, started when the release was reported: space > 2u + D
+ *   - it also ends the word if it exceeds the INTERCHARACTER timeout,
+ *     3u later: space > 5u + D
+ *
+ * where u is the dot time and D is the debounce time, DEBOUNCE_TIME
+ * unless built with FAST_PRESETS. The code numbers are
+ * then built as in decode(), and translated to characters through a
+ * direct table.
+ *
+ * On x86 processors with BMI2, 32 durations are compared at a time with
+ * SSE2, giving bit masks of the dashes, the character ends and the word
+ * ends. The code numbers are built from these with pext: every element
+ * is given two bits, "10" for a dot and "01" for a dash (LSB first),
+ * and the unused bit of the dots is squeezed out. Otherwise, the
+ * durations are processed one pair at a time, without branches.
+ *
+ * This uses the definitions of host-decoder.h, which should be included
+ * first, directly or through another header.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#  define BATCH_SIMD
+#  include <immintrin.h>
+#endif
+
+/* All the codes of the built-in table are below this. */
+#define BATCH_TABLE_SIZE 1024
+
+typedef struct {
+    uint32_t dash;       // marks longer than this are dashes
+    uint32_t char_gap;   // spaces longer than this end the character
+    uint32_t word_gap;   // spaces longer than this end the word
+    uint32_t debounce;   // shorter spaces are bounces
+    const uint16_t *table;
+    char direct[BATCH_TABLE_SIZE];  // code number -> character
+
+    /* Character being received. */
+    uint16_t code, bitmask;
+} batch_decoder_t;
+
+static inline void batch_init(batch_decoder_t *b, float rate,
+        const uint16_t *table)
+{
+    uint32_t u = DOT_TIME(rate), d = DEBOUNCE_TIME_FOR(u);
+    b->debounce = d;
+    b->dash = 2*u > d ? 2*u - d : 0;
+    b->char_gap = 2*u + d;
+    b->word_gap = 5*u + d;
+    b->table = table;
+    for (int code = 0; code < BATCH_TABLE_SIZE; code++)
+        b->direct[code] = lookup_code(table, code);
+    b->code = 0;
+    b->bitmask = 1;
+}
+
+/*
+ * Merge the marks separated by bounces, i.e. spaces no longer than
+ * `debounce', in place. `count' should be even. Returns the new count.
+ */
+static inline size_t batch_debounce(uint32_t *durations, size_t count,
+        uint32_t debounce)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count; i += 2) {
+        if (n && durations[n-1] <= debounce) {
+            durations[n-2] += durations[n-1] + durations[i];
+            durations[n-1] = durations[i+1];
+        } else {
+            durations[n++] = durations[i];
+            durations[n++] = durations[i+1];
+        }
+    }
+    return n;
+}
+
+/*
+ * Decoding state, kept in local variables during a batch: as the output
+ * is written through a char pointer, which may alias anything, keeping
+ * it in the batch_decoder_t would force reloading it after every store.
+ */
+typedef struct {
+    uint16_t code, bitmask;
+} batch_state_t;
+
+/*
+ * Decode a pair of durations (mark, space), given whether the mark is a
+ * dash, the space ends the character, and it ends the word. Branch
+ * free: the output pointer advances by the number of characters
+ * written.
+ */
+static inline char *batch_element(const batch_decoder_t *b,
+        batch_state_t *s, char *out, unsigned dash, unsigned end,
+        unsigned word)
+{
+    s->code |= (uint16_t) (s->bitmask << dash);
+    s->bitmask <<= 1 + dash;
+    *out = s->code < BATCH_TABLE_SIZE ? b->direct[s->code]
+            : lookup_code(b->table, s->code);
+    out += end;
+    *out = ' ';
+    out += word;
+    uint16_t keep = end - 1;  // all ones if the character goes on
+    s->code &= keep;
+    s->bitmask = (s->bitmask & keep) | end;
+    return out;
+}
+
+/* Scalar version of batch_decode(). */
+static inline size_t batch_decode_scalar(batch_decoder_t *b,
+        const uint32_t *durations, size_t count, char *out)
+{
+    batch_state_t s = {b->code, b->bitmask};
+    char *p = out;
+    for (size_t i = 0; i + 1 < count; i += 2)
+        p = batch_element(b, &s, p, durations[i] > b->dash,
+                durations[i+1] > b->char_gap,
+                durations[i+1] > b->word_gap);
+    b->code = s.code;
+    b->bitmask = s.bitmask;
+    return p - out;
+}
+
+#ifdef BATCH_SIMD
+/* SSE2 and BMI2 version of batch_decode(). */
+__attribute__((target("sse2,popcnt,bmi2")))
+static inline size_t batch_decode_simd(batch_decoder_t *b,
+        const uint32_t *durations, size_t count, char *out)
+{
+    /*
+     * The comparisons are signed, hence the bias. Even lanes hold
+     * marks, odd lanes spaces: the first threshold vector classifies
+     * both, the second one only the spaces.
+     */
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i classify = _mm_xor_si128(_mm_setr_epi32(b->dash,
+            b->char_gap, b->dash, b->char_gap), bias);
+    const __m128i words = _mm_xor_si128(_mm_setr_epi32(UINT32_MAX,
+            b->word_gap, UINT32_MAX, b->word_gap), bias);
+
+    /*
+     * Partial code of the character being received, and its length in
+     * bits. The bits beyond the 16th are lost, as in decode().
+     */
+    uint32_t partial = b->code;
+    int length = b->bitmask ? __builtin_ctz(b->bitmask) : 16;
+
+    char *p = out;
+    size_t i;
+    for (i = 0; i + 32 <= count; i += 32) {
+        uint32_t long_mask = 0, word_mask = 0;
+        for (int k = 0; k < 8; k++) {
+            __m128i x = _mm_xor_si128(_mm_loadu_si128(
+                    (const __m128i *) (durations + i) + k), bias);
+            long_mask |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmpgt_epi32(x, classify))) << 4*k;
+            word_mask |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmpgt_epi32(x, words))) << 4*k;
+        }
+
+        /* Bit stream of the 16 elements, as decode() would build it. */
+        uint32_t dashes = long_mask & 0x55555555;
+        uint32_t ends = long_mask & 0xaaaaaaaa;
+        uint32_t used = 0x55555555 | dashes << 1;
+        uint64_t stream = _pext_u32((~long_mask & 0x55555555)
+                | dashes << 1, used);
+
+        /* Cut it at the character ends. */
+        int start = 0;
+        while (ends) {
+            int bit = __builtin_ctz(ends);
+            ends &= ends - 1;
+            int end = __builtin_popcount(used & ((2ULL << bit) - 1));
+            uint64_t bits = stream >> start & ((1ULL << (end - start)) - 1);
+            uint16_t code = partial | bits << length;
+            *p++ = code < BATCH_TABLE_SIZE ? b->direct[code]
+                    : lookup_code(b->table, code);
+            *p = ' ';
+            p += word_mask >> bit & 1;
+            partial = length = 0;
+            start = end;
+        }
+        if (length < 16)
+            partial = (partial | (stream >> start) << length) & 0xffff;
+        length += __builtin_popcount(used) - start;
+        if (length > 16)
+            length = 16;
+    }
+    b->code = partial;
+    b->bitmask = length < 16 ? 1 << length : 0;
+    return (p - out) + batch_decode_scalar(b, durations + i, count - i, p);
+}
+#endif
+
+/*
+ * Decode debounced durations, starting with a mark. `count' should be
+ * even. The output buffer should have room for `count' characters.
+ * Returns the number of characters written. A character that is not
+ * finished at the end is continued by the next call.
+ */
+static inline size_t batch_decode(batch_decoder_t *b,
+        const uint32_t *durations, size_t count, char *out)
+{
+#ifdef BATCH_SIMD
+    if (__builtin_cpu_supports("bmi2"))
+        return batch_decode_simd(b, durations, count, out);
+#endif
+    return batch_decode_scalar(b, durations, count, out);
+}
@@ -0,0 +1,1162 @@
+/*
+ * Microbenchmarks of the host port of the decoder and of the front end.
+ *
+ * Every stage of the pipeline is timed on its own, on precomputed
+ * inputs, for a few workloads with different event distributions. The
+ * alternative implementations of the edge detector and of the code
+ * lookup are timed alongside the ones used by the firmware, and the
+ * channel pool is compared to plain malloc(). The batch decoder is
+ * timed on the durations of the key states, and the filter bank and
+ * channels of the front end on an IQ stream at a realistic rate, to
+ * tell how many channels a core can decode. Optionally, the hardware
+ * performance counters are read around every run.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "raw-morse-code.h"
+#include "channel-pool.h"
+#include "batch-decoder.h"
+#include "random.h"
+#include "perf-counters.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 4096  // front end block, in samples
+#define IQ_RATE 2000000  // of the IQ stream, in samples per second
+#define IQ_SECONDS 0.5
+#define IQ_SIGNALS 16    // keyed carriers in the IQ stream
+#define IQ_CHANNELS 256  // decoded from it
+#define FIXED_THRESHOLD 0.15f  // envelope threshold of channel_fixed
+
+/*
+ * A workload is a key state stream, together with the intermediate
+ * results of the pipeline, so that every stage can be fed its own
+ * input.
+ */
+typedef struct {
+    const char *name;
+    const char *text;      // sent repeatedly
+    double jitter;         // relative std. dev. of the durations
+    double seconds;        // total duration
+
+    /* Inputs of the stages, one per tic. */
+    bool *keys;
+    edge_t *edges;
+    symbol_t *symbols;
+    size_t tics;
+
+    /* Inputs of code_to_char(). */
+    uint16_t *codes;
+    size_t code_count;
+
+    /* Input of the batch decoder: debounced key durations. */
+    uint32_t *durations;
+    size_t duration_count;
+
+    /* Characters output by the decoder, including spaces. */
+    size_t characters;
+
+    /* Input of the front end: the keyed tone. */
+    float *re, *im;
+    size_t samples;
+} workload_t;
+
+static workload_t workloads[] = {
+    /* Key up all the time: the decoder sees only NO_EDGE. */
+    {.name = "idle", .text = "", .seconds = 10},
+
+    /* Ordinary text, with a slightly irregular fist. */
+    {.name = "text", .text = "CQ CQ DE F4XYZ F4XYZ K "
+        "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 ",
+        .jitter = 0.1, .seconds = 60},
+
+    /*
+     * Worst case: '$' is the longest code, and 'Z' is the last entry
+     * of the table. No word gaps.
+     */
+    {.name = "worst", .text = "$Z", .seconds = 60}
+};
+#define WORKLOAD_COUNT (sizeof workloads / sizeof workloads[0])
+
+/* Keying speed, in words per minute. */
+static float rate = 18;
+
+static random_t rng;
+
+/* Written to, so that the compiler does not optimize the work away. */
+static volatile unsigned sink;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: benchmark [options] [name...]\n"
+        "Options:\n"
+        "  -w wpm   keying speed (default: 18)\n"
+        "  -m time  minimum time per benchmark, in seconds "
+            "(default: 0.5)\n"
+        "  -s seed  random seed (default: 1)\n"
+        "  -c       read the hardware performance counters\n"
+        "  -C       same, and report them per decoded character\n"
+        "Only the benchmarks whose name starts with one of the given\n"
+        "names are run.\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *allocate(size_t size)
+{
+    void *p = malloc(size);
+    if (!p) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+
+/***********************************************************************
+ * Workload generation.
+ */
+
+/* Append `units' time units of the given key state, with jitter. */
+static void key(workload_t *w, bool down, double units, size_t max)
+{
+    double unit = DOT_TIME(rate);
+    double factor = 1 + w->jitter * random_normal(&rng);
+    if (factor < 0.1) factor = 0.1;
+    size_t tics = units * unit * factor + 0.5;
+    for (size_t i = 0; i < tics && w->tics < max; i++)
+        w->keys[w->tics++] = down;
+}
+
+/* Generate the key stream, then run it through the pipeline. */
+static void make_workload(workload_t *w)
+{
+    size_t max = w->seconds * TIC_FREQ;
+    w->keys = allocate(max * sizeof *w->keys);
+    w->edges = allocate(max * sizeof *w->edges);
+    w->symbols = allocate(max * sizeof *w->symbols);
+    w->codes = allocate(max * sizeof *w->codes);
+
+    /* Key stream. */
+    w->tics = 0;
+    size_t length = strlen(w->text);
+    for (size_t k = 0; length && w->tics < max; k++) {
+        char c = w->text[k % length];
+        if (c == ' ') {
+            key(w, false, 4, max);  // plus the intercharacter gap
+            continue;
+        }
+        size_t i;
+        for (i = 0; i < RAW_CODE_LENGTH; i++)
+            if (raw_code[i].c == c) break;
+        for (const char *q = raw_code[i].code; *q; q++) {
+            key(w, true, *q == '-' ? 3 : 1, max);
+            key(w, false, q[1] ? 1 : 3, max);
+        }
+    }
+    while (w->tics < max)
+        w->keys[w->tics++] = false;
+
+    /* Durations, as (mark, space) pairs. */
+    w->durations = allocate((w->tics + 2) * sizeof *w->durations);
+    w->duration_count = 0;
+    for (size_t i = 0; i < w->tics; i++) {
+        bool mark = w->duration_count % 2 == 0;
+        if (w->keys[i] == mark)
+            w->durations[w->duration_count++] = 1;
+        else if (w->duration_count)
+            w->durations[w->duration_count-1]++;
+    }
+    if (w->duration_count % 2)
+        w->durations[w->duration_count++] = UINT32_MAX;
+    w->duration_count = batch_debounce(w->durations, w->duration_count,
+            DEBOUNCE_TIME_FOR(DOT_TIME(rate)));
+
+    /* Intermediate results of the pipeline. */
+    decoder_t d;
+    decoder_init(&d, rate);
+    w->code_count = w->characters = 0;
+    for (size_t i = 0; i < w->tics; i++) {
+        w->edges[i] = get_edge(&d, i, w->keys[i]);
+        w->symbols[i] = tokenize(&d, i, w->edges[i]);
+        if (w->symbols[i] == END_OF_CHAR)
+            w->codes[w->code_count++] = d.code;
+        if (decode(&d, w->symbols[i]))
+            w->characters++;
+    }
+
+    /*
+     * Audio: a 600 Hz tone with 5 ms edges and some noise, mixed to a
+     * complex signal so that the channel sees IQ input.
+     */
+    w->samples = w->tics * SAMPLE_RATE / TIC_FREQ;
+    w->re = allocate(w->samples * sizeof *w->re);
+    w->im = allocate(w->samples * sizeof *w->im);
+    float envelope = 0, step = 1 / (0.005f * SAMPLE_RATE);
+    for (size_t i = 0; i < w->samples; i++) {
+        bool down = w->keys[(size_t) (i * TIC_FREQ / SAMPLE_RATE)];
+        envelope += down ? step : -step;
+        if (envelope > 1) envelope = 1;
+        if (envelope < 0) envelope = 0;
+        double phase = 2 * M_PI * 600 * i / SAMPLE_RATE;
+        w->re[i] = 0.3 * envelope * cos(phase)
+                + 0.01 * random_normal(&rng);
+        w->im[i] = 0.3 * envelope * sin(phase)
+                + 0.01 * random_normal(&rng);
+    }
+}
+
+
+/***********************************************************************
+ * Alternative implementation of get_edge().
+ */
+
+/*
+ * Table-driven edge detector, without conditional branches. The table
+ * is indexed by the current state, the key state and whether the
+ * debounce timer has expired. Each entry gives the next state, the
+ * edge to return, and whether to restart the timer.
+ */
+#define EDGE(state, edge, restart) ((state) | (edge) << 2 | (restart) << 4)
+
+static const uint8_t edge_table[3][2][2] = {  // [state][key][expired]
+    [UP]       = {{EDGE(UP, NO_EDGE, 0), EDGE(UP, NO_EDGE, 0)},
+                  {EDGE(DOWN, FALL, 0), EDGE(DOWN, FALL, 0)}},
+    [DOWN]     = {{EDGE(BOUNCING, NO_EDGE, 1), EDGE(BOUNCING, NO_EDGE, 1)},
+                  {EDGE(DOWN, NO_EDGE, 0), EDGE(DOWN, NO_EDGE, 0)}},
+    [BOUNCING] = {{EDGE(BOUNCING, NO_EDGE, 0), EDGE(UP, RISE, 0)},
+                  {EDGE(DOWN, NO_EDGE, 0), EDGE(DOWN, NO_EDGE, 0)}}
+};
+
+static inline edge_t get_edge_table(decoder_t *d, uint16_t now,
+        bool key_down)
+{
+    uint8_t entry = edge_table[d->edge_state][key_down]
+            [expired(now, d->edge_timeout)];
+    d->edge_state = entry & 3;
+    d->edge_timeout = entry & 0x10 ? now + d->debounce : d->edge_timeout;
+    return entry >> 2 & 3;
+}
+
+
+/***********************************************************************
+ * Alternative implementations of code_to_char().
+ */
+
+/*
+ * Direct indexing: a table mapping every possible code number to its
+ * character. All the valid codes are below 1024, which makes this a
+ * 1 KiB table, versus 118 bytes for morse_code[].
+ */
+#define DIRECT_TABLE_SIZE 1024
+static char direct_table[DIRECT_TABLE_SIZE];
+
+static void init_direct_table(void)
+{
+    memset(direct_table, '#', sizeof direct_table);
+    for (int i = CODE_LENGTH - 1; i >= 0; i--)
+        if (morse_code[i] < DIRECT_TABLE_SIZE)
+            direct_table[morse_code[i]] = i ? ' ' + i : '_';
+}
+
+static inline char code_to_char_direct(uint16_t code)
+{
+    return code < DIRECT_TABLE_SIZE ? direct_table[code] : '#';
+}
+
+/* Binary search in a table sorted by code number. */
+static struct {
+    uint16_t code;
+    char c;
+} sorted_table[CODE_LENGTH];
+static size_t sorted_length;
+
+static int compare_codes(const void *a, const void *b)
+{
+    return *(const uint16_t *) a - *(const uint16_t *) b;
+}
+
+static void init_sorted_table(void)
+{
+    for (int i = 0; i < CODE_LENGTH; i++) {
+        if (i && !morse_code[i]) continue;  // unused entry
+        sorted_table[sorted_length].code = morse_code[i];
+        sorted_table[sorted_length].c = i ? ' ' + i : '_';
+        sorted_length++;
+    }
+    qsort(sorted_table, sorted_length, sizeof sorted_table[0],
+            compare_codes);
+}
+
+static inline char code_to_char_sorted(uint16_t code)
+{
+    size_t low = 0, high = sorted_length;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (sorted_table[mid].code < code)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low < sorted_length && sorted_table[low].code == code)
+        return sorted_table[low].c;
+    return '#';
+}
+
+
+/***********************************************************************
+ * Benchmarks. Each one processes a whole workload and returns the
+ * number of events processed, in the unit given by the table.
+ */
+
+static size_t bench_get_edge(const workload_t *w)
+{
+    decoder_t d;
+    decoder_init(&d, rate);
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->tics; i++)
+        sum += get_edge(&d, i, w->keys[i]);
+    sink = sum;
+    return w->tics;
+}
+
+static size_t bench_get_edge_table(const workload_t *w)
+{
+    decoder_t d;
+    decoder_init(&d, rate);
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->tics; i++)
+        sum += get_edge_table(&d, i, w->keys[i]);
+    sink = sum;
+    return w->tics;
+}
+
+static size_t bench_tokenize(const workload_t *w)
+{
+    decoder_t d;
+    decoder_init(&d, rate);
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->tics; i++)
+        sum += tokenize(&d, i, w->edges[i]);
+    sink = sum;
+    return w->tics;
+}
+
+static size_t bench_decode(const workload_t *w)
+{
+    decoder_t d;
+    decoder_init(&d, rate);
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->tics; i++)
+        sum += decode(&d, w->symbols[i]);
+    sink = sum;
+    return w->tics;
+}
+
+static size_t bench_decoder_step(const workload_t *w)
+{
+    decoder_t d;
+    decoder_init(&d, rate);
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->tics; i++)
+        sum += decoder_step(&d, i, w->keys[i]);
+    sink = sum;
+    return w->tics;
+}
+
+static size_t bench_code_to_char(const workload_t *w)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->code_count; i++)
+        sum += code_to_char(w->codes[i]);
+    sink = sum;
+    return w->code_count;
+}
+
+static size_t bench_code_to_char_direct(const workload_t *w)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->code_count; i++)
+        sum += code_to_char_direct(w->codes[i]);
+    sink = sum;
+    return w->code_count;
+}
+
+static size_t bench_code_to_char_sorted(const workload_t *w)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->code_count; i++)
+        sum += code_to_char_sorted(w->codes[i]);
+    sink = sum;
+    return w->code_count;
+}
+
+/* Batch decoding, timed per duration. */
+static size_t run_batch(const workload_t *w, size_t (*decode_batch)(
+        batch_decoder_t *, const uint32_t *, size_t, char *))
+{
+    static batch_decoder_t b;
+    static char *text;
+    static size_t text_size;
+    if (text_size < w->duration_count) {
+        char *p = realloc(text, w->duration_count);
+        if (!p) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        text = p;
+        text_size = w->duration_count;
+    }
+    if (!b.table)
+        batch_init(&b, rate, morse_code);  // once: it fills a table
+    b.code = 0;
+    b.bitmask = 1;
+    sink = decode_batch(&b, w->durations, w->duration_count, text);
+    return w->duration_count;
+}
+
+static size_t bench_batch_scalar(const workload_t *w)
+{
+    return run_batch(w, batch_decode_scalar);
+}
+
+static size_t bench_batch_decode(const workload_t *w)
+{
+    return run_batch(w, batch_decode);
+}
+
+/* Filter bank for the workload audio. */
+static filter_bank_t bank;
+
+static size_t bench_filter_bank(const workload_t *w)
+{
+    float sum = 0;
+    for (size_t i = 0; i < w->samples; i += BLOCK_SIZE) {
+        size_t count = w->samples - i;
+        if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+        filter_bank_process(&bank, w->re + i, w->im + i, count);
+        sum += bank.out_re[0];
+    }
+    sink = sum;
+    return w->samples;
+}
+
+/*
+ * Run a channel on the workload audio, block by block. This includes
+ * the filter bank, as a single channel has nothing to share it with.
+ */
+static size_t run_channel(const workload_t *w, float threshold,
+        float afc_range)
+{
+    static channel_t ch;
+    static char text[BLOCK_SIZE];
+    channel_init(&ch, &bank, 600, 100, afc_range, threshold, rate);
+    unsigned sum = 0;
+    for (size_t i = 0; i < w->samples; i += BLOCK_SIZE) {
+        size_t count = w->samples - i;
+        if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+        filter_bank_process(&bank, w->re + i, w->im + i, count);
+        sum += channel_process(&ch, &bank, text);
+    }
+    sink = sum;
+    return w->samples;
+}
+
+static size_t bench_channel_fixed(const workload_t *w)
+{
+    return run_channel(w, FIXED_THRESHOLD, 0);
+}
+
+static size_t bench_channel_adaptive(const workload_t *w)
+{
+    return run_channel(w, 0, 0);
+}
+
+static size_t bench_channel_afc(const workload_t *w)
+{
+    return run_channel(w, 0, 100);
+}
+
+/* The blanker works in place: copy every block before blanking it. */
+static size_t bench_noise_blank(const workload_t *w)
+{
+    static float re[BLOCK_SIZE], im[BLOCK_SIZE];
+    blanker_t nb;
+    blanker_init(&nb, 20, SAMPLE_RATE);
+    for (size_t i = 0; i < w->samples; i += BLOCK_SIZE) {
+        size_t count = w->samples - i;
+        if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+        memcpy(re, w->re + i, count * sizeof *re);
+        memcpy(im, w->im + i, count * sizeof *im);
+        noise_blank(&nb, re, im, count);
+    }
+    sink = nb.blanked;
+    return w->samples;
+}
+
+/*
+ * Effect of the blanker on the decoded text. Clicks, 20 dB above the
+ * tone and decaying exponentially, are added to the audio of a
+ * workload, together with white noise, for an SNR of about 20 dB in
+ * 2500 Hz. This is decoded with and without the blanker, and the result
+ * is compared to the text decoded from the key stream. The error rate
+ * without clicks is given for reference. The same is done at 40 dB SNR,
+ * where the tone itself is far above the noise floor and must not be
+ * blanked.
+ */
+#define IMPULSE_RATE   10    // per second
+#define IMPULSE_LEVEL  3.0f
+#define NOISE_LEVEL    0.1f  // rms, of re and im
+#define QUIET_LEVEL    0.01f // rms, for the 40 dB SNR case
+#define BLANKER_FACTOR 20
+
+/* Levenshtein distance between two strings. */
+static size_t edit_distance(const char *a, size_t m, const char *b, size_t n)
+{
+    size_t *row = allocate((n + 1) * sizeof *row);
+    for (size_t j = 0; j <= n; j++)
+        row[j] = j;
+    for (size_t i = 1; i <= m; i++) {
+        size_t diagonal = row[0];
+        row[0] = i;
+        for (size_t j = 1; j <= n; j++) {
+            size_t above = row[j];
+            size_t best = diagonal + (a[i-1] != b[j-1]);
+            if (above + 1 < best) best = above + 1;
+            if (row[j-1] + 1 < best) best = row[j-1] + 1;
+            row[j] = best;
+            diagonal = above;
+        }
+    }
+    size_t distance = row[n];
+    free(row);
+    return distance;
+}
+
+/*
+ * Add noise of the given rms level and clicks with the given time
+ * constant, in seconds, to the audio of a workload, decode it with one
+ * channel and the given blanker factor, and return the character error
+ * rate, in percent.
+ */
+static double blanked_error_rate(const workload_t *w, float noise_level,
+        float time_constant, float factor, const char *reference,
+        size_t reference_length)
+{
+    float *audio_re = allocate(w->samples * sizeof *audio_re);
+    float *audio_im = allocate(w->samples * sizeof *audio_im);
+    random_t r;
+    random_init(&r, 1);
+    for (size_t i = 0; i < w->samples; i++) {
+        audio_re[i] = w->re[i] + noise_level * random_normal(&r);
+        audio_im[i] = w->im[i] + noise_level * random_normal(&r);
+    }
+    if (time_constant) {
+        float decay = expf(-1 / (time_constant * SAMPLE_RATE));
+        for (size_t i = 0; i < w->samples; i++) {
+            if (random_uniform(&r) >= (double) IMPULSE_RATE / SAMPLE_RATE)
+                continue;
+            float a = IMPULSE_LEVEL * (random_u64(&r) & 1 ? 1 : -1);
+            for (size_t j = i; j < w->samples && fabsf(a) > 0.001f; j++) {
+                audio_re[j] += a;
+                a *= decay;
+            }
+        }
+    }
+
+    static float re[BLOCK_SIZE], im[BLOCK_SIZE];
+    filter_bank_t fb;
+    if (!filter_bank_init(&fb, SAMPLE_RATE, BLOCK_SIZE)) {
+        perror("filter_bank_init");
+        exit(EXIT_FAILURE);
+    }
+    blanker_t nb;
+    blanker_init(&nb, factor, SAMPLE_RATE);
+    channel_t ch;
+    channel_init(&ch, &fb, 600, 100, 0, 0, rate);
+    char *text = allocate(w->samples);
+    size_t length = 0;
+    for (size_t i = 0; i < w->samples; i += BLOCK_SIZE) {
+        size_t count = w->samples - i;
+        if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+        memcpy(re, audio_re + i, count * sizeof *re);
+        memcpy(im, audio_im + i, count * sizeof *im);
+        noise_blank(&nb, re, im, count);
+        filter_bank_process(&fb, re, im, count);
+        length += channel_process(&ch, &fb, text + length);
+    }
+    double rate_percent = 100.0 * edit_distance(reference, reference_length,
+            text, length) / reference_length;
+    filter_bank_free(&fb);
+    free(audio_re);
+    free(audio_im);
+    free(text);
+    return rate_percent;
+}
+
+static void report_blanker(const workload_t *w)
+{
+    char *reference = allocate(w->tics + 1);
+    size_t reference_length = 0;
+    decoder_t d;
+    decoder_init(&d, rate);
+    for (size_t i = 0; i < w->tics; i++) {
+        char c = decoder_step(&d, i, w->keys[i]);
+        if (c)
+            reference[reference_length++] = c;
+    }
+
+    const float noise_levels[] = {NOISE_LEVEL, QUIET_LEVEL};
+    const float time_constants[] = {50e-6, 200e-6};
+    for (int n = 0; n < 2; n++) {
+        float noise = noise_levels[n];
+        printf("Character error rate, %s workload, %d clicks/s, "
+                "%.0f dB SNR:\n", w->name, IMPULSE_RATE,
+                20 * log10f(NOISE_LEVEL / noise) + 20);
+        printf("  no clicks:     %5.1f %% not blanked, "
+                "%5.1f %% blanked (factor %d)\n",
+                blanked_error_rate(w, noise, 0, 0, reference,
+                reference_length),
+                blanked_error_rate(w, noise, 0, BLANKER_FACTOR, reference,
+                reference_length), BLANKER_FACTOR);
+        for (int k = 0; k < 2; k++) {
+            float t = time_constants[k];
+            printf("  %3.0f us clicks: %5.1f %% not blanked, "
+                    "%5.1f %% blanked (factor %d)\n", t * 1e6,
+                    blanked_error_rate(w, noise, t, 0, reference,
+                    reference_length),
+                    blanked_error_rate(w, noise, t, BLANKER_FACTOR,
+                    reference, reference_length), BLANKER_FACTOR);
+        }
+    }
+    free(reference);
+}
+
+
+/*
+ * Effect of fading on the envelope threshold. The audio of a workload is
+ * faded as by make-cw-audio -q and -Q, white noise is added as above,
+ * and the key state of one channel, with a fixed or adaptive threshold,
+ * is compared to the key stream. A mark of the key stream is missed if
+ * no mark of the channel overlaps it, or if the channel merges it with
+ * the next one. Every extra mark of the channel, spurious or splitting a
+ * mark of the key stream, makes two false edges.
+ */
+typedef struct {
+    size_t start, end;  // in tics
+} mark_t;
+
+/* Append the marks of a key stream, given one key state per tic. */
+static size_t add_marks(mark_t *marks, size_t count, size_t tic, bool down,
+        bool *was_down)
+{
+    if (down && !*was_down)
+        marks[count++] = (mark_t) {tic, tic + 1};
+    else if (down)
+        marks[count-1].end = tic + 1;
+    *was_down = down;
+    return count;
+}
+
+/*
+ * Decode the faded audio with the given threshold, and store the missed
+ * marks and false edges, in percent of the marks and edges of the key
+ * stream.
+ */
+static void fading_errors(const workload_t *w, const mark_t *reference,
+        size_t reference_count, const float *re, const float *im,
+        float threshold, double *missed, double *false_edges)
+{
+    mark_t *marks = allocate(w->tics * sizeof *marks);
+    size_t count = 0;
+    bool was_down = false;
+
+    /*
+     * Feed the bank one step at a time, so that the key state can be
+     * read after every one or two tics.
+     */
+    filter_bank_t fb;
+    if (!filter_bank_init(&fb, SAMPLE_RATE, BLOCK_SIZE)) {
+        perror("filter_bank_init");
+        exit(EXIT_FAILURE);
+    }
+    channel_t ch;
+    channel_init(&ch, &fb, 600, 100, 0, threshold, rate);
+    static char text[BLOCK_SIZE];
+    size_t tic = 0;
+    for (size_t i = 0; i < w->samples; i += fb.step) {
+        size_t n = w->samples - i;
+        if (n > fb.step) n = fb.step;
+        filter_bank_process(&fb, re + i, im + i, n);
+        uint16_t before = ch.now;
+        channel_process(&ch, &fb, text);
+        for (uint16_t t = before; t != ch.now && tic < w->tics; t++)
+            count = add_marks(marks, count, tic++, ch.key_down, &was_down);
+    }
+    filter_bank_free(&fb);
+
+    /* Match the two lists of marks, both sorted by time. */
+    size_t misses = 0, extras = 0;
+    for (size_t i = 0, j = 0; i < reference_count; i++) {
+        const mark_t *r = &reference[i];
+        while (j < count && marks[j].end <= r->start)
+            j++;
+        size_t overlaps = 0;
+        for (size_t k = j; k < count && marks[k].start < r->end; k++)
+            overlaps++;
+        if (overlaps == 0)
+            misses++;
+        else
+            extras += overlaps - 1;
+    }
+    for (size_t j = 0, i = 0; j < count; j++) {
+        const mark_t *m = &marks[j];
+        while (i < reference_count && reference[i].end <= m->start)
+            i++;
+        size_t overlaps = 0;
+        for (size_t k = i; k < reference_count
+                && reference[k].start < m->end; k++)
+            overlaps++;
+        if (overlaps == 0)
+            extras++;
+        else
+            misses += overlaps - 1;
+    }
+    free(marks);
+    *missed = 100.0 * misses / reference_count;
+    *false_edges = 100.0 * extras / reference_count;
+}
+
+static void report_fading(const workload_t *w)
+{
+    mark_t *reference = allocate(w->tics * sizeof *reference);
+    size_t reference_count = 0;
+    bool was_down = false;
+    for (size_t i = 0; i < w->tics; i++)
+        reference_count = add_marks(reference, reference_count, i,
+                w->keys[i], &was_down);
+
+    static const struct {
+        float period, depth;  // as make-cw-audio -q and -Q
+    } profiles[] = {{0, 0}, {10, 0.9}, {5, 0.99}, {2, 0.99}};
+    float *re = allocate(w->samples * sizeof *re);
+    float *im = allocate(w->samples * sizeof *im);
+    printf("Missed marks and false edges, %s workload, %.0f wpm:\n",
+            w->name, rate);
+    printf("  %-17s %17s %17s\n", "fading", "fixed threshold",
+            "adaptive");
+    for (size_t k = 0; k < sizeof profiles / sizeof profiles[0]; k++) {
+        random_t r;
+        random_init(&r, 1);
+        for (size_t i = 0; i < w->samples; i++) {
+            float gain = 1;
+            if (profiles[k].period)
+                gain -= profiles[k].depth / 2 * (1 + cosf(2 * M_PI * i
+                        / (profiles[k].period * SAMPLE_RATE)));
+            re[i] = gain * w->re[i] + NOISE_LEVEL * random_normal(&r);
+            im[i] = gain * w->im[i] + NOISE_LEVEL * random_normal(&r);
+        }
+        if (profiles[k].period)
+            printf("  %4.0f s, %4.1f dB  ", profiles[k].period,
+                    20 * log10f(1 - profiles[k].depth));
+        else
+            printf("  %-17s ", "none");
+        const float thresholds[] = {FIXED_THRESHOLD, 0};
+        for (int t = 0; t < 2; t++) {
+            double missed, false_edges;
+            fading_errors(w, reference, reference_count, re, im,
+                    thresholds[t], &missed, &false_edges);
+            printf(" %6.1f %% %6.1f %%", missed, false_edges);
+        }
+        putchar('\n');
+    }
+    free(re);
+    free(im);
+    free(reference);
+}
+
+/***********************************************************************
+ * Channel allocation. Carriers come and go: every operation of the
+ * "churn" benchmarks frees a random channel and allocates a new one.
+ * The "sweep" benchmarks run all the channels on a few blocks, either
+ * from the pool or from channels scattered in the heap by malloc().
+ */
+
+#define POOL_CHANNELS 32
+#define CHURN_OPERATIONS 100000
+#define SWEEP_BLOCKS 16
+
+static channel_pool_t pool;
+static channel_t *scattered[POOL_CHANNELS];
+static channel_t prototype;  // copied into the new channels
+
+static void init_channels(void)
+{
+    if (!filter_bank_init(&bank, SAMPLE_RATE, BLOCK_SIZE)) {
+        perror("filter_bank_init");
+        exit(EXIT_FAILURE);
+    }
+    channel_init(&prototype, &bank, 600, 100, 0, 0, rate);
+    if (!channel_pool_init(&pool, POOL_CHANNELS)) {
+        perror("channel_pool_init");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < POOL_CHANNELS; i++) {
+        float frequency = 300 + 50 * i;
+        channel_init(channel_get(&pool, channel_alloc(&pool)),
+                &bank, frequency, 100, 0, 0, rate);
+
+        /* Spread the channels with unrelated allocations in between. */
+        scattered[i] = allocate(sizeof *scattered[i]);
+        allocate(1000 + random_u64(&rng) % 4000);
+        channel_init(scattered[i], &bank, frequency, 100, 0, 0, rate);
+    }
+}
+
+static size_t bench_pool_churn(const workload_t *w)
+{
+    (void) w;
+    random_t r;
+    random_init(&r, 1);
+    for (size_t i = 0; i < CHURN_OPERATIONS; i++) {
+        channel_free(&pool, pool.slot[random_u64(&r) % pool.count]);
+        *channel_get(&pool, channel_alloc(&pool)) = prototype;
+    }
+    return CHURN_OPERATIONS;
+}
+
+static size_t bench_malloc_churn(const workload_t *w)
+{
+    (void) w;
+    random_t r;
+    random_init(&r, 1);
+    for (size_t i = 0; i < CHURN_OPERATIONS; i++) {
+        size_t k = random_u64(&r) % POOL_CHANNELS;
+        free(scattered[k]);
+        scattered[k] = allocate(sizeof *scattered[k]);
+        *scattered[k] = prototype;
+    }
+    return CHURN_OPERATIONS;
+}
+
+/*
+ * Process the first blocks of the workload on the given channels, with
+ * the filter bank run once per block.
+ */
+static size_t sweep(const workload_t *w, channel_t *channels,
+        channel_t **pointers)
+{
+    static char text[BLOCK_SIZE];
+    unsigned sum = 0;
+    size_t samples = 0;
+    for (size_t i = 0; i < SWEEP_BLOCKS * BLOCK_SIZE
+            && i + BLOCK_SIZE <= w->samples; i += BLOCK_SIZE) {
+        filter_bank_process(&bank, w->re + i, w->im + i, BLOCK_SIZE);
+        for (int k = 0; k < POOL_CHANNELS; k++) {
+            channel_t *ch = channels ? &channels[k] : pointers[k];
+            sum += channel_process(ch, &bank, text);
+        }
+        samples += BLOCK_SIZE;
+    }
+    sink = sum;
+    return samples * POOL_CHANNELS;
+}
+
+static size_t bench_pool_sweep(const workload_t *w)
+{
+    return sweep(w, pool.channels, NULL);
+}
+
+static size_t bench_malloc_sweep(const workload_t *w)
+{
+    return sweep(w, NULL, scattered);
+}
+
+
+/***********************************************************************
+ * Capacity of the front end. An IQ stream of IQ_RATE samples per
+ * second carries IQ_SIGNALS carriers, keyed by the "text" workload, in
+ * white noise. The filter bank is timed on the stream, and IQ_CHANNELS
+ * channels, spread over the band, on the output of the bank, which is
+ * computed beforehand. The channels a core can decode in real time
+ * follow from these two times.
+ */
+
+static filter_bank_t iq_bank;
+static float *iq_re, *iq_im;
+static size_t iq_samples;
+static float *iq_out_re, *iq_out_im;  // all the outputs of iq_bank
+static size_t iq_steps;
+static channel_t iq_channels[IQ_CHANNELS];
+
+/* Measured times, in ns per sample and per channel-sample. */
+static double iq_bank_time = NAN, iq_channel_time = NAN;
+
+static void init_iq(const workload_t *w)
+{
+    iq_samples = IQ_SECONDS * IQ_RATE;
+    iq_re = allocate(iq_samples * sizeof *iq_re);
+    iq_im = allocate(iq_samples * sizeof *iq_im);
+    for (size_t i = 0; i < iq_samples; i++) {
+        iq_re[i] = 0.01 * random_normal(&rng);
+        iq_im[i] = 0.01 * random_normal(&rng);
+    }
+    for (int k = 0; k < IQ_SIGNALS; k++) {
+        double w0 = 2 * M_PI * (-0.4 + 0.05 * k) + 0.001 * k;
+        float osc_re = 1, osc_im = 0;
+        float rot_re = cos(w0), rot_im = sin(w0);
+        for (size_t i = 0; i < iq_samples; i++) {
+            size_t tic = (i * (uint64_t) TIC_FREQ / IQ_RATE + 1000 * k)
+                    % w->tics;
+            float a = w->keys[tic] ? 0.05 : 0;
+            iq_re[i] += a * osc_re;
+            iq_im[i] += a * osc_im;
+            float t = osc_re * rot_re - osc_im * rot_im;
+            osc_im = osc_re * rot_im + osc_im * rot_re;
+            osc_re = t;
+            if (i % 1024 == 0) {  // renormalize
+                float g = 1.5f - 0.5f * (osc_re*osc_re + osc_im*osc_im);
+                osc_re *= g;
+                osc_im *= g;
+            }
+        }
+    }
+
+    if (!filter_bank_init(&iq_bank, IQ_RATE, BLOCK_SIZE)) {
+        perror("filter_bank_init");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = iq_bank.size;
+    iq_out_re = allocate((iq_samples / iq_bank.step + 1) * size * sizeof(float));
+    iq_out_im = allocate((iq_samples / iq_bank.step + 1) * size * sizeof(float));
+    iq_steps = 0;
+    for (size_t i = 0; i < iq_samples; i += BLOCK_SIZE) {
+        size_t count = iq_samples - i;
+        if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+        filter_bank_process(&iq_bank, iq_re + i, iq_im + i, count);
+        memcpy(iq_out_re + iq_steps * size, iq_bank.out_re,
+                iq_bank.steps * size * sizeof(float));
+        memcpy(iq_out_im + iq_steps * size, iq_bank.out_im,
+                iq_bank.steps * size * sizeof(float));
+        iq_steps += iq_bank.steps;
+    }
+}
+
+static size_t bench_iq_filter_bank(const workload_t *w)
+{
+    (void) w;
+    float sum = 0;
+    for (size_t i = 0; i < iq_samples; i += BLOCK_SIZE) {
+        size_t count = iq_samples - i;
+        if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+        filter_bank_process(&iq_bank, iq_re + i, iq_im + i, count);
+        sum += iq_bank.out_re[0];
+    }
+    sink = sum;
+    return iq_samples;
+}
+
+/*
+ * Run the channels on the precomputed outputs of the bank, fed to them
+ * as if from blocks of BLOCK_SIZE samples.
+ */
+static size_t bench_iq_channels(const workload_t *w)
+{
+    (void) w;
+    static char text[BLOCK_SIZE];
+    for (int k = 0; k < IQ_CHANNELS; k++)
+        channel_init(&iq_channels[k], &iq_bank,
+                IQ_RATE * (-0.45 + 0.9 * k / IQ_CHANNELS), 100, 0, 0, rate);
+    filter_bank_t view = iq_bank;
+    size_t block_steps = BLOCK_SIZE / iq_bank.step;
+    unsigned sum = 0;
+    for (size_t j = 0; j < iq_steps; j += block_steps) {
+        view.out_re = iq_out_re + j * iq_bank.size;
+        view.out_im = iq_out_im + j * iq_bank.size;
+        view.steps = iq_steps - j;
+        if (view.steps > block_steps) view.steps = block_steps;
+        for (int k = 0; k < IQ_CHANNELS; k++)
+            sum += channel_process(&iq_channels[k], &view, text);
+    }
+    sink = sum;
+    return iq_samples * IQ_CHANNELS;
+}
+
+/*
+ * The benchmarks. Those that do not depend on the workload are only run
+ * with the one named in the table.
+ */
+static const struct {
+    const char *name;
+    size_t (*run)(const workload_t *w);
+    const char *unit;
+    const char *workload;  // NULL for all
+} benchmarks[] = {
+    {"get_edge",            bench_get_edge,            "tic", NULL},
+    {"get_edge_table",      bench_get_edge_table,      "tic", NULL},
+    {"tokenize",            bench_tokenize,            "tic", NULL},
+    {"decode",              bench_decode,              "tic", NULL},
+    {"decoder_step",        bench_decoder_step,        "tic", NULL},
+    {"code_to_char",        bench_code_to_char,        "char", NULL},
+    {"code_to_char_direct", bench_code_to_char_direct, "char", NULL},
+    {"code_to_char_sorted", bench_code_to_char_sorted, "char", NULL},
+    {"batch_scalar",        bench_batch_scalar,        "duration", NULL},
+    {"batch_decode",        bench_batch_decode,        "duration", NULL},
+    {"filter_bank",         bench_filter_bank,         "sample", NULL},
+    {"channel_fixed",       bench_channel_fixed,       "sample", NULL},
+    {"channel_adaptive",    bench_channel_adaptive,    "sample", NULL},
+    {"channel_afc",         bench_channel_afc,         "sample", NULL},
+    {"noise_blank",         bench_noise_blank,         "sample", NULL},
+    {"pool_churn",          bench_pool_churn,          "op", "text"},
+    {"malloc_churn",        bench_malloc_churn,        "op", "text"},
+    {"pool_sweep",          bench_pool_sweep,    "channel-sample", "text"},
+    {"malloc_sweep",        bench_malloc_sweep,  "channel-sample", "text"},
+    {"iq_filter_bank",      bench_iq_filter_bank,      "sample", "text"},
+    {"iq_channels",         bench_iq_channels,   "channel-sample", "text"}
+};
+#define BENCHMARK_COUNT (sizeof benchmarks / sizeof benchmarks[0])
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Whether a benchmark was selected on the command line. */
+static bool selected(const char *name, int argc, char *argv[])
+{
+    if (optind == argc)
+        return true;
+    for (int i = optind; i < argc; i++)
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+            return true;
+    return false;
+}
+
+/*
+ * Print one result line. The time and counts are divided by the number
+ * of events, or by the number of decoded characters if `per_char'.
+ */
+static void print_result(size_t i, const workload_t *w, double time,
+        size_t events, const perf_counters_t *pc, bool per_char)
+{
+    double n = pc && per_char ? w->characters : events;
+    if (!n) {
+        printf("%-20s %-6s %10s", benchmarks[i].name, w->name, "-");
+    } else {
+        printf("%-20s %-6s %10.3f", benchmarks[i].name, w->name,
+                time / n * 1e9);
+    }
+    if (pc) {
+        for (int k = 0; k < COUNTER_COUNT; k++) {
+            if (isnan(pc->value[k]) || !n)
+                printf(" %10s", "-");
+            else
+                printf(" %10.3f", pc->value[k] / n);
+        }
+    }
+    printf("  %s\n", pc && per_char ? "decoded char" : benchmarks[i].unit);
+}
+
+int main(int argc, char *argv[])
+{
+    double min_time = 0.5;
+    unsigned long seed = 1;
+    bool use_counters = false, per_char = false;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "w:m:s:cC")) != -1) {
+        switch (opt) {
+            case 'w': rate = atof(optarg); break;
+            case 'm': min_time = atof(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'C': per_char = true; /* fallthrough */
+            case 'c': use_counters = true; break;
+            default: usage();
+        }
+    }
+    if (!decoder_rate_valid(rate))
+        usage();
+
+    perf_counters_t counters, best_counters;
+    if (use_counters && counters_open(&counters) == 0)
+        fprintf(stderr, "No performance counters available.\n");
+
+    random_init(&rng, seed);
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+        make_workload(&workloads[i]);
+    init_direct_table();
+    init_sorted_table();
+    init_channels();
+    if (selected("iq_filter_bank", argc, argv)
+            || selected("iq_channels", argc, argv))
+        init_iq(&workloads[1]);
+
+    /*
+     * Run every benchmark on every workload repeatedly, for at least
+     * min_time, and keep the fastest run: the others were slowed down
+     * by something else. The counters are those of the fastest run.
+     */
+    printf("%-20s %-6s %10s", "benchmark", "input", "ns");
+    if (use_counters)
+        for (int k = 0; k < COUNTER_COUNT; k++)
+            printf(" %10s", counter_events[k].name);
+    printf("  %s\n", "per");
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        if (!selected(benchmarks[i].name, argc, argv))
+            continue;
+        for (size_t j = 0; j < WORKLOAD_COUNT; j++) {
+            const workload_t *w = &workloads[j];
+            if (benchmarks[i].workload
+                    && strcmp(benchmarks[i].workload, w->name) != 0)
+                continue;
+            double best = INFINITY, start = now();
+            size_t events = 0;
+            do {
+                if (use_counters) counters_start(&counters);
+                double t0 = now();
+                events = benchmarks[i].run(w);
+                double t = now() - t0;
+                if (use_counters) counters_stop(&counters);
+                if (t < best) {
+                    best = t;
+                    best_counters = counters;
+                }
+            } while (events && now() - start < min_time);
+            if (!events)
+                continue;  // nothing to measure in this workload
+            print_result(i, w, best, events,
+                    use_counters ? &best_counters : NULL, per_char);
+            if (benchmarks[i].run == bench_iq_filter_bank)
+                iq_bank_time = best / events * 1e9;
+            if (benchmarks[i].run == bench_iq_channels)
+                iq_channel_time = best / events * 1e9;
+        }
+    }
+
+    if (selected("noise_blank", argc, argv))
+        report_blanker(&workloads[1]);
+    if (selected("channel_fixed", argc, argv)
+            || selected("channel_adaptive", argc, argv))
+        report_fading(&workloads[1]);
+
+    /* Channels per core: what is left of a sample period after the bank. */
+    if (!isnan(iq_bank_time) && !isnan(iq_channel_time))
+        printf("At %.1f MS/s, a core runs the filter bank (%.0f %%) and "
+                "%.0f channels.\n", IQ_RATE * 1e-6,
+                iq_bank_time * IQ_RATE * 1e-7,
+                (1e9 / IQ_RATE - iq_bank_time) / iq_channel_time);
+
+    if (use_counters)
+        counters_close(&counters);
+    return EXIT_SUCCESS;
+}
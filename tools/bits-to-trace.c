@@ -0,0 +1,235 @@
+/*
+ * Convert a logic analyzer capture of the key line to a key trace.
+ *
+ * The capture is a raw stream of packed bits, one bit per sample, least
+ * significant bit first within each byte (or most significant first,
+ * with -m). The trace is written on the standard output, with the
+ * durations converted to tics. See key-trace.h for the format.
+ *
+ * At the sample rates of logic analyzers, the key line changes only a
+ * few times per million samples, so the conversion is all about
+ * skipping the long runs of identical bits quickly: 64 bytes at a time
+ * are compared to the current level with SSE2, when available, and the
+ * 64-bit words that do hold transitions are scanned with count trailing
+ * zeros, one transition at a time.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "key-trace.h"
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#define BUFFER_SIZE (1 << 20)  // in bytes, for reading from a pipe
+
+/* Settings. */
+static double sample_rate;
+static bool msb_first;
+static bool active_level;  // line level when the key is down
+
+/* State. */
+static trace_writer_t trace;
+static bool level;           // current line level
+static uint64_t last_tic;    // time of the last transition, in tics
+static unsigned long transitions;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: bits-to-trace -r rate [-m] [-p] [capture] > trace\n"
+        "Options:\n"
+        "  -r rate  sample rate, in Hz\n"
+        "  -m       most significant bit first\n"
+        "  -p       the key line is high when the key is down\n"
+        "The capture is read from the standard input if not given.\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * The line changed at sample `t': write the run that ended there. The
+ * times are rounded to tics before taking the difference, so that the
+ * rounding errors do not accumulate. Runs shorter than half a tic
+ * vanish, and the runs around them are merged.
+ */
+static void transition(uint64_t t)
+{
+    uint64_t tic = t * TIC_FREQ / sample_rate + 0.5;
+    if (tic > last_tic)
+        trace_key(&trace, level == active_level, tic - last_tic);
+    last_tic = tic;
+    level = !level;
+    transitions++;
+}
+
+/* Bit reversal of every byte of a word. */
+static uint64_t reverse_bytes(uint64_t x)
+{
+    x = (x >> 1 & 0x5555555555555555) | (x & 0x5555555555555555) << 1;
+    x = (x >> 2 & 0x3333333333333333) | (x & 0x3333333333333333) << 2;
+    x = (x >> 4 & 0x0f0f0f0f0f0f0f0f) | (x & 0x0f0f0f0f0f0f0f0f) << 4;
+    return x;
+}
+
+/*
+ * Process a 64-bit word of samples, starting at sample `t'. Bit k of
+ * `changes' is set if sample k differs from the previous one.
+ */
+static void process_word(uint64_t x, uint64_t t)
+{
+    if (msb_first)
+        x = reverse_bytes(x);
+    uint64_t changes = x ^ (x << 1 | level);
+    while (changes) {
+        transition(t + __builtin_ctzll(changes));
+        changes &= changes - 1;
+    }
+}
+
+/* Load a little-endian word. */
+static uint64_t load_word(const uint8_t *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof x);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+/*
+ * Process `n' bytes of samples, starting at sample `t'. Returns the
+ * number of samples processed.
+ */
+static uint64_t process(const uint8_t *p, size_t n, uint64_t t)
+{
+    size_t i = 0;
+    while (i + 64 <= n) {
+
+        /* Skip the blocks of 64 bytes with no transitions. */
+#ifdef __SSE2__
+        __m128i fill = _mm_set1_epi8(level ? 0xff : 0);
+        for (; i + 64 <= n; i += 64) {
+            const __m128i *q = (const __m128i *) (p + i);
+            __m128i diff = _mm_or_si128(
+                    _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(q), fill),
+                        _mm_xor_si128(_mm_loadu_si128(q + 1), fill)),
+                    _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(q + 2), fill),
+                        _mm_xor_si128(_mm_loadu_si128(q + 3), fill)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff,
+                    _mm_setzero_si128())) != 0xffff)
+                break;
+        }
+#else
+        uint64_t fill = level ? UINT64_MAX : 0;
+        for (; i + 64 <= n; i += 64) {
+            uint64_t diff = 0;
+            for (int k = 0; k < 64; k += 8)
+                diff |= load_word(p + i + k) ^ fill;
+            if (diff)
+                break;
+        }
+#endif
+        if (i + 64 > n)
+            break;
+
+        /* Scan the block that has transitions. */
+        for (int k = 0; k < 64; k += 8)
+            process_word(load_word(p + i + k), t + 8 * (i + k));
+        i += 64;
+    }
+
+    /* Remaining bytes. */
+    for (; i + 8 <= n; i += 8)
+        process_word(load_word(p + i), t + 8 * i);
+    for (; i < n; i++) {
+        bool last = msb_first ? p[i] & 1 : p[i] >> 7;  // repeated
+        uint64_t fill = last ? ~UINT64_C(0) << 8 : 0;
+        process_word(p[i] | (msb_first ? reverse_bytes(fill) : fill),
+                t + 8 * i);
+    }
+    return 8 * (uint64_t) n;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "r:mp")) != -1) {
+        switch (opt) {
+            case 'r': sample_rate = atof(optarg); break;
+            case 'm': msb_first = true; break;
+            case 'p': active_level = true; break;
+            default: usage();
+        }
+    }
+    if (optind < argc - 1 || sample_rate < TIC_FREQ)
+        usage();
+    int fd = STDIN_FILENO;
+    if (optind < argc) {
+        fd = open(argv[optind], O_RDONLY);
+        if (fd < 0) {
+            perror(argv[optind]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /*
+     * Process the capture: mapped in memory if it is a file, which
+     * saves copying it, otherwise read by blocks. The line level before
+     * the first sample is assumed to be the level of the first sample.
+     */
+    trace_init(&trace, stdout);
+    uint64_t samples = 0;
+    double start = now();
+    struct stat st;
+    const uint8_t *capture = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        capture = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (capture == MAP_FAILED)
+            capture = NULL;
+    }
+    if (capture) {
+        madvise((void *) capture, st.st_size, MADV_SEQUENTIAL);
+        level = msb_first ? capture[0] >> 7 : capture[0] & 1;
+        samples = process(capture, st.st_size, 0);
+    } else {
+        static uint8_t buffer[BUFFER_SIZE];
+        for (;;) {
+            ssize_t n = 0, count;
+            while (n < BUFFER_SIZE
+                    && (count = read(fd, buffer + n, BUFFER_SIZE - n)) > 0)
+                n += count;
+            if (n == 0)
+                break;
+            if (samples == 0)
+                level = msb_first ? buffer[0] >> 7 : buffer[0] & 1;
+            samples += process(buffer, n, samples);
+        }
+    }
+    transition(samples);  // end of the last run
+    transitions--;
+    trace_flush(&trace);
+    double elapsed = now() - start;
+
+    fprintf(stderr, "%" PRIu64 " samples (%.1f s), %lu transitions, "
+            "%.0f MB/s\n", samples, samples / sample_rate, transitions,
+            samples / 8 / elapsed * 1e-6);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/*
+ * Pool of channel contexts for the multi-channel front end.
+ *
+ * The channels are stored in a single array, allocated once, and the
+ * active ones are kept packed at its beginning, such that processing a
+ * block is a sweep over contiguous memory. Freeing a channel moves the
+ * last active one into its place. Channels are therefore identified by
+ * a "slot" number that does not change while the channel is active:
+ * pool->position[slot] gives its current index in the array, and
+ * pool->slot[index] goes the other way. The free slots are kept on a
+ * stack. Neither allocating nor freeing calls malloc().
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include "host-frontend.h"
+
+typedef struct {
+    channel_t *channels;  // active channels at [0, count)
+    uint32_t *slot;       // slot of each channel
+    uint32_t *position;   // index of the channel in each slot
+    uint32_t *free_slots; // stack of free slots
+    size_t count, capacity, free_count;
+
+    /* Statistics. */
+    unsigned long allocations, frees;
+} channel_pool_t;
+
+/* Allocate the storage for `capacity' channels. Returns false on error. */
+static inline bool channel_pool_init(channel_pool_t *pool, size_t capacity)
+{
+    *pool = (channel_pool_t) {
+        .channels = malloc(capacity * sizeof *pool->channels),
+        .slot = malloc(capacity * sizeof *pool->slot),
+        .position = malloc(capacity * sizeof *pool->position),
+        .free_slots = malloc(capacity * sizeof *pool->free_slots),
+        .capacity = capacity,
+        .free_count = capacity
+    };
+    if (!pool->channels || !pool->slot || !pool->position
+            || !pool->free_slots)
+        return false;
+
+    /* Hand out the low slots first. */
+    for (size_t i = 0; i < capacity; i++)
+        pool->free_slots[i] = capacity - 1 - i;
+    return true;
+}
+
+static inline void channel_pool_destroy(channel_pool_t *pool)
+{
+    free(pool->channels);
+    free(pool->slot);
+    free(pool->position);
+    free(pool->free_slots);
+}
+
+/*
+ * Allocate a channel. Returns its slot, or -1 if the pool is full. The
+ * channel is not initialized: see channel_init().
+ */
+static inline long channel_alloc(channel_pool_t *pool)
+{
+    if (!pool->free_count)
+        return -1;
+    uint32_t slot = pool->free_slots[--pool->free_count];
+    pool->slot[pool->count] = slot;
+    pool->position[slot] = pool->count++;
+    pool->allocations++;
+    return slot;
+}
+
+/* Channel in a given slot. Only valid until the next channel_free(). */
+static inline channel_t *channel_get(channel_pool_t *pool, uint32_t slot)
+{
+    return &pool->channels[pool->position[slot]];
+}
+
+/* Free the channel in the given slot. */
+static inline void channel_free(channel_pool_t *pool, uint32_t slot)
+{
+    uint32_t hole = pool->position[slot];
+    uint32_t last = --pool->count;
+    if (hole != last) {
+        pool->channels[hole] = pool->channels[last];
+        pool->slot[hole] = pool->slot[last];
+        pool->position[pool->slot[hole]] = hole;
+    }
+    pool->free_slots[pool->free_count++] = slot;
+    pool->frees++;
+}
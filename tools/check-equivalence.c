@@ -0,0 +1,423 @@
+/*
+ * Check that the firmware and the host port of the decoder are
+ * equivalent, by running the same key traces through both and
+ * comparing their outputs.
+ *
+ * The firmware runs in the simavr simulator (see sim-attiny.h), the
+ * host port is host-decoder.h. The traces are either given on the
+ * command line, or randomly generated. The random traces send random
+ * characters, with a mix of nominal durations and durations within a
+ * couple of tics of the decision thresholds of the edge detector and
+ * the tokenizer, which is where an off-by-one in the timing would show.
+ *
+ * The outputs are equivalent if they are the same characters, sent at
+ * the same times within a tolerance. The firmware starts sending a
+ * character on the tic after the one it decoded it, hence the
+ * tolerance. When a trace gives different outputs, it is minimized, by
+ * removing key events and rounding durations as long as the outputs
+ * still differ, and saved as a key trace file.
+ *
+ * The traces are distributed over worker processes, one per core by
+ * default, each with its own simulator.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "raw-morse-code.h"
+#include "key-trace.h"
+#include "host-decoder.h"
+#include "random.h"
+#include "sim-attiny.h"
+
+#define MAX_EVENTS 4096
+#define MAX_OUTPUT SIM_MAX_OUTPUT
+
+/* A key trace, as a sequence of key events alternating up and down. */
+typedef struct {
+    bool key_down[MAX_EVENTS];
+    uint32_t tics[MAX_EVENTS];
+    size_t length;
+} trace_t;
+
+/* Decoded output: characters and the tics at which they were sent. */
+typedef struct {
+    char c[MAX_OUTPUT];
+    uint32_t tic[MAX_OUTPUT];
+    size_t length;
+} output_t;
+
+/* Settings. */
+static const char *firmware = "../tiny-morse-decoder.elf";
+static int rate = KEY_RATE_2;
+static uint32_t tolerance = 2;    // in tics
+static int chars_per_trace = 20;
+static const char *prefix = "diverging-";
+
+static sim_t sim;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: check-equivalence [options] [trace...]\n"
+        "Options:\n"
+        "  -f file    firmware ELF file (default: "
+            "../tiny-morse-decoder.elf)\n"
+        "  -w wpm     keying speed: %d, %d, %d or %d (default: %d)\n"
+        "  -n count   number of random traces (default: 1000)\n"
+        "  -c chars   characters per random trace (default: 20)\n"
+        "  -s seed    random seed (default: 1)\n"
+        "  -t tics    timing tolerance (default: 2)\n"
+        "  -j jobs    worker processes (default: one per core)\n"
+        "  -o prefix  prefix of the diverging trace files "
+            "(default: diverging-)\n",
+        KEY_RATE_0, KEY_RATE_1, KEY_RATE_2, KEY_RATE_3, KEY_RATE_2);
+    exit(EXIT_FAILURE);
+}
+
+static void add_event(trace_t *t, bool key_down, uint32_t tics)
+{
+    if (tics == 0)
+        return;
+    if (t->length && t->key_down[t->length-1] == key_down)
+        t->tics[t->length-1] += tics;
+    else if (t->length < MAX_EVENTS) {
+        t->key_down[t->length] = key_down;
+        t->tics[t->length++] = tics;
+    }
+}
+
+/*
+ * Duration of a key event, in tics: the nominal one most of the time,
+ * otherwise within two tics of one of the given thresholds.
+ */
+static uint32_t duration(random_t *rng, uint32_t nominal,
+        const uint32_t *thresholds, int count)
+{
+    if (random_uniform(rng) < 0.7)
+        return nominal * (0.9 + 0.2 * random_uniform(rng));
+    uint32_t threshold = thresholds[random_u64(rng) % count];
+    return threshold - 2 + random_u64(rng) % 5;
+}
+
+/* Generate a random trace. */
+static void random_trace(trace_t *t, uint64_t seed)
+{
+    random_t rng;
+    random_init(&rng, seed);
+    uint32_t u = DOT_TIME(rate), d = DEBOUNCE_TIME_FOR(u);
+
+    /*
+     * The edge detector reports a release a debounce time after it
+     * happens. The tokenizer times the elements from the press to the
+     * reported release, and the gaps from the reported release.
+     */
+    const uint32_t mark_thresholds[] = {2*u - d};
+    const uint32_t space_thresholds[] = {d, 2*u + d, 5*u + d};
+
+    t->length = 0;
+    for (int i = 0; i < chars_per_trace; i++) {
+        const char *code = raw_code[random_u64(&rng) % RAW_CODE_LENGTH].code;
+        for (const char *p = code; *p; p++) {
+            add_event(t, true, duration(&rng, *p == '.' ? u : 3*u,
+                    mark_thresholds, 1));
+            uint32_t gap = p[1] ? u : random_uniform(&rng) < 0.8 ? 3*u : 7*u;
+            add_event(t, false, duration(&rng, gap, space_thresholds, 3));
+        }
+    }
+}
+
+/* Load a trace file. Returns false on error. */
+static bool load_trace(const char *file_name, trace_t *t)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f) {
+        perror(file_name);
+        return false;
+    }
+    trace_record_t r;
+    t->length = 0;
+    while (trace_read(f, &r))
+        if (r.type == KEY_EVENT)
+            add_event(t, r.key_down, r.tics);
+    fclose(f);
+    return true;
+}
+
+static void save_trace(const char *file_name, const trace_t *t,
+        const output_t *host, const output_t *firmware_output)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f) {
+        perror(file_name);
+        return;
+    }
+    fprintf(f, "# Diverging trace at %d wpm\n", rate);
+    fprintf(f, "# host:     %.*s\n", (int) host->length, host->c);
+    fprintf(f, "# firmware: %.*s\n", (int) firmware_output->length,
+            firmware_output->c);
+    trace_writer_t w;
+    trace_init(&w, f);
+    for (size_t i = 0; i < t->length; i++)
+        trace_key(&w, t->key_down[i], t->tics[i]);
+    trace_flush(&w);
+    fclose(f);
+}
+
+
+/***********************************************************************
+ * Running the trace through both implementations.
+ */
+
+/*
+ * Key up time before the trace, enough for the firmware to boot and
+ * send its invitation to transmit (-.-) at the slowest speed.
+ */
+static uint32_t warmup_tics(void)
+{
+    return 12 * DOT_TIME(KEY_RATE_0) + 100;
+}
+
+/* Key up time after the trace, for the last character and word. */
+static uint32_t flush_tics(void)
+{
+    return 8 * DOT_TIME(rate);
+}
+
+static void run_host(const trace_t *t, output_t *out)
+{
+    decoder_t d;
+    decoder_init(&d, rate);
+    uint16_t now = warmup_tics();  // same clock as the firmware
+    uint32_t tic = 0;
+    out->length = 0;
+    for (size_t i = 0; i <= t->length; i++) {
+        bool key_down = i < t->length && t->key_down[i];
+        uint32_t tics = i < t->length ? t->tics[i] : flush_tics();
+        while (tics--) {
+            char c = decoder_step(&d, now++, key_down);
+            if (c && out->length < MAX_OUTPUT) {
+                out->c[out->length] = c;
+                out->tic[out->length++] = tic;
+            }
+            tic++;
+        }
+    }
+}
+
+static bool run_firmware(const trace_t *t, output_t *out)
+{
+    sim_reset(&sim, rate);
+    if (!sim_run(&sim, false, warmup_tics()))
+        return false;
+    uint64_t start = sim.avr->cycle;
+    sim.output_length = 0;
+    for (size_t i = 0; i < t->length; i++)
+        if (!sim_run(&sim, t->key_down[i], t->tics[i]))
+            return false;
+    if (!sim_run(&sim, false, flush_tics()))
+        return false;
+    out->length = sim.output_length;
+    for (size_t i = 0; i < out->length; i++) {
+        out->c[i] = sim.output[i].c;
+        out->tic[i] = (sim.output[i].cycle - start) / SIM_CYCLES_PER_TIC;
+    }
+    return true;
+}
+
+/* Whether the firmware sent the same as the host, in time. */
+static bool equivalent(const output_t *host, const output_t *fw)
+{
+    if (host->length != fw->length)
+        return false;
+    for (size_t i = 0; i < host->length; i++)
+        if (host->c[i] != fw->c[i] || fw->tic[i] < host->tic[i]
+                || fw->tic[i] > host->tic[i] + tolerance)
+            return false;
+    return true;
+}
+
+/* Returns true if the trace gives diverging outputs. */
+static bool diverges(const trace_t *t, output_t *host, output_t *fw)
+{
+    run_host(t, host);
+    if (!run_firmware(t, fw))
+        exit(EXIT_FAILURE);
+    return !equivalent(host, fw);
+}
+
+
+/***********************************************************************
+ * Minimization.
+ */
+
+/*
+ * Remove events `start' to `start + count - 1' from a copy of the
+ * trace. The events around the removed ones are merged if needed.
+ */
+static void remove_events(const trace_t *t, size_t start, size_t count,
+        trace_t *out)
+{
+    out->length = 0;
+    for (size_t i = 0; i < t->length; i++)
+        if (i < start || i >= start + count)
+            add_event(out, t->key_down[i], t->tics[i]);
+}
+
+/*
+ * Shrink a diverging trace: try removing chunks of events, from large
+ * to small, then rounding the durations to a whole number of dots, and
+ * keep every change that preserves the divergence.
+ */
+static void minimize(trace_t *t)
+{
+    static trace_t candidate;
+    static output_t host, fw;
+    uint32_t u = DOT_TIME(rate);
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t chunk = t->length / 2; chunk >= 1; chunk /= 2) {
+            for (size_t start = 0; start + chunk <= t->length; ) {
+                remove_events(t, start, chunk, &candidate);
+                if (diverges(&candidate, &host, &fw)) {
+                    *t = candidate;
+                    progress = true;
+                } else {
+                    start += chunk;
+                }
+            }
+        }
+        for (size_t i = 0; i < t->length; i++) {
+            uint32_t rounded = (t->tics[i] + u/2) / u * u;
+            if (rounded == 0 || rounded == t->tics[i])
+                continue;
+            candidate = *t;
+            candidate.tics[i] = rounded;
+            if (diverges(&candidate, &host, &fw)) {
+                *t = candidate;
+                progress = true;
+            }
+        }
+    }
+}
+
+
+/***********************************************************************
+ * Main program.
+ */
+
+/*
+ * Check the traces number `worker', `worker + jobs', etc. Random traces
+ * if `files' is NULL. Writes the counts of checked and diverging
+ * traces to the pipe `fd'.
+ */
+static void work(int worker, int jobs, size_t count, char **files,
+        uint64_t seed, int fd)
+{
+    static trace_t t;
+    static output_t host, fw;
+    unsigned long counts[2] = {0, 0};  // checked, diverging
+    for (size_t i = worker; i < count; i += jobs) {
+        if (files) {
+            if (!load_trace(files[i], &t))
+                continue;
+        } else {
+            random_trace(&t, seed + i);
+        }
+        counts[0]++;
+        if (!diverges(&t, &host, &fw))
+            continue;
+        counts[1]++;
+        minimize(&t);
+        diverges(&t, &host, &fw);
+        char file_name[256];
+        snprintf(file_name, sizeof file_name, "%s%zu.trace", prefix, i);
+        save_trace(file_name, &t, &host, &fw);
+        fprintf(stderr, "trace %zu diverges: host \"%.*s\", firmware "
+                "\"%.*s\", saved as %s\n", i, (int) host.length, host.c,
+                (int) fw.length, fw.c, file_name);
+    }
+    if (write(fd, counts, sizeof counts) != sizeof counts)
+        perror("write");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = 1000;
+    uint64_t seed = 1;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "f:w:n:c:s:t:j:o:")) != -1) {
+        switch (opt) {
+            case 'f': firmware = optarg; break;
+            case 'w': rate = atoi(optarg); break;
+            case 'n': count = atol(optarg); break;
+            case 'c': chars_per_trace = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 't': tolerance = atol(optarg); break;
+            case 'j': jobs = atol(optarg); break;
+            case 'o': prefix = optarg; break;
+            default: usage();
+        }
+    }
+    if ((rate != KEY_RATE_0 && rate != KEY_RATE_1 && rate != KEY_RATE_2
+            && rate != KEY_RATE_3)
+            || chars_per_trace <= 0 || jobs <= 0)
+        usage();
+    char **files = NULL;
+    if (optind < argc) {
+        files = argv + optind;
+        count = argc - optind;
+    }
+    if ((size_t) jobs > count)
+        jobs = count ? count : 1;
+
+    /* Start the workers. */
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    for (int k = 0; k < jobs; k++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            if (!sim_open(&sim, firmware))
+                exit(EXIT_FAILURE);
+            work(k, jobs, count, files, seed, fds[1]);
+            sim_close(&sim);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    close(fds[1]);
+
+    /* Gather the results. */
+    unsigned long checked = 0, diverging = 0, counts[2];
+    while (read(fds[0], counts, sizeof counts) == sizeof counts) {
+        checked += counts[0];
+        diverging += counts[1];
+    }
+    int status, failed = 0;
+    while (wait(&status) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    fprintf(stderr, "%lu traces checked at %d wpm, %lu diverging\n",
+            checked, rate, diverging);
+    if (failed) {
+        fprintf(stderr, "%d workers failed.\n", failed);
+        return EXIT_FAILURE;
+    }
+    return diverging ? EXIT_FAILURE : EXIT_SUCCESS;
+}
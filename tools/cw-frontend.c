@@ -0,0 +1,403 @@
+/*
+ * Decode Morse from an audio or IQ recording.
+ *
+ * The recording is read from the standard input as raw samples. Each
+ * channel, given by its frequency, is decoded independently, and the
+ * decoded text is written to the standard output.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include "channel-pool.h"
+#include "trace-events.h"
+#include "metrics.h"
+
+#define MAX_CHANNELS 4096
+#define BLOCK_SIZE 4096     // in samples
+#define LINE_LENGTH 64      // of the multi-channel output
+#define LINE_SIZE (2*LINE_LENGTH + BLOCK_SIZE + 1)
+
+/* Input sample formats. */
+static const struct {
+    const char *name;
+    bool complex;   // IQ
+    bool floating;  // float32, otherwise int16
+} formats[] = {
+    {"s16",  false, false},
+    {"f32",  false, true },
+    {"cs16", true,  false},
+    {"cf32", true,  true }
+};
+#define FORMAT_COUNT (sizeof formats / sizeof formats[0])
+
+/* Set by SIGHUP, to reload the configuration file. */
+static volatile sig_atomic_t reload_requested;
+
+/* Channels, and their frequencies and output lines, indexed by slot. */
+static channel_pool_t pool;
+static float frequencies[MAX_CHANNELS];
+static char (*lines)[LINE_SIZE];
+static size_t line_lengths[MAX_CHANNELS];
+
+static blanker_t blanker;
+static filter_bank_t bank;
+
+/*
+ * Statistics for the metrics endpoint. The processing time of the
+ * blocks is kept as a histogram with the following bucket limits, in
+ * seconds.
+ */
+static const double latency_buckets[] = {
+    1e-5, 3e-5, 1e-4, 3e-4, 1e-3, 3e-3, 1e-2, 3e-2, 1e-1
+};
+#define LATENCY_BUCKET_COUNT \
+    (sizeof latency_buckets / sizeof latency_buckets[0])
+static struct {
+    unsigned long samples, blocks;
+    unsigned long latency_counts[LATENCY_BUCKET_COUNT];
+    double latency_sum;
+} stats;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: cw-frontend [options] -f frequency [-f frequency...]\n"
+        "Options:\n"
+        "  -r rate       input sample rate in Hz (default: 48000)\n"
+        "  -F format     s16, f32 (audio), cs16, cf32 (IQ); default: s16\n"
+        "  -f frequency  tone pitch or IQ offset of a channel, in Hz\n"
+        "  -b bandwidth  channel bandwidth in Hz (default: 100)\n"
+        "  -a range      frequency tracking range in Hz (default: 0 = off)\n"
+        "  -n factor     blank impulses above factor * median power "
+            "(default: 0 = off)\n"
+        "  -t threshold  fixed envelope threshold, full scale = 1 "
+            "(default: adaptive)\n"
+        "  -w wpm        keying speed in words per minute (default: 12)\n"
+        "  -c file       configuration file, reloaded on SIGHUP\n"
+        "  -m socket     serve metrics on a Unix domain socket\n"
+        "  -T file       write a Chrome trace of the processing "
+            "(needs make TRACE=1)\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Print the text decoded by the channel in slot `i'. With a single
+ * channel, the text is printed as is, like the output of the firmware.
+ * With many channels, the text is split in lines tagged by frequency. A
+ * line is printed once it is long enough and ends on a word boundary,
+ * once it is too long to wait for a word boundary, or when `flush' is
+ * true.
+ */
+static void print_text(size_t channel_count, size_t i,
+        const char *text, size_t length, bool flush)
+{
+    if (channel_count == 1) {
+        if (length)
+            fwrite(text, 1, length, stdout);
+        return;
+    }
+    if (length) {
+        memcpy(lines[i] + line_lengths[i], text, length);
+        line_lengths[i] += length;
+    }
+    size_t n = line_lengths[i];
+    if (n == 0)
+        return;
+    if (!flush && n < 2*LINE_LENGTH
+            && (n < LINE_LENGTH || lines[i][n-1] != ' '))
+        return;
+    lines[i][n] = '\0';
+    printf("%9.1f Hz: %s\n", frequencies[i], lines[i]);
+    line_lengths[i] = 0;
+}
+
+static void request_reload(int signum)
+{
+    (void) signum;
+    reload_requested = true;
+}
+
+/* Whether any channel still uses a configuration snapshot. */
+static bool config_in_use(const decoder_config_t *config)
+{
+    for (size_t i = 0; i < pool.count; i++)
+        if (pool.channels[i].config == config)
+            return true;
+    return false;
+}
+
+/*
+ * Load the configuration file and publish the new snapshot. On error,
+ * the current configuration is kept.
+ */
+static bool load_config(const char *file_name, float rate)
+{
+    decoder_config_t *config = config_load(file_name, rate);
+    if (!config)
+        return false;
+    config_publish(config);
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Write one metric of every channel. The slot is a label, as several
+ * channels may share a frequency.
+ */
+#define PER_CHANNEL(name, type, help, format, expression) do { \
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", \
+                name, help, name, type); \
+        for (size_t i = 0; i < pool.count; i++) { \
+            const channel_t *ch = &pool.channels[i]; \
+            uint32_t slot = pool.slot[i]; \
+            (void) ch; \
+            fprintf(f, "%s{slot=\"%" PRIu32 "\",frequency=\"%.1f\"} " \
+                    format "\n", name, slot, frequencies[slot], \
+                    expression); \
+        } \
+    } while (0)
+
+/* Write all the metrics, in the Prometheus text format. */
+static void write_metrics(FILE *f)
+{
+    unsigned long characters = 0, invalid = 0;
+    for (size_t i = 0; i < pool.count; i++) {
+        characters += pool.channels[i].characters;
+        invalid += pool.channels[i].invalid;
+    }
+    fprintf(f,
+        "# HELP cw_input_samples_total Input samples processed.\n"
+        "# TYPE cw_input_samples_total counter\n"
+        "cw_input_samples_total %lu\n"
+        "# HELP cw_blanked_samples_total Samples zeroed by the noise "
+            "blanker.\n"
+        "# TYPE cw_blanked_samples_total counter\n"
+        "cw_blanked_samples_total %zu\n"
+        "# HELP cw_channels Active channels.\n"
+        "# TYPE cw_channels gauge\n"
+        "cw_channels %zu\n"
+        "# HELP cw_characters_total Characters decoded, all channels.\n"
+        "# TYPE cw_characters_total counter\n"
+        "cw_characters_total %lu\n"
+        "# HELP cw_invalid_characters_total Characters decoded as '#', "
+            "all channels.\n"
+        "# TYPE cw_invalid_characters_total counter\n"
+        "cw_invalid_characters_total %lu\n",
+        stats.samples, blanker.blanked, pool.count, characters, invalid);
+
+    PER_CHANNEL("cw_channel_characters_total", "counter",
+            "Characters decoded, including spaces.", "%lu",
+            ch->characters);
+    PER_CHANNEL("cw_channel_invalid_characters_total", "counter",
+            "Characters decoded as '#'.", "%lu", ch->invalid);
+    PER_CHANNEL("cw_channel_wpm", "gauge",
+            "Estimated keying speed, in words per minute.", "%.1f",
+            channel_wpm(ch));
+    PER_CHANNEL("cw_channel_pending_characters", "gauge",
+            "Decoded characters waiting for a full output line.", "%zu",
+            line_lengths[slot]);
+
+    fprintf(f,
+        "# HELP cw_block_latency_seconds Time from reading a block to "
+            "printing its text.\n"
+        "# TYPE cw_block_latency_seconds histogram\n");
+    unsigned long cumulative = 0;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        cumulative += stats.latency_counts[i];
+        fprintf(f, "cw_block_latency_seconds_bucket{le=\"%g\"} %lu\n",
+                latency_buckets[i], cumulative);
+    }
+    fprintf(f,
+        "cw_block_latency_seconds_bucket{le=\"+Inf\"} %lu\n"
+        "cw_block_latency_seconds_sum %g\n"
+        "cw_block_latency_seconds_count %lu\n",
+        stats.blocks, stats.latency_sum, stats.blocks);
+}
+
+/* Account for the processing time of one block. */
+static void record_latency(double latency)
+{
+    stats.blocks++;
+    stats.latency_sum += latency;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        if (latency <= latency_buckets[i]) {
+            stats.latency_counts[i]++;
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t sample_rate = 48000;
+    size_t format = 0;
+    size_t channel_count = 0;
+    float bandwidth = 100, afc_range = 0, threshold = 0, rate = 12;
+    float blanker_factor = 0;
+    const char *trace_file = NULL;
+    const char *config_file = NULL;
+    const char *metrics_path = NULL;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "r:F:f:b:a:n:t:w:c:m:T:")) != -1) {
+        switch (opt) {
+            case 'r': sample_rate = atol(optarg); break;
+            case 'F':
+                for (format = 0; format < FORMAT_COUNT; format++)
+                    if (strcmp(optarg, formats[format].name) == 0) break;
+                if (format == FORMAT_COUNT) usage();
+                break;
+            case 'f':
+                if (channel_count == MAX_CHANNELS) {
+                    fprintf(stderr, "Too many channels.\n");
+                    return EXIT_FAILURE;
+                }
+                frequencies[channel_count++] = atof(optarg);
+                break;
+            case 'b': bandwidth = atof(optarg); break;
+            case 'a': afc_range = atof(optarg); break;
+            case 'n': blanker_factor = atof(optarg); break;
+            case 't': threshold = atof(optarg); break;
+            case 'w': rate = atof(optarg); break;
+            case 'c': config_file = optarg; break;
+            case 'm': metrics_path = optarg; break;
+            case 'T': trace_file = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc || channel_count == 0 || !decoder_rate_valid(rate)
+            || sample_rate < TIC_FREQ)
+        usage();
+
+    /* The channels pick up the configuration when initialized. */
+    if (config_file) {
+        if (!load_config(config_file, rate))
+            return EXIT_FAILURE;
+        signal(SIGHUP, request_reload);
+    }
+
+    static metrics_t metrics;
+    if (metrics_path && !metrics_open(&metrics, metrics_path))
+        return EXIT_FAILURE;
+
+    blanker_init(&blanker, blanker_factor, sample_rate);
+    lines = malloc(channel_count * sizeof *lines);
+    if (!lines || !filter_bank_init(&bank, sample_rate, BLOCK_SIZE)) {
+        perror("filter_bank_init");
+        return EXIT_FAILURE;
+    }
+    if (!channel_pool_init(&pool, MAX_CHANNELS)) {
+        perror("channel_pool_init");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < channel_count; i++) {
+        long slot = channel_alloc(&pool);
+        channel_init(channel_get(&pool, slot), &bank,
+                frequencies[i], bandwidth, afc_range, threshold, rate);
+    }
+
+    /* Process the input stream block by block. */
+    bool complex = formats[format].complex;
+    bool floating = formats[format].floating;
+    size_t frame_size = (complex ? 2 : 1) * (floating ? 4 : 2);
+    static unsigned char raw[BLOCK_SIZE * 8];
+    static float re[BLOCK_SIZE], im[BLOCK_SIZE];
+    static char text[BLOCK_SIZE];
+    size_t count;
+    for (;;) {
+        TRACE_BEGIN("read");
+        count = fread(raw, frame_size, BLOCK_SIZE, stdin);
+        TRACE_END("read");
+        if (count == 0)
+            break;
+        TRACE_COUNTER("input block", count);
+        double start = now();
+
+        /*
+         * Publish the new configuration, if requested. The channels
+         * switch to it at their next character boundary, and the old
+         * one is freed once they all have.
+         */
+        if (reload_requested) {
+            reload_requested = false;
+            if (load_config(config_file, rate))
+                fprintf(stderr, "Configuration reloaded.\n");
+        }
+        config_reclaim(config_in_use);
+
+        /* Convert to floating point, full scale = 1. */
+        TRACE_BEGIN("convert");
+        if (floating) {
+            const float *samples = (const float *) raw;
+            for (size_t j = 0; j < count; j++) {
+                re[j] = complex ? samples[2*j] : samples[j];
+                im[j] = complex ? samples[2*j+1] : 0;
+            }
+        } else {
+            const int16_t *samples = (const int16_t *) raw;
+            for (size_t j = 0; j < count; j++) {
+                re[j] = (complex ? samples[2*j] : samples[j]) / 32768.0f;
+                im[j] = complex ? samples[2*j+1] / 32768.0f : 0;
+            }
+        }
+        TRACE_END("convert");
+
+        TRACE_BEGIN("noise blank");
+        noise_blank(&blanker, re, im, count);
+        TRACE_END("noise blank");
+
+        TRACE_BEGIN("filter bank");
+        filter_bank_process(&bank, re, im, count);
+        TRACE_END("filter bank");
+
+        /* Decode every channel. */
+        size_t pending = 0;
+        for (size_t i = 0; i < pool.count; i++) {
+            uint32_t slot = pool.slot[i];
+            TRACE_BEGIN_N("channel", slot);
+            size_t length = channel_process(&pool.channels[i], &bank, text);
+            TRACE_END("channel");
+            TRACE_BEGIN("print");
+            print_text(channel_count, slot, text, length, false);
+            TRACE_END("print");
+            pending += line_lengths[slot];
+        }
+        TRACE_COUNTER("pending text", pending);
+
+        /* Serve the metrics between blocks. */
+        stats.samples += count;
+        if (metrics_path) {
+            record_latency(now() - start);
+            metrics_poll(&metrics, write_metrics);
+        }
+    }
+    for (size_t i = 0; i < channel_count; i++)
+        print_text(channel_count, i, NULL, 0, true);
+    if (channel_count == 1)
+        putchar('\n');
+    if (trace_file)
+        trace_dump(trace_file);
+    if (metrics_path)
+        metrics_close(&metrics, metrics_path);
+    channel_pool_destroy(&pool);
+    filter_bank_free(&bank);
+    free(lines);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/*
+ * Decode a key trace with the host port of the decoder.
+ *
+ * The trace is read from the standard input and the decoded text is
+ * written to the standard output. If the trace is labeled, the decoded
+ * text is compared to the labels, and the error count is reported on
+ * the standard error.
+ *
+ * With -b, the whole trace is decoded at once by batch-decoder.h, which
+ * is much faster on long traces, but does not score the result.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "key-trace.h"
+#include "host-decoder.h"
+#include "batch-decoder.h"
+
+/* Characters decoded since the last label. */
+static char decoded[256];
+static size_t decoded_length;
+
+/* Scoring. */
+static char label;  // current label, 0 if none yet
+static unsigned long label_count, error_count;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: decode-trace [-w wpm] [-b] < trace\n"
+        "Options:\n"
+        "  -w wpm  keying speed in words per minute (default: 12)\n"
+        "  -b      batch mode, without scoring\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Score the characters decoded while the current label was being
+ * sent. Ideally, this is exactly the label: the firmware outputs each
+ * character two time units after its last element, and each space five
+ * units after the end of the word, both of which happen before the
+ * next label starts. Anything else counts as one error per missing,
+ * extra or wrong character.
+ */
+static void score(void)
+{
+    if (label) {
+        label_count++;
+        if (memchr(decoded, label, decoded_length))
+            error_count += decoded_length - 1;
+        else
+            error_count += decoded_length ? decoded_length : 1;
+    }
+    decoded_length = 0;
+}
+
+/* Run the decoder for the given number of tics. */
+static void run(decoder_t *d, uint16_t *now, bool key_down, uint32_t tics)
+{
+    while (tics--) {
+        char c = decoder_step(d, (*now)++, key_down);
+        if (c) {
+            putchar(c);
+            if (decoded_length < sizeof decoded)
+                decoded[decoded_length++] = c;
+        }
+    }
+}
+
+/*
+ * Decode the whole trace with the batch decoder. The durations are
+ * gathered as (mark, space) pairs, the leading space being dropped, and
+ * a final space long enough to end the last word.
+ */
+static void run_batch(float rate)
+{
+    size_t count = 0, capacity = 1024;
+    uint32_t *durations = malloc(capacity * sizeof *durations);
+    if (!durations) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    trace_record_t record;
+    while (trace_read(stdin, &record)) {
+        if (record.type != KEY_EVENT || record.tics == 0)
+            continue;
+        if (count + 2 > capacity) {
+            capacity *= 2;
+            uint32_t *p = realloc(durations, capacity * sizeof *durations);
+            if (!p) {
+                perror("realloc");
+                free(durations);
+                exit(EXIT_FAILURE);
+            }
+            durations = p;
+        }
+        bool mark = count % 2 == 0;
+        if (record.key_down == mark)
+            durations[count++] = record.tics;
+        else if (count)
+            durations[count-1] += record.tics;  // same state as before
+    }
+    if (count % 2)
+        durations[count++] = UINT32_MAX;
+    else if (count)
+        durations[count-1] = UINT32_MAX;
+    static batch_decoder_t decoder;
+    batch_init(&decoder, rate, morse_code);
+    count = batch_debounce(durations, count, decoder.debounce);
+    char *text = malloc(count + 1);
+    if (!text) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t length = batch_decode(&decoder, durations, count, text);
+    fwrite(text, 1, length, stdout);
+    putchar('\n');
+    free(text);
+    free(durations);
+}
+
+int main(int argc, char *argv[])
+{
+    float rate = 12;
+    bool batch = false;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "w:b")) != -1) {
+        switch (opt) {
+            case 'w': rate = atof(optarg); break;
+            case 'b': batch = true; break;
+            default: usage();
+        }
+    }
+    if (optind != argc || !decoder_rate_valid(rate))
+        usage();
+    if (batch) {
+        run_batch(rate);
+        return EXIT_SUCCESS;
+    }
+
+    decoder_t decoder;
+    decoder_init(&decoder, rate);
+    uint16_t now = 0;
+    trace_record_t record;
+    while (trace_read(stdin, &record)) {
+        if (record.type == KEY_EVENT) {
+            run(&decoder, &now, record.key_down, record.tics);
+        } else {
+            score();
+            label = record.c;
+        }
+    }
+
+    /* Let the decoder time out the last character and word. */
+    run(&decoder, &now, false, 8 * decoder.delay_1u);
+    score();
+    putchar('\n');
+
+    if (label_count)
+        fprintf(stderr, "%lu characters, %lu errors (%.3f%%)\n",
+                label_count, error_count, 100.0 * error_count / label_count);
+
+    return EXIT_SUCCESS;
+}
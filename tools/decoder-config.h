@@ -0,0 +1,161 @@
+/*
+ * Reloadable decoder configuration: keying rate and Morse code table.
+ *
+ * A configuration is an immutable snapshot. The current one is
+ * published through a single pointer, with an atomic store. The
+ * decoders read that pointer only between characters, and switch to a
+ * new snapshot there, such that no character is ever decoded with a mix
+ * of two configurations, and the per-tic path takes no lock. A replaced
+ * snapshot is "retired", and freed only once no decoder uses it any
+ * more, in the spirit of read-copy-update (RCU).
+ *
+ * The configuration file is a text file with one setting per line:
+ *
+ *   wpm <rate>              keying rate, in words per minute
+ *   code <char> <pattern>   Morse code of a character, as dots and
+ *                           dashes, overriding the built-in table
+ *   # ...                   comment, ignored
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host-decoder.h"
+
+typedef struct decoder_config {
+    struct decoder_config *next;  // on the retired list
+    unsigned long version;        // incremented by every reload
+    float rate;                   // in words per minute
+    uint16_t morse_code[CODE_LENGTH];
+} decoder_config_t;
+
+/* Current snapshot, NULL if none, and retired snapshots. */
+static decoder_config_t *config_current;
+static decoder_config_t *config_retired;
+
+/* Snapshot to be used by a decoder when it is next between characters. */
+static inline const decoder_config_t *config_get(void)
+{
+    return __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+}
+
+/* Apply a snapshot to a decoder. */
+static inline void decoder_set_config(decoder_t *d,
+        const decoder_config_t *config)
+{
+    decoder_set_rate(d, config->rate);
+    d->table = config->morse_code;
+}
+
+/*
+ * Translate a pattern of dots and dashes to a code number, as does
+ * make-code-table.c. Returns 0 if the pattern is invalid.
+ */
+static inline uint16_t config_code(const char *pattern)
+{
+    uint32_t code = 0, bitmask = 1;
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '-')
+            bitmask <<= 1;
+        else if (*p != '.')
+            return 0;
+        code |= bitmask;
+        bitmask <<= 1;
+        if (code > UINT16_MAX)
+            return 0;
+    }
+    return code;
+}
+
+/*
+ * Load a configuration file. The settings it does not give are taken
+ * from the built-in table and the given default rate, never from the
+ * current snapshot, such that removing a setting from the file reverts
+ * it. Returns a new snapshot, or NULL if the file could not be read or
+ * has errors, which are reported on stderr.
+ */
+static inline decoder_config_t *config_load(const char *file_name,
+        float default_rate)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f) {
+        perror(file_name);
+        return NULL;
+    }
+    decoder_config_t *config = malloc(sizeof *config);
+    if (!config) {
+        perror("malloc");
+        fclose(f);
+        return NULL;
+    }
+    const decoder_config_t *current = config_get();
+    config->next = NULL;
+    config->version = current ? current->version + 1 : 1;
+    config->rate = default_rate;
+    memcpy(config->morse_code, morse_code, sizeof morse_code);
+
+    char line[128];
+    int line_number = 0, errors = 0;
+    while (fgets(line, sizeof line, f)) {
+        line_number++;
+        char key[16], value[32];
+        char c;
+        float rate;
+        if (line[0] == '#' || sscanf(line, "%15s", key) != 1)
+            continue;  // comment or blank line
+        if (strcmp(key, "wpm") == 0
+                && sscanf(line, "%*s %f", &rate) == 1
+                && decoder_rate_valid(rate)) {
+            config->rate = rate;
+        } else if (strcmp(key, "code") == 0
+                && sscanf(line, "%*s %c %31s", &c, value) == 2
+                && ((c > ' ' && c < ' ' + CODE_LENGTH) || c == '_')
+                && config_code(value)) {
+            config->morse_code[c == '_' ? 0 : c - ' '] = config_code(value);
+        } else {
+            fprintf(stderr, "%s:%d: invalid setting\n", file_name,
+                    line_number);
+            errors++;
+        }
+    }
+    fclose(f);
+    if (errors) {
+        free(config);
+        return NULL;
+    }
+    return config;
+}
+
+/* Make a snapshot current, and retire the previous one. */
+static inline void config_publish(decoder_config_t *config)
+{
+    decoder_config_t *old = __atomic_exchange_n(&config_current, config,
+            __ATOMIC_ACQ_REL);
+    if (old) {
+        old->next = config_retired;
+        config_retired = old;
+    }
+}
+
+/*
+ * Free the retired snapshots that are no longer in use. The caller
+ * provides the test, as only it knows its decoders. It must be called
+ * when no decoder is in the middle of switching snapshots.
+ */
+static inline void config_reclaim(bool (*in_use)(const decoder_config_t *))
+{
+    decoder_config_t **p = &config_retired;
+    while (*p) {
+        decoder_config_t *config = *p;
+        if (in_use(config)) {
+            p = &config->next;
+        } else {
+            *p = config->next;
+            free(config);
+        }
+    }
+}
@@ -0,0 +1,284 @@
+/*
+ * Host port of the tiny-morse-decoder processing pipeline.
+ *
+ * This is a translation, for running on a PC, of the edge detector,
+ * tokenizer and decoder of tiny-morse-decoder.c. The state machines are
+ * the same, but the state that the firmware keeps in static variables
+ * is gathered here into a decoder_t structure, so that many independent
+ * decoders can run side by side. Time is counted in the same "tics" as
+ * in the firmware, and the functions take the current time and key
+ * state as parameters instead of reading them from the hardware.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Timing, as on the ATtiny13A: one tic every 1000 CPU cycles. */
+#define TIC_FREQ 9600.0                                   // in Hz
+#define DOT_TIME(rate) ((uint16_t)(1.2/(rate)*TIC_FREQ))  // in tics
+#define DEBOUNCE_TIME  ((uint16_t)(0.01*TIC_FREQ+0.5))    // in tics
+
+/*
+ * Speed presets, in words per minute, and debounce time for a given dot
+ * time, as in the firmware. With FAST_PRESETS, the debounce time is an
+ * eighth of the dot time.
+ */
+#ifdef FAST_PRESETS
+#  define KEY_RATE_0 25
+#  define KEY_RATE_1 35
+#  define KEY_RATE_2 45
+#  define KEY_RATE_3 60
+#  define DEBOUNCE_TIME_FOR(dot) ((uint16_t) ((dot) >> 3))
+#else
+#  define KEY_RATE_0  5
+#  define KEY_RATE_1  8
+#  define KEY_RATE_2 12
+#  define KEY_RATE_3 18
+#  define DEBOUNCE_TIME_FOR(dot) DEBOUNCE_TIME
+#endif
+
+/* Same as expired() in the firmware. */
+static inline bool expired(uint16_t now, uint16_t timeout)
+{
+    return (int16_t) (now - timeout) >= 0;
+}
+
+typedef enum {NO_EDGE, RISE, FALL} edge_t;
+
+typedef enum {NO_SYMBOL, DOT, DASH, END_OF_CHAR, END_OF_WORD} symbol_t;
+
+/* The state of one decoder. */
+typedef struct {
+
+    /* Edge detector. */
+    enum {UP, DOWN, BOUNCING} edge_state;
+    uint16_t edge_timeout;
+
+    /* Tokenizer. */
+    enum {
+        INTERWORD, SHORT, LONG, INTERELEMENT, INTERCHARACTER
+    } token_state;
+    uint16_t token_timeout;
+
+    /* Decoder. */
+    uint16_t code, bitmask;
+    const uint16_t *table;  // Morse code table, morse_code[] by default
+
+    /* Keying speed and debounce time, in tics. */
+    uint16_t delay_1u, delay_2u, delay_3u;
+    uint16_t debounce;
+} decoder_t;
+
+
+/***********************************************************************
+ * Edge detector: same as get_edge() in the firmware.
+ */
+
+static inline edge_t get_edge(decoder_t *d, uint16_t now, bool key_down)
+{
+    switch (d->edge_state) {
+        case UP:
+            if (key_down) {
+                d->edge_state = DOWN;
+                return FALL;
+            }
+            break;
+        case DOWN:
+            if (!key_down) {
+                d->edge_state = BOUNCING;
+                d->edge_timeout = now + d->debounce;
+            }
+            break;
+        case BOUNCING:
+            if (key_down) {
+                d->edge_state = DOWN;
+            } else if (expired(now, d->edge_timeout)) {
+                d->edge_state = UP;
+                return RISE;
+            }
+            break;
+    }
+    return NO_EDGE;
+}
+
+
+/***********************************************************************
+ * Tokenizer: same as tokenize_with() in the firmware.
+ */
+
+static inline symbol_t tokenize(decoder_t *d, uint16_t now, edge_t edge)
+{
+    switch (d->token_state) {
+        case INTERWORD:
+            if (edge == FALL) {
+                d->token_state = SHORT;
+                d->token_timeout = now + d->delay_2u;
+            }
+            break;
+        case SHORT:
+            if (edge == RISE) {
+                d->token_state = INTERELEMENT;
+                d->token_timeout = now + d->delay_2u;
+                return DOT;
+            } else if (expired(now, d->token_timeout)) {
+                d->token_state = LONG;
+            }
+            break;
+        case LONG:
+            if (edge == RISE) {
+                d->token_state = INTERELEMENT;
+                d->token_timeout = now + d->delay_2u;
+                return DASH;
+            }
+            break;
+        case INTERELEMENT:
+            if (edge == FALL) {
+                d->token_state = SHORT;
+                d->token_timeout = now + d->delay_2u;
+            } else if (expired(now, d->token_timeout)) {
+                d->token_state = INTERCHARACTER;
+                d->token_timeout = now + d->delay_3u;
+                return END_OF_CHAR;
+            }
+            break;
+        case INTERCHARACTER:
+            if (edge == FALL) {
+                d->token_state = SHORT;
+                d->token_timeout = now + d->delay_2u;
+            } else if (expired(now, d->token_timeout)) {
+                d->token_state = INTERWORD;
+                return END_OF_WORD;
+            }
+            break;
+    }
+    return NO_SYMBOL;
+}
+
+
+/***********************************************************************
+ * Decoder: same as decode() and code_to_char() in the firmware.
+ */
+
+/* === Generated code. See make-code-table.c. === */
+#define CODE_LENGTH 59
+
+static const uint16_t morse_code[CODE_LENGTH] = {
+    363, 694, 221,   0, 375,   0,  61, 853, 214, 726,   0, 109,
+    698, 190, 365, 110, 682, 341, 171,  87,  47,  31,  62, 122,
+    234, 426, 490, 438,   0,  94,   0, 235, 437,   5,  30,  54,
+     14,   1,  27,  26,  15,   3,  85,  22,  29,  10,   6,  42,
+     53,  90,  13,   7,   2,  11,  23,  21,  46,  86,  58
+};
+/* === End of generated code. === */
+
+/* Lookup a code in the given table. */
+static inline char lookup_code(const uint16_t *table, uint16_t code)
+{
+    int i;  // array index
+
+    // Lookup the code in the array.
+    for (i = 0; i < CODE_LENGTH; i++) {
+        if (table[i] == code)
+            break;
+    }
+
+    if (i == 0)                // 0 means '_'
+        return '_';
+    else if (i < CODE_LENGTH)  // generic case
+        return ' ' + i;
+    else                       // not found: return "invalid"
+        return '#';
+}
+
+static inline char code_to_char(uint16_t code)
+{
+    return lookup_code(morse_code, code);
+}
+
+static inline char decode(decoder_t *d, symbol_t symbol)
+{
+    switch (symbol) {
+        case NO_SYMBOL:
+            break;
+        case DASH:
+            d->bitmask <<= 1;       // add a 0 to the bit stream
+            /* fallthrough */
+        case DOT:
+            d->code |= d->bitmask;  // add a 1
+            d->bitmask <<= 1;
+            break;
+        case END_OF_CHAR: {
+                char c = lookup_code(d->table, d->code);
+                d->code = 0;  // reset, to get ready for the next character
+                d->bitmask = 1;
+                return c;
+            }
+        case END_OF_WORD:
+            return ' ';
+    }
+    return 0;  // not a full character yet
+}
+
+
+/***********************************************************************
+ * Whole pipeline.
+ */
+
+/* Set the keying rate of a decoder, in words per minute. */
+static inline void decoder_set_rate(decoder_t *d, float rate)
+{
+    d->delay_1u = DOT_TIME(rate);
+    d->delay_2u = 2 * d->delay_1u;
+    d->delay_3u = 3 * d->delay_1u;
+    d->debounce = DEBOUNCE_TIME_FOR(d->delay_1u);
+}
+
+/*
+ * Whether a keying rate is usable: the longest timeout, delay_3u, must
+ * be at most 32767 tics ahead for expired() to work, which excludes
+ * rates below about 1.06 wpm, and a dot must last at least one tic.
+ */
+static inline bool decoder_rate_valid(float rate)
+{
+    double dot = 1.2 / rate * TIC_FREQ;
+    return rate > 0 && dot >= 1 && 3 * dot <= INT16_MAX;
+}
+
+/* Initialize a decoder for the given keying rate in words per minute. */
+static inline void decoder_init(decoder_t *d, float rate)
+{
+    *d = (decoder_t) {
+        .edge_state = UP,
+        .token_state = INTERWORD,
+        .code = 0,
+        .bitmask = 1,
+        .table = morse_code
+    };
+    decoder_set_rate(d, rate);
+}
+
+/*
+ * Whether the decoder is between characters, i.e. not in the middle of
+ * receiving one. This is when its settings can be changed.
+ */
+static inline bool decoder_idle(const decoder_t *d)
+{
+    return d->token_state == INTERWORD
+        || d->token_state == INTERCHARACTER;
+}
+
+/*
+ * Run one iteration of the firmware's main loop. This should be called
+ * once per tic, with `now' incremented by one between calls. Returns
+ * the decoded character, or 0 if there is none.
+ */
+static inline char decoder_step(decoder_t *d, uint16_t now, bool key_down)
+{
+    edge_t edge = get_edge(d, now, key_down);
+    symbol_t sym = tokenize(d, now, edge);
+    return decode(d, sym);
+}
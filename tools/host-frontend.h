@@ -0,0 +1,723 @@
+/*
+ * Signal processing front end for decoding Morse from audio or IQ
+ * recordings on a PC.
+ *
+ * The input stream first goes through a noise blanker, which removes
+ * the short and strong impulses caused by static crashes and power line
+ * noise. Then a polyphase filter bank, shared by all the channels,
+ * splits the whole band into equally spaced bins, each brought down to
+ * zero frequency and to a low sample rate. Each channel takes the bin
+ * nearest to its CW signal and turns it into a key up / key down state,
+ * which then feeds its own host decoder. The processing chain is:
+ *
+ *   filter bank → mixer → interpolator → AFC → channel filter
+ *       → envelope detector → decoder
+ *
+ * The mixer shifts the signal of interest from its offset within the
+ * bin to zero frequency. Then a linear interpolator brings the sample
+ * rate up from the bin rate to the tic rate of the decoder (TIC_FREQ).
+ * At this rate, the automatic frequency control (AFC) compensates for
+ * the drift of the transmitter, a pair of cascaded one-pole low-pass
+ * filters sets the bandwidth of the channel, and the magnitude of their
+ * output is compared to a threshold in order to tell whether the key is
+ * down. Every interpolated sample is a decoder tic.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#include "decoder-config.h"
+
+/*
+ * Loop gain of the AFC. The frequency correction follows the measured
+ * frequency error with a time constant of 1/AFC_GAIN tics, i.e. about
+ * 50 ms.
+ */
+#define AFC_GAIN 0.002f
+
+/*
+ * Adaptive threshold. The signal and noise levels are tracked by
+ * asymmetric first-order filters, with the coefficients below. The
+ * signal level follows rising envelopes within a couple of ms. While
+ * the key is down, it also follows falling envelopes within about
+ * 20 ms, which tracks fading. While the key is up, it only decays in
+ * about 2 s, such that it is kept through the gaps. The noise level is
+ * the average envelope while the key is up, with a time constant of
+ * 50 ms. While the key is down, it is nearly frozen, and so it is while
+ * the key is up but the envelope is above half the key down threshold:
+ * that is likely a mark lost in a fade, which would otherwise raise the
+ * noise level up to the signal.
+ */
+#define SIGNAL_ATTACK      0.05f
+#define SIGNAL_DECAY_MARK  (1 / 200.0f)
+#define SIGNAL_DECAY_SPACE (1 / 19200.0f)
+#define NOISE_SPACE        (1 / 480.0f)
+#define NOISE_MARK         (1 / 96000.0f)
+
+/*
+ * The key is deemed down when the envelope rises above KEY_DOWN_LEVEL
+ * of the way from the noise level to the signal level, and above
+ * MIN_SNR times the noise level. It is deemed up again when the
+ * envelope falls below KEY_UP_LEVEL of the way, or below half MIN_SNR
+ * times the noise level. Both key up thresholds are below the key down
+ * ones, which keeps the ripple of the envelope on the edges from making
+ * the key bounce.
+ */
+#define KEY_DOWN_LEVEL 0.5f
+#define KEY_UP_LEVEL   0.3f
+#define MIN_SNR        4.0f
+
+/*
+ * Noise blanker. This removes from the input the samples with a power
+ * much higher than the recent typical power, which are assumed to be
+ * impulses. The input is cut into short spans, and the reference power
+ * is the median of the mean powers of the last few spans. The median
+ * ignores the one or two spans hit by an impulse, and follows a carrier
+ * within a millisecond of its start, so that a strong key down is never
+ * mistaken for an impulse. The blanker is common to all the channels.
+ */
+#define BLANKER_SPAN_TIME 0.5e-3f  // length of a span, in seconds
+#define BLANKER_SPANS     5        // spans in the median, as coded below
+
+typedef struct {
+    size_t span;    // length of a span, in samples, a multiple of 4
+    float history[BLANKER_SPANS];  // mean power of the last spans
+    size_t next;    // oldest entry of the history
+    bool started;   // false until the history is filled
+    float factor;   // blank samples above factor * median
+    size_t blanked; // count of blanked samples
+} blanker_t;
+
+/*
+ * Polyphase filter bank. The band is split into `size' bins, a power of
+ * two, spaced by sample_rate / size. Every bin is low-pass filtered by
+ * the same prototype filter, of BANK_TAPS * size taps, with a cutoff at
+ * the bin spacing, and decimated by size / 2. The bins are thus
+ * oversampled by a factor 2, which keeps the whole spacing around the
+ * bin center free of aliases, whereas a critically sampled bank would
+ * lose the signals that fall between two bins. The size is chosen such
+ * that the bin rate, 2 * sample_rate / size, is just below TIC_FREQ.
+ *
+ * Every `step' input samples, the filter bank computes the polyphase
+ * partial sums of the last BANK_TAPS * size samples, and takes their
+ * FFT, which gives one output sample of every bin. The cost per input
+ * sample is thus BANK_TAPS complex multiply-adds plus a log2(size)
+ * radix-2 FFT stage, whatever the number of channels. Both loops run on
+ * SSE vectors of four floats.
+ */
+#define BANK_TAPS 8
+
+typedef struct {
+    size_t size;             // number of bins
+    size_t step;             // input samples per output sample
+    uint32_t sample_rate;    // of the input, in Hz
+    float spacing;           // between bins, in Hz
+    float *prototype;        // time-reversed, BANK_TAPS * size taps
+    float *tw_re, *tw_im;    // FFT twiddles, size - 1
+    uint32_t *reversed;      // bit-reversal permutation
+    float *partial_re, *partial_im;  // polyphase partial sums
+
+    /* Input history: the filter window ends at `window_end'. */
+    float *hist_re, *hist_im;
+    size_t hist_length, hist_capacity, window_end;
+    bool odd;                // parity of the next output sample
+
+    /* Outputs of the last block: out_re[j * size + bin]. */
+    float *out_re, *out_im;
+    size_t steps;            // output samples per bin in the last block
+} filter_bank_t;
+
+typedef struct {
+
+    /* Filter bank bin, and mixer for the offset within the bin. */
+    uint32_t bin;
+    float osc_re, osc_im;  // local oscillator, as a rotating unit phasor
+    float rot_re, rot_im;  // rotation per bin sample
+
+    /*
+     * Interpolator. The phase is counted in units of 1 / (sample_rate *
+     * TIC_FREQ) s: a bin sample adds sample_period, and a tic is due
+     * every tic_period.
+     */
+    float prev_re, prev_im;   // previous bin sample
+    uint32_t tic_phase;
+    uint32_t sample_period, tic_period;
+
+    /* Automatic frequency control. */
+    float afc_re, afc_im;  // correction oscillator
+    float afc_w;           // correction, in radians per tic
+    float afc_limit;       // maximum |afc_w|, 0 if disabled
+
+    /* Channel filter. */
+    float lp_re[2], lp_im[2];
+    float lp_coef;
+
+    /* Envelope detector. */
+    float threshold2;      // squared fixed threshold, 0 if adaptive
+    float signal_level;    // for the adaptive threshold
+    float noise_level;
+    bool key_down;
+
+    /* Decoder, clocked by the decimated samples. */
+    decoder_t decoder;
+    uint16_t now;
+    const decoder_config_t *config;  // snapshot in use, NULL if none
+
+    /* Statistics. */
+    unsigned long characters;  // decoded, including spaces
+    unsigned long invalid;     // decoded as '#'
+    uint32_t mark_length;      // of the current key down, in tics
+    float dot_length;          // running estimate, in tics
+} channel_t;
+
+/*
+ * Initialize the noise blanker for the given sample rate. Samples with a
+ * power greater than `factor' times the median power of the last spans
+ * are blanked. A zero factor disables the blanker.
+ */
+static inline void blanker_init(blanker_t *nb, float factor,
+        uint32_t sample_rate)
+{
+    size_t span = (size_t) (sample_rate * BLANKER_SPAN_TIME / 4 + 0.5f) * 4;
+    *nb = (blanker_t) {.span = span ? span : 4, .factor = factor};
+}
+
+/* Branchless minimum and maximum: these compile to minss and maxss. */
+static inline float blanker_min(float x, float y) { return x < y ? x : y; }
+static inline float blanker_max(float x, float y) { return x > y ? x : y; }
+
+/*
+ * Median of the span powers. The smallest of the first four can't be
+ * the median, nor can the largest, and the median of five is then the
+ * median of the three that remain.
+ */
+static inline float blanker_median(const float h[BLANKER_SPANS])
+{
+    float lo = blanker_max(blanker_min(h[0], h[1]), blanker_min(h[2], h[3]));
+    float hi = blanker_min(blanker_max(h[0], h[1]), blanker_max(h[2], h[3]));
+    return blanker_max(blanker_min(lo, hi),
+            blanker_min(blanker_max(lo, hi), h[4]));
+}
+
+/* Total power of `count' complex samples. */
+static inline float blanker_power(const float *re, const float *im,
+        size_t count)
+{
+    float total = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128 sum = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(re + i), y = _mm_loadu_ps(im + i);
+        sum = _mm_add_ps(sum, _mm_add_ps(_mm_mul_ps(x, x),
+                _mm_mul_ps(y, y)));
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, sum);
+    total = sums[0] + sums[1] + sums[2] + sums[3];
+#endif
+    for (; i < count; i++)
+        total += re[i]*re[i] + im[i]*im[i];
+    return total;
+}
+
+/* Zero the samples with a power above `limit'. Return how many. */
+static inline size_t blanker_clip(float *re, float *im, size_t count,
+        float limit)
+{
+    size_t kept = 0, i = 0;
+#ifdef __SSE2__
+    __m128 limits = _mm_set1_ps(limit);
+    __m128i kept_count = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(re + i), y = _mm_loadu_ps(im + i);
+        __m128 power = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+        __m128 keep = _mm_cmple_ps(power, limits);  // all ones if kept
+        _mm_storeu_ps(re + i, _mm_and_ps(keep, x));
+        _mm_storeu_ps(im + i, _mm_and_ps(keep, y));
+        kept_count = _mm_sub_epi32(kept_count, _mm_castps_si128(keep));
+    }
+    uint32_t counts[4];
+    _mm_storeu_si128((__m128i *) counts, kept_count);
+    kept = counts[0] + counts[1] + counts[2] + counts[3];
+#endif
+    for (; i < count; i++) {
+        if (re[i]*re[i] + im[i]*im[i] <= limit)
+            kept++;
+        else
+            re[i] = im[i] = 0;
+    }
+    return count - kept;
+}
+
+/*
+ * Blank the impulses in a block of `count' complex samples, in place.
+ * Every span is measured before it is blanked, so the history keeps
+ * following the input even when whole spans are blanked. The samples
+ * are processed four at a time with SSE2, the blanking being done by
+ * masks rather than branches.
+ */
+static inline void noise_blank(blanker_t *nb, float *re, float *im,
+        size_t count)
+{
+    if (!nb->factor)
+        return;
+    for (size_t start = 0; start < count; start += nb->span) {
+        size_t length = count - start;
+        if (length > nb->span) length = nb->span;
+        float power = blanker_power(re + start, im + start, length) / length;
+        if (!nb->started) {
+            for (int k = 0; k < BLANKER_SPANS; k++)
+                nb->history[k] = power;
+            nb->started = true;
+        }
+        nb->history[nb->next] = power;
+        nb->next = (nb->next + 1) % BLANKER_SPANS;
+
+        float limit = nb->factor * blanker_median(nb->history);
+        nb->blanked += blanker_clip(re + start, im + start, length, limit);
+    }
+}
+
+/***********************************************************************
+ * Filter bank.
+ */
+
+/*
+ * Initialize a filter bank for the given input sample rate, which
+ * should be at least TIC_FREQ, and blocks of at most `max_block'
+ * samples. Returns false if out of memory.
+ */
+static inline bool filter_bank_init(filter_bank_t *fb, uint32_t sample_rate,
+        size_t max_block)
+{
+    size_t size = 2;
+    while (2.0 * sample_rate / size > TIC_FREQ)
+        size *= 2;
+    size_t taps = BANK_TAPS * size;
+    size_t max_steps = max_block / (size / 2) + 1;
+    *fb = (filter_bank_t) {
+        .size = size,
+        .step = size / 2,
+        .sample_rate = sample_rate,
+        .spacing = (float) sample_rate / size,
+        .prototype = malloc(taps * sizeof(float)),
+        .tw_re = malloc(size * sizeof(float)),
+        .tw_im = malloc(size * sizeof(float)),
+        .reversed = malloc(size * sizeof(uint32_t)),
+        .partial_re = malloc(size * sizeof(float)),
+        .partial_im = malloc(size * sizeof(float)),
+        .hist_capacity = taps + max_block,
+        .out_re = malloc(max_steps * size * sizeof(float)),
+        .out_im = malloc(max_steps * size * sizeof(float))
+    };
+    fb->hist_re = calloc(fb->hist_capacity, sizeof(float));
+    fb->hist_im = calloc(fb->hist_capacity, sizeof(float));
+    if (!fb->prototype || !fb->tw_re || !fb->tw_im || !fb->reversed
+            || !fb->partial_re || !fb->partial_im || !fb->hist_re
+            || !fb->hist_im || !fb->out_re || !fb->out_im)
+        return false;
+
+    /*
+     * Prototype: Blackman-windowed sinc, cut off at the bin spacing,
+     * with unity gain at zero frequency. The response is flat up to
+     * 0.6 bin spacings from the center, and more than 75 dB down from
+     * 1.5 spacings on, which is where the aliases come from.
+     */
+    double sum = 0;
+    for (size_t n = 0; n < taps; n++) {
+        double x = n - (taps - 1) / 2.0;
+        double sinc = x ? sin(2 * M_PI * x / size) / (M_PI * x) : 2.0 / size;
+        double window = 0.42 - 0.5 * cos(2 * M_PI * (n + 0.5) / taps)
+                + 0.08 * cos(4 * M_PI * (n + 0.5) / taps);
+        fb->prototype[taps - 1 - n] = sinc * window;
+        sum += sinc * window;
+    }
+    for (size_t n = 0; n < taps; n++)
+        fb->prototype[n] /= sum;
+
+    /* FFT tables: the twiddles of the stage of half-size h are at h. */
+    for (size_t h = 1; h < size; h *= 2)
+        for (size_t j = 0; j < h; j++) {
+            fb->tw_re[h + j] = cos(M_PI * j / h);
+            fb->tw_im[h + j] = -sin(M_PI * j / h);
+        }
+    int bits = 0;
+    while ((1u << bits) < size)
+        bits++;
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= (i >> b & 1) << (bits - 1 - b);
+        fb->reversed[i] = r;
+    }
+
+    /* The history starts as silence, one step short of a full window. */
+    fb->hist_length = taps - fb->step;
+    fb->window_end = taps;
+    return true;
+}
+
+static inline void filter_bank_free(filter_bank_t *fb)
+{
+    free(fb->prototype);
+    free(fb->tw_re);
+    free(fb->tw_im);
+    free(fb->reversed);
+    free(fb->partial_re);
+    free(fb->partial_im);
+    free(fb->hist_re);
+    free(fb->hist_im);
+    free(fb->out_re);
+    free(fb->out_im);
+}
+
+/*
+ * Polyphase partial sums of the window ending at `x' + taps: the sum of
+ * every size-th product of a sample by a tap.
+ */
+static inline void bank_partial_sums(filter_bank_t *fb, const float *x_re,
+        const float *x_im)
+{
+    const size_t size = fb->size;
+    const float *h = fb->prototype;
+    size_t s = 0;
+#ifdef __SSE2__
+    for (; s + 4 <= size; s += 4) {
+        __m128 sum_re = _mm_setzero_ps(), sum_im = _mm_setzero_ps();
+        for (size_t p = s; p < BANK_TAPS * size; p += size) {
+            __m128 tap = _mm_loadu_ps(h + p);
+            sum_re = _mm_add_ps(sum_re, _mm_mul_ps(tap, _mm_loadu_ps(x_re + p)));
+            sum_im = _mm_add_ps(sum_im, _mm_mul_ps(tap, _mm_loadu_ps(x_im + p)));
+        }
+        _mm_storeu_ps(fb->partial_re + s, sum_re);
+        _mm_storeu_ps(fb->partial_im + s, sum_im);
+    }
+#endif
+    for (; s < size; s++) {
+        float sum_re = 0, sum_im = 0;
+        for (size_t p = s; p < BANK_TAPS * size; p += size) {
+            sum_re += h[p] * x_re[p];
+            sum_im += h[p] * x_im[p];
+        }
+        fb->partial_re[s] = sum_re;
+        fb->partial_im[s] = sum_im;
+    }
+}
+
+/*
+ * In-place radix-2 FFT of arrays already in bit-reversed order. The
+ * first two stages, whose twiddles are 1 and -i, are done together
+ * without multiplications.
+ */
+static inline void bank_fft(const filter_bank_t *fb, float *re, float *im)
+{
+    const size_t size = fb->size;
+    size_t h = 1;
+    if (size >= 4) {
+        for (size_t g = 0; g < size; g += 4) {
+            float s0_re = re[g] + re[g+1], s0_im = im[g] + im[g+1];
+            float d0_re = re[g] - re[g+1], d0_im = im[g] - im[g+1];
+            float s1_re = re[g+2] + re[g+3], s1_im = im[g+2] + im[g+3];
+            float d1_re = re[g+2] - re[g+3], d1_im = im[g+2] - im[g+3];
+            re[g]   = s0_re + s1_re;  im[g]   = s0_im + s1_im;
+            re[g+2] = s0_re - s1_re;  im[g+2] = s0_im - s1_im;
+            re[g+1] = d0_re + d1_im;  im[g+1] = d0_im - d1_re;
+            re[g+3] = d0_re - d1_im;  im[g+3] = d0_im + d1_re;
+        }
+        h = 4;
+    }
+    for (; h < size; h *= 2) {
+        for (size_t g = 0; g < size; g += 2 * h) {
+            size_t j = 0;
+#ifdef __SSE2__
+            for (; j + 4 <= h; j += 4) {
+                __m128 w_re = _mm_loadu_ps(fb->tw_re + h + j);
+                __m128 w_im = _mm_loadu_ps(fb->tw_im + h + j);
+                float *a_re = re + g + j, *a_im = im + g + j;
+                float *b_re = a_re + h, *b_im = a_im + h;
+                __m128 x_re = _mm_loadu_ps(b_re), x_im = _mm_loadu_ps(b_im);
+                __m128 t_re = _mm_sub_ps(_mm_mul_ps(x_re, w_re),
+                        _mm_mul_ps(x_im, w_im));
+                __m128 t_im = _mm_add_ps(_mm_mul_ps(x_re, w_im),
+                        _mm_mul_ps(x_im, w_re));
+                __m128 y_re = _mm_loadu_ps(a_re), y_im = _mm_loadu_ps(a_im);
+                _mm_storeu_ps(b_re, _mm_sub_ps(y_re, t_re));
+                _mm_storeu_ps(b_im, _mm_sub_ps(y_im, t_im));
+                _mm_storeu_ps(a_re, _mm_add_ps(y_re, t_re));
+                _mm_storeu_ps(a_im, _mm_add_ps(y_im, t_im));
+            }
+#endif
+            for (; j < h; j++) {
+                float w_re = fb->tw_re[h + j], w_im = fb->tw_im[h + j];
+                size_t a = g + j, b = a + h;
+                float t_re = re[b] * w_re - im[b] * w_im;
+                float t_im = re[b] * w_im + im[b] * w_re;
+                re[b] = re[a] - t_re;
+                im[b] = im[a] - t_im;
+                re[a] += t_re;
+                im[a] += t_im;
+            }
+        }
+    }
+}
+
+/*
+ * Process a block of `count' complex input samples, at most the
+ * `max_block' given to filter_bank_init(). The outputs are left in
+ * out_re and out_im, `steps' samples per bin.
+ *
+ * Bin k is the input shifted down by k * spacing, filtered and
+ * decimated. The FFT of the partial sums gives it up to a constant
+ * phase, and a sign flip of the odd bins on every other output, which
+ * is undone here.
+ */
+static inline void filter_bank_process(filter_bank_t *fb, const float *re,
+        const float *im, size_t count)
+{
+    const size_t size = fb->size, taps = BANK_TAPS * size;
+    memcpy(fb->hist_re + fb->hist_length, re, count * sizeof *re);
+    memcpy(fb->hist_im + fb->hist_length, im, count * sizeof *im);
+    fb->hist_length += count;
+    fb->steps = 0;
+    for (; fb->window_end <= fb->hist_length; fb->window_end += fb->step) {
+        size_t start = fb->window_end - taps;
+        bank_partial_sums(fb, fb->hist_re + start, fb->hist_im + start);
+        float *out_re = fb->out_re + fb->steps * size;
+        float *out_im = fb->out_im + fb->steps * size;
+        for (size_t s = 0; s < size; s++) {
+            out_re[fb->reversed[s]] = fb->partial_re[s];
+            out_im[fb->reversed[s]] = fb->partial_im[s];
+        }
+        bank_fft(fb, out_re, out_im);
+        if (fb->odd)
+            for (size_t k = 1; k < size; k += 2) {
+                out_re[k] = -out_re[k];
+                out_im[k] = -out_im[k];
+            }
+        fb->odd = !fb->odd;
+        fb->steps++;
+    }
+
+    /* Keep the samples of the next window. */
+    size_t start = fb->window_end - taps;
+    fb->hist_length -= start;
+    memmove(fb->hist_re, fb->hist_re + start, fb->hist_length * sizeof *re);
+    memmove(fb->hist_im, fb->hist_im + start, fb->hist_length * sizeof *im);
+    fb->window_end = taps;
+}
+
+
+/***********************************************************************
+ * Channels.
+ */
+
+/*
+ * Initialize a channel centered at `frequency' in the input stream of
+ * the filter bank. For real (audio) input this is the pitch of the
+ * tone, and the threshold should account for the bank dropping half
+ * the amplitude. For IQ input this is the offset from the receiver's
+ * tuned frequency, and can be negative. The AFC can pull the channel up
+ * to `afc_range' Hz away from its initial frequency, which should stay
+ * within half a bin spacing of the bin center for the filter bank to
+ * pass the signal unattenuated. Zero disables the AFC. If `threshold' is
+ * zero, the envelope threshold adapts to the signal and noise levels.
+ */
+static inline void channel_init(channel_t *ch, const filter_bank_t *fb,
+        float frequency, float bandwidth, float afc_range,
+        float threshold, float rate)
+{
+    long k = lroundf(frequency / fb->spacing);
+    float offset = frequency - k * fb->spacing;
+    float w = 2 * M_PI * offset * fb->step / fb->sample_rate;
+    *ch = (channel_t) {
+        .bin = (k % (long) fb->size + fb->size) % fb->size,
+        .osc_re = 1,
+        .osc_im = 0,
+        .rot_re = cosf(w),
+        .rot_im = -sinf(w),
+        .sample_period = fb->step * (uint32_t) TIC_FREQ,
+        .tic_period = fb->sample_rate,
+        .afc_re = 1,
+        .afc_im = 0,
+        .afc_limit = 2 * M_PI * afc_range / TIC_FREQ,
+        .lp_coef = 1 - expf(-2 * M_PI * bandwidth / TIC_FREQ),
+        .threshold2 = threshold * threshold,
+        .noise_level = 1  // will quickly settle to the actual level
+    };
+    decoder_init(&ch->decoder, rate);
+    ch->config = config_get();
+    if (ch->config)
+        decoder_set_config(&ch->decoder, ch->config);
+    ch->dot_length = ch->decoder.delay_1u;
+}
+
+/* Estimated keying speed, in words per minute. */
+static inline float channel_wpm(const channel_t *ch)
+{
+    return 1.2 * TIC_FREQ / ch->dot_length;
+}
+
+/*
+ * Return whether the key is down, given the current envelope, and
+ * update the signal and noise level estimates.
+ */
+static inline bool adaptive_threshold(channel_t *ch, float envelope)
+{
+    float signal = ch->signal_level, noise = ch->noise_level;
+    float decay = ch->key_down ? SIGNAL_DECAY_MARK : SIGNAL_DECAY_SPACE;
+    signal += (envelope > signal ? SIGNAL_ATTACK : decay)
+            * (envelope - signal);
+    bool quiet = !ch->key_down && envelope < MIN_SNR / 2 * noise;
+    noise += (quiet ? NOISE_SPACE : NOISE_MARK) * (envelope - noise);
+    ch->signal_level = signal;
+    ch->noise_level = noise;
+    if (!ch->key_down)
+        return envelope >= noise + KEY_DOWN_LEVEL * (signal - noise)
+            && envelope >= MIN_SNR * noise;
+    return envelope >= noise + KEY_UP_LEVEL * (signal - noise)
+        && envelope >= MIN_SNR / 2 * noise;
+}
+
+/*
+ * Process one decimated sample, i.e. one decoder tic. Returns the
+ * decoded character, if any, 0 otherwise.
+ */
+static inline char channel_tic(channel_t *ch, float re, float im)
+{
+    /* Frequency correction. */
+    if (ch->afc_limit) {
+        float x = re * ch->afc_re - im * ch->afc_im;
+        im = re * ch->afc_im + im * ch->afc_re;
+        re = x;
+
+        /*
+         * Rotate the correction oscillator by -afc_w. As the angle is
+         * small, a second order approximation of the rotation is good
+         * enough, and it spares us calling cosf() and sinf().
+         */
+        float w = ch->afc_w;
+        float c = 1 - w*w/2;
+        x = ch->afc_re * c + ch->afc_im * w;
+        ch->afc_im = ch->afc_im * c - ch->afc_re * w;
+        ch->afc_re = x;
+    }
+
+    /* Channel filter. */
+    float prev_re = ch->lp_re[1], prev_im = ch->lp_im[1];
+    float a = ch->lp_coef;
+    ch->lp_re[0] += a * (re - ch->lp_re[0]);
+    ch->lp_im[0] += a * (im - ch->lp_im[0]);
+    ch->lp_re[1] += a * (ch->lp_re[0] - ch->lp_re[1]);
+    ch->lp_im[1] += a * (ch->lp_im[0] - ch->lp_im[1]);
+
+    /* Envelope detector. */
+    re = ch->lp_re[1];
+    im = ch->lp_im[1];
+    float power = re*re + im*im;
+    if (ch->threshold2)
+        ch->key_down = power >= ch->threshold2;
+    else
+        ch->key_down = adaptive_threshold(ch, sqrtf(power));
+
+    /*
+     * Frequency error, from the phase advance since the previous tic.
+     * It is only meaningful while the carrier is on.
+     */
+    if (ch->afc_limit && ch->key_down) {
+        float error = (prev_re * im - prev_im * re) / power;
+        float w = ch->afc_w + AFC_GAIN * error;
+        if (w > ch->afc_limit) w = ch->afc_limit;
+        if (w < -ch->afc_limit) w = -ch->afc_limit;
+        ch->afc_w = w;
+    }
+
+    /*
+     * Estimate the dot length from the key down durations. Those
+     * longer than two dots are taken as dashes, and spikes much shorter
+     * than a dot are ignored.
+     */
+    if (ch->key_down) {
+        ch->mark_length++;
+    } else if (ch->mark_length) {
+        float dot = ch->dot_length, length = ch->mark_length;
+        if (length > 2 * dot)
+            length /= 3;
+        if (length > dot / 4)
+            ch->dot_length += (length - dot) / 8;
+        ch->mark_length = 0;
+    }
+
+    char c = decoder_step(&ch->decoder, ch->now++, ch->key_down);
+    if (c) {
+        ch->characters++;
+        ch->invalid += c == '#';
+    }
+
+    /* Switch to a new configuration, only between characters. */
+    if (decoder_idle(&ch->decoder)) {
+        const decoder_config_t *config = config_get();
+        if (config != ch->config) {
+            ch->config = config;
+            decoder_set_config(&ch->decoder, config);
+        }
+    }
+    return c;
+}
+
+/*
+ * Process the bin of the channel in the last block of the filter bank.
+ * The decoded characters, if any, are stored in `text', which should
+ * have room for as many characters as there were input samples in the
+ * block. Returns the number of characters stored.
+ */
+static inline size_t channel_process(channel_t *ch, const filter_bank_t *fb,
+        char *text)
+{
+    size_t length = 0;
+    const float *re = fb->out_re + ch->bin, *im = fb->out_im + ch->bin;
+    for (size_t j = 0; j < fb->steps; j++) {
+
+        /* Mix. */
+        float in_re = re[j * fb->size], in_im = im[j * fb->size];
+        float x = in_re * ch->osc_re - in_im * ch->osc_im;
+        float y = in_re * ch->osc_im + in_im * ch->osc_re;
+        float osc_re = ch->osc_re * ch->rot_re - ch->osc_im * ch->rot_im;
+        ch->osc_im = ch->osc_re * ch->rot_im + ch->osc_im * ch->rot_re;
+        ch->osc_re = osc_re;
+
+        /*
+         * Interpolate the tics due since the previous sample, which are
+         * at most two, as the bin rate is above TIC_FREQ / 2.
+         */
+        ch->tic_phase += ch->sample_period;
+        while (ch->tic_phase >= ch->tic_period) {
+            ch->tic_phase -= ch->tic_period;
+            float a = (float) ch->tic_phase / ch->sample_period;
+            char c = channel_tic(ch, x - a * (x - ch->prev_re),
+                    y - a * (y - ch->prev_im));
+            if (c)
+                text[length++] = c;
+        }
+        ch->prev_re = x;
+        ch->prev_im = y;
+    }
+
+    /* Keep the oscillators on the unit circle despite rounding errors. */
+    float norm = (3 - ch->osc_re*ch->osc_re - ch->osc_im*ch->osc_im) / 2;
+    ch->osc_re *= norm;
+    ch->osc_im *= norm;
+    norm = (3 - ch->afc_re*ch->afc_re - ch->afc_im*ch->afc_im) / 2;
+    ch->afc_re *= norm;
+    ch->afc_im *= norm;
+
+    return length;
+}
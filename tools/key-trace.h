@@ -0,0 +1,102 @@
+/*
+ * Key traces: recordings of the state of a Morse key over time.
+ *
+ * A key trace is a text file with one record per line. The records are:
+ *
+ *   D <n>       the key is down for n tics
+ *   U <n>       the key is up for n tics
+ *   C <ascii>   the following key events send the given character
+ *               (ASCII code in decimal); this is the "ground truth"
+ *   # ...       comment, ignored
+ *
+ * Durations are in the same 104.2 us tics as in the firmware. The key
+ * is assumed to be up at the start of the trace.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+/* Tic frequency, same as in host-decoder.h. */
+#define TIC_FREQ 9600.0  // in Hz
+
+typedef struct {
+    enum {KEY_EVENT, LABEL} type;
+    bool key_down;  // for KEY_EVENT
+    uint32_t tics;  // duration, for KEY_EVENT
+    char c;         // for LABEL
+} trace_record_t;
+
+/*
+ * Read the next record. Returns false at the end of the file. Invalid
+ * lines are reported on stderr and skipped.
+ */
+static inline bool trace_read(FILE *f, trace_record_t *r)
+{
+    char line[64];
+    while (fgets(line, sizeof line, f)) {
+        unsigned long n;
+        switch (line[0]) {
+            case 'D':
+            case 'U':
+                if (sscanf(line + 1, "%lu", &n) != 1) break;
+                r->type = KEY_EVENT;
+                r->key_down = line[0] == 'D';
+                r->tics = n;
+                return true;
+            case 'C':
+                if (sscanf(line + 1, "%lu", &n) != 1 || n > 127) break;
+                r->type = LABEL;
+                r->c = n;
+                return true;
+            case '#':
+            case '\n':
+                continue;
+        }
+        fprintf(stderr, "Invalid trace record: %s", line);
+    }
+    return false;
+}
+
+/*
+ * Trace writer. Consecutive key events with the same key state are
+ * merged into a single record.
+ */
+typedef struct {
+    FILE *f;
+    bool key_down;
+    uint32_t tics;  // pending duration in the current state
+} trace_writer_t;
+
+static inline void trace_init(trace_writer_t *w, FILE *f)
+{
+    *w = (trace_writer_t) {.f = f, .key_down = false, .tics = 0};
+}
+
+/* Write the pending key event, if any. */
+static inline void trace_flush(trace_writer_t *w)
+{
+    if (w->tics)
+        fprintf(w->f, "%c %" PRIu32 "\n", w->key_down ? 'D' : 'U', w->tics);
+    w->tics = 0;
+}
+
+static inline void trace_key(trace_writer_t *w, bool key_down, uint32_t tics)
+{
+    if (key_down != w->key_down) {
+        trace_flush(w);
+        w->key_down = key_down;
+    }
+    w->tics += tics;
+}
+
+static inline void trace_label(trace_writer_t *w, char c)
+{
+    trace_flush(w);
+    fprintf(w->f, "C %d\n", c);
+}
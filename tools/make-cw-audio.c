@@ -0,0 +1,444 @@
+/*
+ * Render key traces as CW audio.
+ *
+ * Each trace keys a tone at its own pitch. The tones are summed, noise
+ * and fading are added, and the result is written to the standard
+ * output as raw signed 16-bit samples, suitable for cw-frontend.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#include "key-trace.h"
+#include "random.h"
+
+#define MAX_SIGNALS 64
+#define BLOCK_SIZE 4096  // in samples
+
+/*
+ * The oscillators are computed as LANES independent phasors, each
+ * handling one sample out of LANES. The inner loops over the lanes have
+ * no dependencies between iterations, which lets the compiler turn them
+ * into SIMD instructions.
+ */
+#define LANES 8
+
+typedef struct {
+    const char *file_name;
+    FILE *trace;
+    float pitch;          // in Hz
+    float amplitude;      // peak, full scale = 1
+
+    /* Keying. */
+    bool key_down;        // current state of the trace
+    uint32_t tics_left;   // until the next trace record
+    bool done;            // trace exhausted
+    uint32_t ramp;        // 0 = silent, edge_length = full amplitude
+
+    /* Oscillator. */
+    float re[LANES], im[LANES];
+    float rot_re, rot_im; // rotation by LANES samples
+
+    /* Fading. */
+    float fading_phase;
+} signal_t;
+
+static signal_t signals[MAX_SIGNALS];
+static size_t signal_count;
+
+/* Global parameters. */
+static uint32_t sample_rate = 48000;
+static float rise_time = 0.005;    // 0 to 100%, in seconds
+static float noise_rms = 0;        // full scale = 1
+static float impulse_rate = 0;     // per second
+static float impulse_amplitude = 0.9;
+static float fading_period = 0;    // in seconds, 0 = no fading
+static float fading_depth = 0.9;   // 0 to 1
+static random_t rng;
+
+/* Raised-cosine edge, from edge[0] = 0 to edge[edge_length] = 1. */
+static float *edge;
+static uint32_t edge_length;       // in samples
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: make-cw-audio [options] pitch:trace [pitch:trace...]\n"
+        "Options:\n"
+        "  -r rate     sample rate in Hz (default: 48000)\n"
+        "  -a level    peak amplitude of each tone (default: 0.3)\n"
+        "  -e time     rise and fall time in ms (default: 5)\n"
+        "  -n snr      add white noise, SNR in dB in 2500 Hz "
+            "(default: none)\n"
+        "  -i rate     add impulses, count per second (default: 0)\n"
+        "  -I level    amplitude of the impulses (default: 0.9)\n"
+        "  -q period   fading period in seconds (default: no fading)\n"
+        "  -Q depth    fading depth, from 0 to 1 (default: 0.9)\n"
+        "  -l file     write the labels to file, with sample numbers\n"
+        "  -s seed     random seed (default: 1)\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Set up the oscillator of a signal. */
+static void signal_init(signal_t *s, float amplitude)
+{
+    double w = 2 * M_PI * s->pitch / sample_rate;
+    for (int k = 0; k < LANES; k++) {
+        s->re[k] = cos(k * w);
+        s->im[k] = sin(k * w);
+    }
+    s->rot_re = cos(LANES * w);
+    s->rot_im = sin(LANES * w);
+    s->amplitude = amplitude;
+    s->fading_phase = 2 * M_PI * random_uniform(&rng);
+}
+
+/*
+ * Advance a trace by one tic. Labels are written to the `labels' file,
+ * if not NULL, together with the current sample number.
+ */
+static void signal_tic(signal_t *s, FILE *labels, uint64_t sample)
+{
+    while (!s->tics_left && !s->done) {
+        trace_record_t record;
+        if (!trace_read(s->trace, &record)) {
+            s->done = true;
+            s->key_down = false;
+        } else if (record.type == KEY_EVENT) {
+            s->key_down = record.key_down;
+            s->tics_left = record.tics;
+        } else if (labels) {
+            fprintf(labels, "%" PRIu64 " %g %d\n", sample, s->pitch,
+                    record.c);
+        }
+    }
+    if (s->tics_left)
+        s->tics_left--;
+}
+
+static void edge_init(void)
+{
+    edge_length = ceilf(rise_time * sample_rate);
+    if (edge_length < 1)
+        edge_length = 1;
+    edge = malloc((edge_length + 1) * sizeof *edge);
+    if (!edge) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t k = 0; k <= edge_length; k++)
+        edge[k] = 0.5 - 0.5 * cos(M_PI * k / edge_length);
+}
+
+/* Render `count' samples of the envelope, without any tic. */
+static void render_ramp(signal_t *s, float *envelope, size_t count)
+{
+    if (s->key_down && s->ramp == edge_length) {
+        for (size_t i = 0; i < count; i++)
+            envelope[i] = 1;
+    } else if (!s->key_down && s->ramp == 0) {
+        memset(envelope, 0, count * sizeof *envelope);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            if (s->key_down && s->ramp < edge_length)
+                s->ramp++;
+            else if (!s->key_down && s->ramp > 0)
+                s->ramp--;
+            envelope[i] = edge[s->ramp];
+        }
+    }
+}
+
+/*
+ * Render the envelope of a signal, shaped with raised-cosine edges,
+ * for one block of samples starting at sample number `start'. The key
+ * state only changes on tics: the samples between them are rendered as
+ * runs, which are constant but for the edges.
+ */
+static void render_envelope(signal_t *s, float *envelope, size_t count,
+        uint64_t start, uint32_t *tic_phase, FILE *labels)
+{
+    const uint32_t tic_freq = TIC_FREQ;
+    uint32_t phase = *tic_phase;
+    size_t i = 0;
+    while (i < count) {
+
+        /* Samples before the next tic. */
+        size_t run = (sample_rate - 1 - phase) / tic_freq;
+        if (run > count - i)
+            run = count - i;
+        render_ramp(s, envelope + i, run);
+        phase += run * tic_freq;
+        i += run;
+        if (i == count)
+            break;
+
+        /* Sample of the tic. */
+        phase += tic_freq - sample_rate;
+        signal_tic(s, labels, start + i);
+        render_ramp(s, envelope + i, 1);
+        i++;
+    }
+    *tic_phase = phase;
+}
+
+/*
+ * Add the tone of a signal, modulated by the envelope, to the output
+ * block. `count' should be a multiple of LANES.
+ */
+static void render_tone(signal_t *s, const float *envelope, float *out,
+        size_t count, float gain)
+{
+    for (size_t i = 0; i < count; i += LANES) {
+        for (size_t k = 0; k < LANES; k++)
+            out[i+k] += gain * envelope[i+k] * s->im[k];
+        for (size_t k = 0; k < LANES; k++) {
+            float re = s->re[k] * s->rot_re - s->im[k] * s->rot_im;
+            s->im[k] = s->re[k] * s->rot_im + s->im[k] * s->rot_re;
+            s->re[k] = re;
+        }
+    }
+
+    /* Keep the phasors on the unit circle. */
+    for (size_t k = 0; k < LANES; k++) {
+        float norm = (3 - s->re[k]*s->re[k] - s->im[k]*s->im[k]) / 2;
+        s->re[k] *= norm;
+        s->im[k] *= norm;
+    }
+}
+
+#ifdef __SSE2__
+
+/*
+ * Gaussian noise, eight samples at a time, by the Box-Muller transform
+ * on four lanes of xorshift32 generators. Both outputs of the transform
+ * are used, and the logarithm, sine and cosine are computed by
+ * polynomials, accurate to about 1e-5.
+ */
+static __m128i noise_state;
+
+static inline __m128i xorshift32(__m128i x)
+{
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+/* Float in [1, 2) from the high 23 bits of a random word. */
+static inline __m128 one_to_two(__m128i x)
+{
+    return _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(x, 9),
+            _mm_set1_epi32(0x3f800000)));
+}
+
+static void gaussian_noise(float *out, size_t count, float rms)
+{
+    __m128i x = noise_state;
+    for (size_t i = 0; i + 8 <= count; i += 8) {
+
+        /* Radius: sqrt(-2 ln u), with u in (0, 1]. */
+        x = xorshift32(x);
+        __m128 u = _mm_sub_ps(_mm_set1_ps(2), one_to_two(x));
+        __m128i bits = _mm_castps_si128(u);
+        __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23),
+                _mm_set1_epi32(127)));
+        __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits,
+                _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+        __m128 t = _mm_div_ps(_mm_sub_ps(m, _mm_set1_ps(1)),
+                _mm_add_ps(m, _mm_set1_ps(1)));  // ln m = 2 atanh t
+        __m128 t2 = _mm_mul_ps(t, t);
+        __m128 series = _mm_add_ps(_mm_set1_ps(1.0f / 5),
+                _mm_mul_ps(t2, _mm_set1_ps(1.0f / 7)));
+        series = _mm_add_ps(_mm_set1_ps(1.0f / 3), _mm_mul_ps(t2, series));
+        series = _mm_add_ps(_mm_set1_ps(1), _mm_mul_ps(t2, series));
+        __m128 ln_u = _mm_add_ps(_mm_mul_ps(e, _mm_set1_ps(M_LN2)),
+                _mm_mul_ps(_mm_set1_ps(2), _mm_mul_ps(t, series)));
+        __m128 r = _mm_sqrt_ps(_mm_mul_ps(_mm_set1_ps(-2 * rms * rms),
+                ln_u));
+
+        /*
+         * Angle: uniform in [0, pi/4), then spread over the circle by
+         * randomly swapping the sine and cosine and flipping their
+         * signs, using the low bits of the random word.
+         */
+        x = xorshift32(x);
+        __m128 a = _mm_mul_ps(_mm_sub_ps(one_to_two(x), _mm_set1_ps(1)),
+                _mm_set1_ps(M_PI / 4));
+        __m128 a2 = _mm_mul_ps(a, a);
+        __m128 sin_a = _mm_sub_ps(_mm_set1_ps(1.0f / 120),
+                _mm_mul_ps(a2, _mm_set1_ps(1.0f / 5040)));
+        sin_a = _mm_sub_ps(_mm_set1_ps(1.0f / 6), _mm_mul_ps(a2, sin_a));
+        sin_a = _mm_mul_ps(a, _mm_sub_ps(_mm_set1_ps(1),
+                _mm_mul_ps(a2, sin_a)));
+        __m128 cos_a = _mm_sub_ps(_mm_set1_ps(1.0f / 720),
+                _mm_mul_ps(a2, _mm_set1_ps(1.0f / 40320)));
+        cos_a = _mm_sub_ps(_mm_set1_ps(1.0f / 24), _mm_mul_ps(a2, cos_a));
+        cos_a = _mm_sub_ps(_mm_set1_ps(0.5f), _mm_mul_ps(a2, cos_a));
+        cos_a = _mm_sub_ps(_mm_set1_ps(1), _mm_mul_ps(a2, cos_a));
+        __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(x,
+                _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+        __m128 c = _mm_or_ps(_mm_and_ps(swap, sin_a),
+                _mm_andnot_ps(swap, cos_a));
+        __m128 s = _mm_or_ps(_mm_and_ps(swap, cos_a),
+                _mm_andnot_ps(swap, sin_a));
+        c = _mm_xor_ps(c, _mm_castsi128_ps(_mm_slli_epi32(
+                _mm_and_si128(x, _mm_set1_epi32(2)), 30)));
+        s = _mm_xor_ps(s, _mm_castsi128_ps(_mm_slli_epi32(
+                _mm_and_si128(x, _mm_set1_epi32(4)), 29)));
+
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i),
+                _mm_mul_ps(r, c)));
+        _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4),
+                _mm_mul_ps(r, s)));
+    }
+    noise_state = x;
+}
+
+#else
+
+static void gaussian_noise(float *out, size_t count, float rms)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] += rms * random_normal(&rng);
+}
+
+#endif
+
+/*
+ * Add white noise and impulses to the output block. `count' should be
+ * a multiple of 8. Every impulse is a damped oscillation lasting about
+ * 1 ms, and as they all decay at the same rate, their sum is a single
+ * oscillation, which is carried over to the next block.
+ */
+static void render_noise(float *out, size_t count, uint64_t start)
+{
+    static float impulse;            // current sum of the impulses
+    static uint64_t next_impulse;    // sample number
+
+    if (noise_rms)
+        gaussian_noise(out, count, noise_rms);
+    if (impulse_rate) {
+        double p = impulse_rate / sample_rate;
+        float decay = -expf(-5000.0f / sample_rate);
+        if (start == 0)
+            next_impulse = log(1 - random_uniform(&rng)) / log(1 - p);
+        for (size_t i = 0; i < count; i++) {
+            if (start + i == next_impulse) {
+                impulse += impulse_amplitude
+                        * (random_u64(&rng) & 1 ? 1 : -1);
+                next_impulse += 1 + (uint64_t) (log(1 - random_uniform(&rng))
+                        / log(1 - p));
+            }
+            out[i] += impulse;
+            impulse *= decay;
+        }
+        if (fabsf(impulse) < 0.001f)  // avoid denormals
+            impulse = 0;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    float amplitude = 0.3, snr = NAN;
+    const char *label_file_name = NULL;
+    unsigned long seed = 1;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "r:a:e:n:i:I:q:Q:l:s:")) != -1) {
+        switch (opt) {
+            case 'r': sample_rate = atol(optarg); break;
+            case 'a': amplitude = atof(optarg); break;
+            case 'e': rise_time = atof(optarg) / 1000; break;
+            case 'n': snr = atof(optarg); break;
+            case 'i': impulse_rate = atof(optarg); break;
+            case 'I': impulse_amplitude = atof(optarg); break;
+            case 'q': fading_period = atof(optarg); break;
+            case 'Q': fading_depth = atof(optarg); break;
+            case 'l': label_file_name = optarg; break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default: usage();
+        }
+    }
+    if (optind == argc || argc - optind > MAX_SIGNALS
+            || sample_rate < TIC_FREQ)
+        usage();
+    random_init(&rng, seed);
+#ifdef __SSE2__
+    noise_state = _mm_set_epi32(random_u64(&rng) | 1, random_u64(&rng) | 1,
+            random_u64(&rng) | 1, random_u64(&rng) | 1);
+#endif
+    edge_init();
+
+    /* Open the traces. */
+    for (int i = optind; i < argc; i++) {
+        signal_t *s = &signals[signal_count++];
+        char *colon = strchr(argv[i], ':');
+        if (!colon) usage();
+        s->pitch = atof(argv[i]);
+        s->file_name = colon + 1;
+        s->trace = fopen(s->file_name, "r");
+        if (!s->trace) {
+            perror(s->file_name);
+            return EXIT_FAILURE;
+        }
+        signal_init(s, amplitude);
+    }
+    FILE *labels = NULL;
+    if (label_file_name) {
+        labels = fopen(label_file_name, "w");
+        if (!labels) {
+            perror(label_file_name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Noise level: the tone power is amplitude²/2. */
+    if (!isnan(snr))
+        noise_rms = amplitude / sqrtf(2) * powf(10, -snr / 20)
+                * sqrtf(sample_rate / 2.0f / 2500);
+
+    /* Render block by block, until all the traces are exhausted. */
+    static float envelope[BLOCK_SIZE], out[BLOCK_SIZE];
+    static int16_t pcm[BLOCK_SIZE];
+    static uint32_t tic_phases[MAX_SIGNALS];
+    uint64_t sample = 0;
+    for (;;) {
+        memset(out, 0, sizeof out);
+        bool all_done = true;
+        for (size_t i = 0; i < signal_count; i++) {
+            signal_t *s = &signals[i];
+            render_envelope(s, envelope, BLOCK_SIZE, sample,
+                    &tic_phases[i], labels);
+            /* Fading is slow enough to be computed once per block. */
+            float gain = s->amplitude;
+            if (fading_period) {
+                float t = (float) sample / sample_rate;
+                gain *= 1 - fading_depth / 2 * (1 + cosf(2 * M_PI
+                        * t / fading_period + s->fading_phase));
+            }
+            render_tone(s, envelope, out, BLOCK_SIZE, gain);
+            all_done = all_done && s->done && s->ramp == 0;
+        }
+        render_noise(out, BLOCK_SIZE, sample);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            float x = out[i] * 32768;
+            pcm[i] = x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+        }
+        fwrite(pcm, sizeof pcm[0], BLOCK_SIZE, stdout);
+        sample += BLOCK_SIZE;
+        if (all_done)
+            break;
+    }
+
+    if (labels)
+        fclose(labels);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+/*
+ * Generate a key trace from text, mimicking the "fist" of a human
+ * operator.
+ *
+ * The text is read from the standard input, and the trace, labeled with
+ * the characters being sent, is written to the standard output. See
+ * key-trace.h for the format.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "raw-morse-code.h"
+#include "key-trace.h"
+#include "random.h"
+
+/* Parameters of the fist model. */
+static struct {
+    double rate;          // character speed, in wpm
+    double overall_rate;  // Farnsworth speed, in wpm, 0 if not used
+    double drift;         // std. dev. of the relative speed change per char
+    double ratio;         // dash / dot length ratio
+    double ratio_spread;  // std. dev. of the above
+    double jitter;        // relative std. dev. of all durations
+    double bounce;        // probability of a bouncing key release
+    double glitches;      // rate of spurious key closures, per second
+} fist = {
+    .rate = 12,
+    .ratio = 3
+};
+
+static random_t rng;
+static trace_writer_t trace;
+
+/* Time unit, i.e. length of a dot, in tics. Drifts over time. */
+static double unit;
+
+/* Duration of the intercharacter and interword gaps, in units. */
+static double char_gap = 3, word_gap = 7;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: make-keying-trace [options] < text > trace\n"
+        "Options:\n"
+        "  -w wpm     character speed (default: 12)\n"
+        "  -f wpm     Farnsworth overall speed (default: same as -w)\n"
+        "  -d drift   relative speed drift per character (default: 0)\n"
+        "  -r ratio   dash / dot ratio (default: 3)\n"
+        "  -R spread  std. dev. of the dash / dot ratio (default: 0)\n"
+        "  -j jitter  relative std. dev. of durations (default: 0)\n"
+        "  -b prob    probability of bounce on key release (default: 0)\n"
+        "  -g rate    spurious key closures per second (default: 0)\n"
+        "  -s seed    random seed (default: 1)\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Convert a duration from seconds to tics, at least one tic. */
+static uint32_t seconds_to_tics(double t)
+{
+    double tics = t * TIC_FREQ + 0.5;
+    return tics < 1 ? 1 : tics;
+}
+
+/* Return `units' time units in tics, with some jitter. */
+static uint32_t jittered(double units)
+{
+    double factor = 1 + fist.jitter * random_normal(&rng);
+    if (factor < 0.1) factor = 0.1;
+    double tics = units * unit * factor + 0.5;
+    return tics < 1 ? 1 : tics;
+}
+
+/*
+ * Keep the key up for the given number of tics, possibly with
+ * spurious closures.
+ */
+static void key_up(uint32_t tics)
+{
+    while (fist.glitches) {
+        double next = -log(1 - random_uniform(&rng)) / fist.glitches;
+        uint32_t delay = seconds_to_tics(next);
+        if (delay >= tics)
+            break;
+        uint32_t length = seconds_to_tics(0.0005 + 0.0025
+                * random_uniform(&rng));
+        trace_key(&trace, false, delay);
+        trace_key(&trace, true, length);
+        tics -= delay;
+        tics = tics > length ? tics - length : 1;
+    }
+    trace_key(&trace, false, tics);
+}
+
+/*
+ * Release the key. A bouncing key is modeled as a burst of short
+ * contacts within the first 5 ms of the release.
+ */
+static void release(uint32_t gap)
+{
+    if (fist.bounce && random_uniform(&rng) < fist.bounce) {
+        int count = 1 + random_u64(&rng) % 4;
+        for (int i = 0; i < count; i++) {
+            uint32_t open = seconds_to_tics(0.0002 + 0.001
+                    * random_uniform(&rng));
+            uint32_t closed = seconds_to_tics(0.0002 + 0.0005
+                    * random_uniform(&rng));
+            if (open + closed >= gap)
+                break;
+            trace_key(&trace, false, open);
+            trace_key(&trace, true, closed);
+            gap -= open + closed;
+        }
+    }
+    key_up(gap);
+}
+
+/* Send one character. */
+static void send(const raw_code_t *character)
+{
+    /* Drift the speed. */
+    unit *= exp(fist.drift * random_normal(&rng));
+
+    trace_label(&trace, character->c);
+    for (const char *p = character->code; *p; p++) {
+        double ratio = fist.ratio + fist.ratio_spread * random_normal(&rng);
+        if (ratio < 1) ratio = 1;
+        trace_key(&trace, true, jittered(*p == '-' ? ratio : 1));
+        release(jittered(p[1] ? 1 : char_gap));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long seed = 1;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "w:f:d:r:R:j:b:g:s:")) != -1) {
+        switch (opt) {
+            case 'w': fist.rate = atof(optarg); break;
+            case 'f': fist.overall_rate = atof(optarg); break;
+            case 'd': fist.drift = atof(optarg); break;
+            case 'r': fist.ratio = atof(optarg); break;
+            case 'R': fist.ratio_spread = atof(optarg); break;
+            case 'j': fist.jitter = atof(optarg); break;
+            case 'b': fist.bounce = atof(optarg); break;
+            case 'g': fist.glitches = atof(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default: usage();
+        }
+    }
+    if (optind != argc || fist.rate <= 0
+            || fist.overall_rate > fist.rate)
+        usage();
+
+    random_init(&rng, seed);
+    trace_init(&trace, stdout);
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, _IOFBF, sizeof buffer);
+    unit = 1.2 / fist.rate * TIC_FREQ;
+
+    /*
+     * Farnsworth timing: stretch the gaps such that the text is sent at
+     * the overall rate. This is the usual formula, from the ARRL, with
+     * the total delay expressed in dot units at the character rate.
+     */
+    if (fist.overall_rate) {
+        double c = fist.rate, s = fist.overall_rate;
+        double delay = (60*c - 37.2*s) / (s*c) / (1.2/c);
+        char_gap = 3 * delay / 19;
+        word_gap = 7 * delay / 19;
+    }
+
+    /* Start with the key up, as a real operator would. */
+    key_up(jittered(word_gap));
+
+    /* Send the text. */
+    bool in_word = false;
+    int c;
+    while ((c = getchar()) != EOF) {
+        if (isspace(c)) {
+            if (in_word) {
+                trace_label(&trace, ' ');
+                key_up(jittered(word_gap - char_gap));
+                in_word = false;
+            }
+            continue;
+        }
+        c = toupper(c);
+        size_t i;
+        for (i = 0; i < RAW_CODE_LENGTH; i++)
+            if (raw_code[i].c == c) break;
+        if (i == RAW_CODE_LENGTH) {
+            fprintf(stderr, "Skipping unknown character %c.\n", c);
+            continue;
+        }
+        send(&raw_code[i]);
+        in_word = true;
+    }
+    if (in_word) {
+        trace_label(&trace, ' ');
+        key_up(jittered(word_gap - char_gap));
+    }
+    trace_flush(&trace);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/*
+ * Metrics endpoint on a Unix domain socket.
+ *
+ * The program writes its metrics in the Prometheus text format, and
+ * serves them to whoever connects to the socket. Both plain connections
+ * (e.g. `socat - UNIX-CONNECT:path') and HTTP GET requests (e.g.
+ * `curl --unix-socket path http://localhost/metrics') are supported.
+ *
+ * There is no server thread: the program calls metrics_poll() from its
+ * main loop, e.g. between blocks of samples. All the sockets are
+ * non-blocking and no call ever waits: every client has its own state,
+ * and each poll only moves it along as far as its socket allows. A new
+ * client is read from until it has sent a complete HTTP request, or is
+ * served as a plain connection if it has sent nothing else within
+ * METRICS_REQUEST_TIMEOUT. The response is then written on this and the
+ * following polls, as the client reads it. A client that takes longer
+ * than METRICS_CLIENT_TIMEOUT in all is dropped, so that a stuck client
+ * cannot hold one of the METRICS_CLIENTS slots forever.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define METRICS_CLIENTS         8      // served at the same time
+#define METRICS_REQUEST_TIMEOUT 10     // in ms
+#define METRICS_CLIENT_TIMEOUT  10000  // in ms
+
+typedef struct {
+    int fd;               // -1 if the slot is free
+    long long accepted;   // time of the connection, in ms
+    char request[512];
+    size_t received;      // bytes of the request
+    char *response;       // header and body, NULL until known
+    size_t length, sent;  // of the response
+} metrics_client_t;
+
+typedef struct {
+    int fd;               // listening socket
+    metrics_client_t clients[METRICS_CLIENTS];
+} metrics_t;
+
+/* Monotonic time, in ms. */
+static inline long long metrics_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+/*
+ * Open a listening socket at the given path, replacing any stale
+ * socket. Returns false on error.
+ */
+static inline bool metrics_open(metrics_t *m, const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof address.sun_path) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    m->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m->fd < 0) {
+        perror("socket");
+        return false;
+    }
+    unlink(path);
+    if (bind(m->fd, (struct sockaddr *) &address, sizeof address) < 0
+            || listen(m->fd, 8) < 0) {
+        perror(path);
+        close(m->fd);
+        return false;
+    }
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        m->clients[i] = (metrics_client_t) {.fd = -1};
+    return true;
+}
+
+static inline void metrics_drop(metrics_client_t *c)
+{
+    close(c->fd);
+    free(c->response);
+    *c = (metrics_client_t) {.fd = -1};
+}
+
+/*
+ * Read what the client has sent so far. Returns true once the response
+ * can be written: the client has sent a complete HTTP request, has
+ * sent something else, or has sent nothing for METRICS_REQUEST_TIMEOUT.
+ * The request is complete once it ends with an empty line, or fills the
+ * buffer. Sets `*http' accordingly. Drops the client on error.
+ */
+static inline bool metrics_read(metrics_client_t *c, long long now,
+        bool *http)
+{
+    size_t space = sizeof c->request - 1 - c->received;
+    ssize_t r = space ? recv(c->fd, c->request + c->received, space, 0) : 0;
+    if (r > 0)
+        c->received += r;
+    else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        metrics_drop(c);
+        return false;
+    }
+    c->request[c->received] = '\0';
+
+    /* r == 0 means the client has stopped sending. */
+    bool closed = space && r == 0;
+    if (c->received < 4 && strncmp(c->request, "GET ", c->received) == 0
+            && !closed && now - c->accepted < METRICS_REQUEST_TIMEOUT)
+        return false;
+    *http = c->received >= 4 && memcmp(c->request, "GET ", 4) == 0;
+    return !*http || closed || !space || strstr(c->request, "\r\n\r\n");
+}
+
+/* Take a snapshot of the metrics, as the response to the client. */
+static inline bool metrics_respond(metrics_client_t *c, bool http,
+        void (*write_metrics)(FILE *))
+{
+    char *body;
+    size_t length;
+    FILE *f = open_memstream(&body, &length);
+    if (!f)
+        return false;
+    write_metrics(f);
+    fclose(f);
+
+    f = open_memstream(&c->response, &c->length);
+    if (!f) {
+        free(body);
+        return false;
+    }
+    if (http)
+        fprintf(f, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n\r\n", length);
+    fwrite(body, 1, length, f);
+    fclose(f);
+    free(body);
+    return true;
+}
+
+/*
+ * Move every connection along as far as it can go without blocking:
+ * accept the new ones, read the requests, and write the responses. The
+ * metrics are written by the `write_metrics' callback.
+ */
+static inline void metrics_poll(metrics_t *m, void (*write_metrics)(FILE *))
+{
+    long long now = metrics_time();
+    for (int i = 0; i < METRICS_CLIENTS; i++) {
+        metrics_client_t *c = &m->clients[i];
+        if (c->fd < 0) {
+            /* Further connections wait in the backlog. */
+            c->fd = accept(m->fd, NULL, NULL);
+            if (c->fd < 0)
+                continue;
+            fcntl(c->fd, F_SETFL, O_NONBLOCK);
+            c->accepted = now;
+        }
+        if (now - c->accepted >= METRICS_CLIENT_TIMEOUT) {
+            metrics_drop(c);
+            continue;
+        }
+        if (!c->response) {
+            bool http;
+            if (!metrics_read(c, now, &http))
+                continue;
+            if (!metrics_respond(c, http, write_metrics)) {
+                metrics_drop(c);
+                continue;
+            }
+        }
+        ssize_t r = 0;
+        while (c->sent < c->length && (r = send(c->fd, c->response
+                + c->sent, c->length - c->sent, MSG_NOSIGNAL)) > 0)
+            c->sent += r;
+        if (c->sent == c->length
+                || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            metrics_drop(c);
+    }
+}
+
+static inline void metrics_close(metrics_t *m, const char *path)
+{
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        if (m->clients[i].fd >= 0)
+            metrics_drop(&m->clients[i]);
+    close(m->fd);
+    unlink(path);
+}
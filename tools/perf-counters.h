@@ -0,0 +1,117 @@
+/*
+ * Hardware performance counters, through the Linux perf_event_open()
+ * system call.
+ *
+ * Each counter is opened on its own, rather than as a group, such that
+ * the counters not supported by the CPU, or by the virtual machine, do
+ * not prevent the others from working. If the kernel has to multiplex
+ * the counters, the counts are scaled by the fraction of the time they
+ * were actually running.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+typedef enum {
+    CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES,
+    STALLED_CYCLES, COUNTER_COUNT
+} counter_t;
+
+static const struct {
+    const char *name;  // short, for table headers
+    uint32_t type;
+    uint64_t config;
+} counter_events[COUNTER_COUNT] = {
+    [CYCLES]         = {"cycles", PERF_TYPE_HARDWARE,
+                        PERF_COUNT_HW_CPU_CYCLES},
+    [INSTRUCTIONS]   = {"instr", PERF_TYPE_HARDWARE,
+                        PERF_COUNT_HW_INSTRUCTIONS},
+    [BRANCH_MISSES]  = {"br-miss", PERF_TYPE_HARDWARE,
+                        PERF_COUNT_HW_BRANCH_MISSES},
+    [L1D_MISSES]     = {"L1d-miss", PERF_TYPE_HW_CACHE,
+                        PERF_COUNT_HW_CACHE_L1D
+                        | PERF_COUNT_HW_CACHE_OP_READ << 8
+                        | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    [LLC_MISSES]     = {"LLC-miss", PERF_TYPE_HARDWARE,
+                        PERF_COUNT_HW_CACHE_MISSES},
+    [STALLED_CYCLES] = {"stalled", PERF_TYPE_HARDWARE,
+                        PERF_COUNT_HW_STALLED_CYCLES_BACKEND}
+};
+
+typedef struct {
+    int fd[COUNTER_COUNT];       // -1 if not available
+    double value[COUNTER_COUNT]; // counts of the last measurement
+} perf_counters_t;
+
+/*
+ * Open the counters for the calling thread, user space only. Returns
+ * the number of counters available, possibly zero.
+ */
+static inline int counters_open(perf_counters_t *pc)
+{
+    int available = 0;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = counter_events[i].type;
+        attr.config = counter_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fd[i] >= 0)
+            available++;
+        pc->value[i] = NAN;
+    }
+    return available;
+}
+
+static inline void counters_close(perf_counters_t *pc)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+}
+
+/* Zero and start the counters. */
+static inline void counters_start(perf_counters_t *pc)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (pc->fd[i] < 0) continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/*
+ * Stop the counters and store their counts in pc->value[]. The counts
+ * of the unavailable counters are NAN.
+ */
+static inline void counters_stop(perf_counters_t *pc)
+{
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        if (pc->fd[i] >= 0)
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        uint64_t data[3];  // value, time enabled, time running
+        pc->value[i] = NAN;
+        if (pc->fd[i] < 0
+                || read(pc->fd[i], data, sizeof data) != sizeof data
+                || data[2] == 0)
+            continue;
+        pc->value[i] = (double) data[0] * data[1] / data[2];
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Pseudo-random number generator for the host tools.
+ *
+ * This is xorshift64*, which is fast, has a small state, and gives
+ * reproducible sequences from a given seed on every platform.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdint.h>
+#include <math.h>
+
+typedef struct {
+    uint64_t state;
+} random_t;
+
+static inline void random_init(random_t *r, uint64_t seed)
+{
+    r->state = seed ? seed : 0x9e3779b97f4a7c15;  // must not be zero
+}
+
+static inline uint64_t random_u64(random_t *r)
+{
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return r->state * 0x2545f4914f6cdd1d;
+}
+
+/* Uniform in [0, 1). */
+static inline double random_uniform(random_t *r)
+{
+    return (random_u64(r) >> 11) * 0x1.0p-53;
+}
+
+/* Normal with zero mean and unit variance (Box-Muller). */
+static inline double random_normal(random_t *r)
+{
+    double u = 1 - random_uniform(r);  // in (0, 1]
+    double v = random_uniform(r);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
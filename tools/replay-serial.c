@@ -0,0 +1,385 @@
+/*
+ * Capture the serial output of tiny-morse-decoder with timestamps, and
+ * replay such captures into many pseudo-terminals at once.
+ *
+ * In capture mode, the program reads a serial port (or its standard
+ * input) and writes one line per received byte: the time of reception,
+ * in microseconds since the start of the capture, and the byte value in
+ * decimal. Lines starting with '#' are comments.
+ *
+ * In replay mode, the program opens a number of pseudo-terminals, prints
+ * their names, and writes the captured bytes into them with the
+ * recorded timing, optionally accelerated, as if each were a serial
+ * port connected to a decoder. This is meant for load testing programs
+ * that read from many decoders at once.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#define _GNU_SOURCE  // for ptsname_r()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/resource.h>
+
+#define MAX_STREAMS 4096
+
+/* A capture, as loaded in memory. */
+typedef struct {
+    uint64_t *times;  // in microseconds
+    uint8_t *bytes;
+    size_t length;
+} capture_t;
+
+/* A replay stream: one capture played into one pseudo-terminal. */
+typedef struct {
+    const capture_t *capture;
+    int master, slave;
+    char name[64];
+    size_t next;            // index of the next byte to send
+    uint64_t start;         // time of the start of the capture, in us
+    unsigned long written, dropped;
+} stream_t;
+
+static stream_t streams[MAX_STREAMS];
+static volatile sig_atomic_t stop;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: replay-serial -c port > capture\n"
+        "       replay-serial [options] capture [capture...]\n"
+        "Capture mode:\n"
+        "  -c port    serial port to capture, at 9600/8N1, or - for "
+            "stdin\n"
+        "Replay mode options:\n"
+        "  -n count   number of pseudo-terminals (default: one per "
+            "capture)\n"
+        "  -x factor  speed-up factor (default: 1)\n"
+        "  -b time    send the bytes in bursts, every `time' ms "
+            "(default: 0)\n"
+        "  -s         stagger the start of the streams randomly\n"
+        "  -l         loop over the captures forever\n");
+    exit(EXIT_FAILURE);
+}
+
+static void request_stop(int signum)
+{
+    (void) signum;
+    stop = true;
+}
+
+/* Current time, in microseconds. */
+static uint64_t now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * UINT64_C(1000000) + t.tv_nsec / 1000;
+}
+
+/* Sleep until the given time, in microseconds. */
+static void sleep_until(uint64_t time)
+{
+    struct timespec t = {
+        .tv_sec = time / 1000000,
+        .tv_nsec = time % 1000000 * 1000
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+
+/***********************************************************************
+ * Capture mode.
+ */
+
+static int capture(const char *port)
+{
+    int fd = STDIN_FILENO;
+    if (strcmp(port, "-") != 0) {
+        fd = open(port, O_RDONLY | O_NOCTTY);
+        if (fd < 0) {
+            perror(port);
+            return EXIT_FAILURE;
+        }
+        struct termios tio;
+        if (tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            cfsetspeed(&tio, B9600);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+    }
+
+    /* Write every byte as soon as it is received. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("# Capture of %s\n", port);
+    uint64_t start = now();
+    uint8_t buffer[256];
+    ssize_t n;
+    while (!stop && (n = read(fd, buffer, sizeof buffer)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(port);
+            return EXIT_FAILURE;
+        }
+
+        /*
+         * The bytes read at once arrived within the same read() call.
+         * At 9600 bauds, they were about 1042 us apart.
+         */
+        uint64_t t = now() - start;
+        for (ssize_t i = 0; i < n; i++) {
+            uint64_t delay = (n - 1 - i) * 1042;
+            printf("%" PRIu64 " %u\n", t > delay ? t - delay : 0,
+                    buffer[i]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/***********************************************************************
+ * Replay mode.
+ */
+
+/* Load a capture file. Returns false on error. */
+static bool load_capture(const char *file_name, capture_t *c)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f) {
+        perror(file_name);
+        return false;
+    }
+    size_t capacity = 1024;
+    c->times = malloc(capacity * sizeof *c->times);
+    c->bytes = malloc(capacity);
+    c->length = 0;
+    char line[64];
+    while (c->times && c->bytes && fgets(line, sizeof line, f)) {
+        uint64_t t;
+        unsigned byte;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%" SCNu64 " %u", &t, &byte) != 2 || byte > 255) {
+            fprintf(stderr, "%s: invalid line: %s", file_name, line);
+            continue;
+        }
+        if (c->length == capacity) {
+            capacity *= 2;
+            c->times = realloc(c->times, capacity * sizeof *c->times);
+            c->bytes = realloc(c->bytes, capacity);
+            if (!c->times || !c->bytes)
+                break;
+        }
+        c->times[c->length] = t;
+        c->bytes[c->length++] = byte;
+    }
+    fclose(f);
+    if (!c->times || !c->bytes) {
+        perror("malloc");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Open a pseudo-terminal for a stream. The slave side is kept open and
+ * put in raw mode, such that readers can come and go, and see the bytes
+ * exactly as sent by the decoder. Returns false on error.
+ */
+static bool open_pty(stream_t *s)
+{
+    s->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (s->master < 0) {
+        perror("posix_openpt");
+        return false;
+    }
+    if (grantpt(s->master) < 0) {
+        perror("grantpt");
+        return false;
+    }
+    if (unlockpt(s->master) < 0) {
+        perror("unlockpt");
+        return false;
+    }
+    int error = ptsname_r(s->master, s->name, sizeof s->name);
+    if (error) {
+        errno = error;
+        perror("ptsname_r");
+        return false;
+    }
+    s->slave = open(s->name, O_RDWR | O_NOCTTY);
+    if (s->slave < 0) {
+        perror(s->name);
+        return false;
+    }
+    struct termios tio;
+    if (tcgetattr(s->slave, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B9600);
+        tcsetattr(s->slave, TCSANOW, &tio);
+    }
+    return true;
+}
+
+/*
+ * Every stream keeps two file descriptors open, for both sides of its
+ * pseudo-terminal. Raise the limit on open files to the hard limit if
+ * needed, and return false, after saying why, if that is not enough.
+ */
+#define SPARE_FILES 16  // standard streams, captures being loaded...
+
+static bool reserve_files(size_t count)
+{
+    rlim_t needed = 2 * count + SPARE_FILES;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit");
+        return false;
+    }
+    if (limit.rlim_cur >= needed)
+        return true;
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+        fprintf(stderr, "%zu streams need %lu open files, but the limit "
+                "is %lu (see ulimit -Hn).\n", count,
+                (unsigned long) needed, (unsigned long) limit.rlim_max);
+        return false;
+    }
+    limit.rlim_cur = needed;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("setrlimit");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *port = NULL;
+    size_t stream_count = 0;
+    double speed = 1;
+    uint64_t burst = 0;  // in us
+    bool stagger = false, loop = false;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:x:b:sl")) != -1) {
+        switch (opt) {
+            case 'c': port = optarg; break;
+            case 'n': stream_count = atol(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'b': burst = atof(optarg) * 1000; break;
+            case 's': stagger = true; break;
+            case 'l': loop = true; break;
+            default: usage();
+        }
+    }
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+    if (port) {
+        if (optind != argc)
+            usage();
+        return capture(port);
+    }
+    size_t capture_count = argc - optind;
+    if (capture_count == 0 || speed <= 0)
+        usage();
+    if (stream_count == 0)
+        stream_count = capture_count;
+    if (stream_count > MAX_STREAMS) {
+        fprintf(stderr, "Too many streams.\n");
+        return EXIT_FAILURE;
+    }
+    if (!reserve_files(stream_count))
+        return EXIT_FAILURE;
+
+    /* Load the captures, and assign them to the streams. */
+    capture_t *captures = calloc(capture_count, sizeof *captures);
+    if (!captures) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < capture_count; i++)
+        if (!load_capture(argv[optind + i], &captures[i]))
+            return EXIT_FAILURE;
+    uint64_t start = now();
+    for (size_t i = 0; i < stream_count; i++) {
+        stream_t *s = &streams[i];
+        s->capture = &captures[i % capture_count];
+        if (!open_pty(s))
+            return EXIT_FAILURE;
+        printf("%s\n", s->name);
+        s->start = start;
+        if (stagger && s->capture->length) {
+            uint64_t duration = s->capture->times[s->capture->length - 1];
+            s->start += (uint64_t) (duration / speed)
+                    * (rand() / (RAND_MAX + 1.0));
+        }
+    }
+    fflush(stdout);
+
+    /*
+     * Replay. Find the next byte due, sleep until then, and send all
+     * the bytes due at that time. With bursts, the due times are
+     * rounded up to the next multiple of the burst period.
+     */
+    while (!stop) {
+        uint64_t next = UINT64_MAX;
+        for (size_t i = 0; i < stream_count; i++) {
+            stream_t *s = &streams[i];
+            if (s->next == s->capture->length) {
+                if (!loop || s->capture->length == 0)
+                    continue;
+                s->start += s->capture->times[s->capture->length - 1]
+                        / speed + 1;
+                s->next = 0;
+            }
+            uint64_t due = s->start + s->capture->times[s->next] / speed;
+            if (burst)
+                due = (due - start + burst - 1) / burst * burst + start;
+            if (due < next)
+                next = due;
+        }
+        if (next == UINT64_MAX)
+            break;  // all done
+        sleep_until(next);
+        uint64_t t = now();
+
+        /* Send what is due on every stream, in one write() per stream. */
+        for (size_t i = 0; i < stream_count; i++) {
+            stream_t *s = &streams[i];
+            const capture_t *c = s->capture;
+            size_t end = s->next;
+            while (end < c->length && s->start + c->times[end] / speed <= t)
+                end++;
+            if (end == s->next)
+                continue;
+            ssize_t n = write(s->master, c->bytes + s->next, end - s->next);
+            if (n < 0) n = 0;
+            s->written += n;
+            s->dropped += end - s->next - n;  // no reader: buffer full
+            s->next = end;
+        }
+    }
+
+    /* Report. */
+    unsigned long written = 0, dropped = 0;
+    for (size_t i = 0; i < stream_count; i++) {
+        written += streams[i].written;
+        dropped += streams[i].dropped;
+    }
+    fprintf(stderr, "%zu streams, %lu bytes written, %lu dropped, "
+            "in %.3f s\n", stream_count, written, dropped,
+            (now() - start) / 1e6);
+    return EXIT_SUCCESS;
+}
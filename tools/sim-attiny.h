@@ -0,0 +1,161 @@
+/*
+ * Run the tiny-morse-decoder firmware in the simavr simulator.
+ *
+ * The firmware ELF file is loaded into a simulated ATtiny13A. The key
+ * (PB4) and speed selection pins (PB0, PB1) are driven by the caller,
+ * and the serial output on PB2 is decoded back to characters by
+ * watching the pin transitions, with the time of their start bits.
+ *
+ * Time is counted in CPU cycles: the tics of the firmware are 1000
+ * cycles long, and so is a bit of its serial output at 9600 bauds.
+ *
+ * This needs the simavr library and its headers, see
+ * https://github.com/buserror/simavr. It also uses the speed presets of
+ * host-decoder.h, which should be included first.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+
+#define SIM_MCU "attiny13a"
+#define SIM_FREQUENCY 9600000
+#define SIM_CYCLES_PER_TIC 1000
+#define SIM_CYCLES_PER_BIT 1000
+#define SIM_MAX_OUTPUT 1024
+
+/* A character sent by the firmware. */
+typedef struct {
+    char c;
+    uint64_t cycle;  // start of the start bit
+} sim_char_t;
+
+typedef struct {
+    avr_t *avr;
+    elf_firmware_t firmware;
+    avr_irq_t *key, *speed0, *speed1;
+
+    /* Serial receiver. */
+    bool tx_level;
+    bool receiving;
+    uint64_t start_cycle;  // of the start bit being received
+    int bit_count;         // bits sampled so far, start bit included
+    uint16_t bits;         // sampled bits, LSB first
+
+    sim_char_t output[SIM_MAX_OUTPUT];
+    size_t output_length;
+} sim_t;
+
+/*
+ * Sample, in the middle of each bit, the bits of the character being
+ * received that are due by `cycle', and store the character when the
+ * stop bit is reached. This is called before every change of TX, so
+ * the level has been constant since the previous call.
+ */
+static inline void sim_sample(sim_t *s, uint64_t cycle)
+{
+    while (s->receiving) {
+        uint64_t middle = s->start_cycle
+                + (2 * s->bit_count + 1) * SIM_CYCLES_PER_BIT / 2;
+        if (middle > cycle)
+            return;
+        s->bits |= s->tx_level << s->bit_count;
+        if (++s->bit_count == 10) {
+            s->receiving = false;
+            bool framed = (s->bits & 1) == 0 && (s->bits & 0x200);
+            if (framed && s->output_length < SIM_MAX_OUTPUT)
+                s->output[s->output_length++] = (sim_char_t) {
+                    .c = s->bits >> 1,
+                    .cycle = s->start_cycle
+                };
+        }
+    }
+}
+
+/* Notified by simavr on every change of the TX pin. */
+static inline void sim_tx_changed(avr_irq_t *irq, uint32_t value,
+        void *param)
+{
+    (void) irq;
+    sim_t *s = param;
+    sim_sample(s, s->avr->cycle);
+    s->tx_level = value;
+    if (!value && !s->receiving) {  // start bit
+        s->receiving = true;
+        s->start_cycle = s->avr->cycle;
+        s->bit_count = 0;
+        s->bits = 0;
+    }
+}
+
+/* Load the firmware. Returns false on error. */
+static inline bool sim_open(sim_t *s, const char *elf_file)
+{
+    *s = (sim_t) {.tx_level = true};
+    if (elf_read_firmware(elf_file, &s->firmware) != 0) {
+        fprintf(stderr, "%s: cannot load firmware\n", elf_file);
+        return false;
+    }
+    s->avr = avr_make_mcu_by_name(SIM_MCU);
+    if (!s->avr)  // older simavr versions
+        s->avr = avr_make_mcu_by_name("attiny13");
+    if (!s->avr) {
+        fprintf(stderr, "simavr does not support the " SIM_MCU "\n");
+        return false;
+    }
+    avr_init(s->avr);
+    s->avr->frequency = SIM_FREQUENCY;
+    s->avr->log = LOG_NONE;
+    avr_load_firmware(s->avr, &s->firmware);
+    avr_irq_t *port = avr_io_getirq(s->avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+            0);
+    s->speed0 = port + 0;
+    s->speed1 = port + 1;
+    s->key = port + 4;
+    avr_irq_register_notify(port + 2, sim_tx_changed, s);
+    return true;
+}
+
+/*
+ * Reset the MCU, with the speed selection pins set for the given
+ * keying rate (one of KEY_RATE_0 to KEY_RATE_3, from host-decoder.h)
+ * and the key up. The output is cleared.
+ */
+static inline void sim_reset(sim_t *s, int rate)
+{
+    avr_reset(s->avr);
+    avr_raise_irq(s->speed0, rate == KEY_RATE_0 || rate == KEY_RATE_2);
+    avr_raise_irq(s->speed1, rate == KEY_RATE_0 || rate == KEY_RATE_1);
+    avr_raise_irq(s->key, 1);
+    s->tx_level = true;
+    s->receiving = false;
+    s->output_length = 0;
+}
+
+/* Run the MCU for the given number of tics with the given key state. */
+static inline bool sim_run(sim_t *s, bool key_down, uint32_t tics)
+{
+    avr_raise_irq(s->key, !key_down);
+    uint64_t end = s->avr->cycle + (uint64_t) tics * SIM_CYCLES_PER_TIC;
+    while (s->avr->cycle < end) {
+        int state = avr_run(s->avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "The simulated MCU stopped.\n");
+            return false;
+        }
+    }
+    sim_sample(s, s->avr->cycle);
+    return true;
+}
+
+static inline void sim_close(sim_t *s)
+{
+    avr_terminate(s->avr);
+}
@@ -0,0 +1,448 @@
+/*
+ * Run a fleet of simulated decoders, each keyed by its own key trace,
+ * with its serial output bridged to a pseudo-terminal.
+ *
+ * This is meant for load testing programs that read from many decoders
+ * at once, and for long soak tests of the real firmware: every instance
+ * runs the firmware ELF file in simavr (see sim-attiny.h), so what comes
+ * out of the pseudo-terminals is exactly what real decoders would send.
+ *
+ * All the instances share a virtual clock, which advances in quanta of
+ * a fixed number of tics. Within a quantum, the instances are
+ * independent, and the worker threads, one per core by default, take
+ * them from a shared counter a few at a time, which balances the load.
+ * At the end of the quantum, the workers wait at a barrier, and one of
+ * them writes the characters sent during the quantum to the
+ * pseudo-terminals and advances the clock. Optionally, the clock is
+ * paced to real time, or a multiple of it. The characters thus come out
+ * with the timing of the quantum, 10 ms by default, which is finer than
+ * the time it takes to send a character at 9600 bauds.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#define _GNU_SOURCE  // for ptsname_r()
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include "key-trace.h"
+#include "host-decoder.h"
+#include "sim-attiny.h"
+
+#define MAX_INSTANCES 4096
+#define CHUNK 4  // instances taken at a time by a worker
+
+/* A key trace, as a sequence of key events alternating up and down. */
+typedef struct {
+    bool *key_down;
+    uint32_t *tics;
+    size_t length;
+} trace_t;
+
+/* A simulated decoder. */
+typedef struct {
+    sim_t sim;
+    const trace_t *trace;
+    uint32_t idle;       // key up tics before the next event
+    size_t event;        // next key event of the trace
+    uint32_t remaining;  // tics left of the current key event
+    bool key_down;       // during the current key event
+    bool flushed;        // the flush time after the trace is done
+    bool done, failed;
+    int master, slave;   // pseudo-terminal
+    char name[64];
+    unsigned long sent, dropped;
+} instance_t;
+
+/* Settings. */
+static const char *firmware = "../tiny-morse-decoder.elf";
+static int rate = KEY_RATE_2;
+static uint32_t quantum = 96;  // in tics
+static double speed;           // relative to real time, 0 = unpaced
+static bool loop, stagger;
+
+/* State shared by the workers. */
+static instance_t *instances;
+static size_t instance_count;
+static size_t next_instance;   // to run in this quantum
+static uint64_t clock_tics;    // virtual time
+static bool finished;
+static unsigned long late;     // quanta that ended after their time
+static pthread_barrier_t barrier;
+static volatile sig_atomic_t stop;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: sim-fleet [options] trace...\n"
+        "Options:\n"
+        "  -f file    firmware ELF file (default: "
+            "../tiny-morse-decoder.elf)\n"
+        "  -w wpm     keying speed: %d, %d, %d or %d (default: %d)\n"
+        "  -n count   number of instances (default: one per trace)\n"
+        "  -j jobs    worker threads (default: one per core)\n"
+        "  -q tics    quantum of the virtual clock (default: 96)\n"
+        "  -x speed   pace the clock at this multiple of real time\n"
+        "  -s         stagger the start times of the instances\n"
+        "  -l         loop over the traces\n"
+        "The traces are assigned to the instances in a round-robin "
+            "fashion.\n",
+        KEY_RATE_0, KEY_RATE_1, KEY_RATE_2, KEY_RATE_3, KEY_RATE_2);
+    exit(EXIT_FAILURE);
+}
+
+static void request_stop(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+/* Time in seconds, for pacing the clock. */
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static bool load_trace(const char *file_name, trace_t *t)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f) {
+        perror(file_name);
+        return false;
+    }
+    size_t capacity = 0;
+    trace_record_t r;
+    while (trace_read(f, &r)) {
+        if (r.type != KEY_EVENT || r.tics == 0)
+            continue;
+        if (t->length && t->key_down[t->length-1] == r.key_down) {
+            t->tics[t->length-1] += r.tics;
+            continue;
+        }
+        if (t->length == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            t->key_down = realloc(t->key_down, capacity);
+            t->tics = realloc(t->tics, capacity * sizeof *t->tics);
+            if (!t->key_down || !t->tics) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        t->key_down[t->length] = r.key_down;
+        t->tics[t->length++] = r.tics;
+    }
+    fclose(f);
+    return true;
+}
+
+/*
+ * Open a pseudo-terminal for an instance, as in replay-serial.c. The
+ * slave side is kept open and put in raw mode, such that readers can
+ * come and go. Returns false on error.
+ */
+static bool open_pty(instance_t *in)
+{
+    in->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (in->master < 0) {
+        perror("posix_openpt");
+        return false;
+    }
+    if (grantpt(in->master) < 0) {
+        perror("grantpt");
+        return false;
+    }
+    if (unlockpt(in->master) < 0) {
+        perror("unlockpt");
+        return false;
+    }
+    int error = ptsname_r(in->master, in->name, sizeof in->name);
+    if (error) {
+        errno = error;
+        perror("ptsname_r");
+        return false;
+    }
+    in->slave = open(in->name, O_RDWR | O_NOCTTY);
+    if (in->slave < 0) {
+        perror(in->name);
+        return false;
+    }
+    struct termios tio;
+    if (tcgetattr(in->slave, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B9600);
+        tcsetattr(in->slave, TCSANOW, &tio);
+    }
+    return true;
+}
+
+
+/*
+ * Every instance keeps two file descriptors open, for both sides of its
+ * pseudo-terminal. Raise the limit on open files to the hard limit if
+ * needed, and return false, after saying why, if that is not enough.
+ */
+#define SPARE_FILES 16  // standard streams, traces being loaded...
+
+static bool reserve_files(size_t count)
+{
+    rlim_t needed = 2 * count + SPARE_FILES;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit");
+        return false;
+    }
+    if (limit.rlim_cur >= needed)
+        return true;
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+        fprintf(stderr, "%zu instances need %lu open files, but the limit "
+                "is %lu (see ulimit -Hn).\n", count,
+                (unsigned long) needed, (unsigned long) limit.rlim_max);
+        return false;
+    }
+    limit.rlim_cur = needed;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("setrlimit");
+        return false;
+    }
+    return true;
+}
+
+
+/***********************************************************************
+ * Simulation.
+ */
+
+/*
+ * Key up time before the trace, enough for the firmware to boot and
+ * send its invitation to transmit at the slowest speed, as in
+ * check-equivalence.c.
+ */
+static uint32_t warmup_tics(void)
+{
+    return 12 * DOT_TIME(KEY_RATE_0) + 100;
+}
+
+/* Key up time after the trace, for the last character and word. */
+static uint32_t flush_tics(void)
+{
+    return 8 * DOT_TIME(rate);
+}
+
+/*
+ * Run an instance for one quantum. Its trace is preceded by the idle
+ * time and followed by the flush time, then played again if looping.
+ */
+static void run_instance(instance_t *in)
+{
+    uint32_t tics = quantum;
+    while (tics && !in->done) {
+        if (in->remaining == 0) {
+            in->key_down = false;
+            if (in->idle) {
+                in->remaining = in->idle;
+                in->idle = 0;
+            } else if (in->event < in->trace->length) {
+                in->key_down = in->trace->key_down[in->event];
+                in->remaining = in->trace->tics[in->event++];
+            } else if (!in->flushed) {
+                in->remaining = flush_tics();
+                in->flushed = true;
+            } else if (loop) {
+                in->event = 0;
+                in->flushed = false;
+                continue;
+            } else {
+                in->done = true;
+                break;
+            }
+        }
+        uint32_t n = in->remaining < tics ? in->remaining : tics;
+        if (!sim_run(&in->sim, in->key_down, n)) {
+            in->failed = in->done = true;
+            break;
+        }
+        in->remaining -= n;
+        tics -= n;
+    }
+}
+
+/* Write what an instance sent during the quantum to its terminal. */
+static void flush_output(instance_t *in)
+{
+    size_t length = in->sim.output_length;
+    if (length == 0)
+        return;
+    char buffer[SIM_MAX_OUTPUT];
+    for (size_t i = 0; i < length; i++)
+        buffer[i] = in->sim.output[i].c;
+    ssize_t n = write(in->master, buffer, length);
+    if (n < 0) n = 0;
+    in->sent += n;
+    in->dropped += length - n;  // no reader: buffer full
+    in->sim.output_length = 0;
+}
+
+/*
+ * End of a quantum, run by a single worker while the others wait: send
+ * the output, advance the clock, and wait for real time to catch up.
+ */
+static void end_quantum(double start)
+{
+    bool all_done = true;
+    for (size_t i = 0; i < instance_count; i++) {
+        flush_output(&instances[i]);
+        all_done &= instances[i].done;
+    }
+    clock_tics += quantum;
+    next_instance = 0;
+    finished = all_done || stop;
+    if (speed && !finished) {
+        double due = start + clock_tics / TIC_FREQ / speed;
+        double delay = due - now();
+        if (delay > 0) {
+            struct timespec t = {delay, (delay - (long) delay) * 1e9};
+            nanosleep(&t, NULL);
+        } else {
+            late++;
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    double start = *(const double *) arg;
+    while (!finished) {
+        for (;;) {
+            size_t i = __atomic_fetch_add(&next_instance, CHUNK,
+                    __ATOMIC_RELAXED);
+            if (i >= instance_count)
+                break;
+            size_t end = i + CHUNK < instance_count ? i + CHUNK
+                    : instance_count;
+            for (; i < end; i++)
+                run_instance(&instances[i]);
+        }
+        if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+            end_quantum(start);
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+
+/***********************************************************************
+ * Main program.
+ */
+
+int main(int argc, char *argv[])
+{
+    size_t count = 0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "f:w:n:j:q:x:sl")) != -1) {
+        switch (opt) {
+            case 'f': firmware = optarg; break;
+            case 'w': rate = atoi(optarg); break;
+            case 'n': count = atol(optarg); break;
+            case 'j': jobs = atol(optarg); break;
+            case 'q': quantum = atol(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 's': stagger = true; break;
+            case 'l': loop = true; break;
+            default: usage();
+        }
+    }
+    size_t trace_count = argc - optind;
+    if ((rate != KEY_RATE_0 && rate != KEY_RATE_1 && rate != KEY_RATE_2
+            && rate != KEY_RATE_3)
+            || trace_count == 0 || jobs <= 0 || quantum == 0 || speed < 0)
+        usage();
+    if (count == 0)
+        count = trace_count;
+    if (count > MAX_INSTANCES) {
+        fprintf(stderr, "Too many instances: at most %d.\n",
+                MAX_INSTANCES);
+        return EXIT_FAILURE;
+    }
+    if (!reserve_files(count))
+        return EXIT_FAILURE;
+    if ((size_t) jobs > count)
+        jobs = count;
+    instance_count = count;
+
+    /* Load the traces, and start the instances. */
+    trace_t *traces = calloc(trace_count, sizeof *traces);
+    instances = calloc(count, sizeof *instances);
+    if (!traces || !instances) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < trace_count; i++)
+        if (!load_trace(argv[optind + i], &traces[i]))
+            return EXIT_FAILURE;
+    for (size_t i = 0; i < count; i++) {
+        instance_t *in = &instances[i];
+        in->trace = &traces[i % trace_count];
+        if (!open_pty(in) || !sim_open(&in->sim, firmware))
+            return EXIT_FAILURE;
+        sim_reset(&in->sim, rate);
+        in->idle = warmup_tics();
+        if (stagger) {
+            uint64_t duration = 0;
+            for (size_t k = 0; k < in->trace->length; k++)
+                duration += in->trace->tics[k];
+            in->idle += duration * (rand() / (RAND_MAX + 1.0));
+        }
+        printf("%s\n", in->name);
+    }
+    fflush(stdout);
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    /* Run. */
+    double start = now();
+    pthread_barrier_init(&barrier, NULL, jobs);
+    pthread_t threads[jobs];
+    for (long k = 1; k < jobs; k++)
+        pthread_create(&threads[k], NULL, worker, &start);
+    worker(&start);
+    for (long k = 1; k < jobs; k++)
+        pthread_join(threads[k], NULL);
+    double elapsed = now() - start;
+
+    /* Report. */
+    unsigned long sent = 0, dropped = 0, failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        sent += instances[i].sent;
+        dropped += instances[i].dropped;
+        failed += instances[i].failed;
+        sim_close(&instances[i].sim);
+    }
+    double simulated = clock_tics / TIC_FREQ;
+    fprintf(stderr, "%zu instances, %.1f s simulated in %.1f s "
+            "(%.1f times real time, %.0f MHz of AVR time per second)\n",
+            count, simulated, elapsed, simulated / elapsed,
+            count * simulated * SIM_FREQUENCY / elapsed * 1e-6);
+    fprintf(stderr, "%lu characters sent, %lu dropped", sent, dropped);
+    if (speed)
+        fprintf(stderr, ", %lu late quanta", late);
+    fprintf(stderr, "\n");
+    if (failed) {
+        fprintf(stderr, "%lu instances failed.\n", failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,279 @@
+/*
+ * Play key traces on a real decoder, through an Arduino running
+ * auto-test.ino in streaming mode, and capture what the decoder sends.
+ *
+ * The trace is converted to key events in microseconds, streamed to the
+ * Arduino with flow control, and played there on the key line of the
+ * ATtiny. The run fails if the queue of the Arduino runs dry before the
+ * last event. The bytes sent back by the ATtiny are written on the standard
+ * output in the capture format of replay-serial.c: the time of their
+ * start bit, in microseconds since the start of the trace, and their
+ * value.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <termios.h>
+#include "key-trace.h"
+#include "host-decoder.h"
+
+#define BAUD_RATE B500000  // as STREAM_BAUD_RATE in auto-test.ino
+#define TIMEOUT 5000       // for the Arduino to answer, in ms, beyond
+                           // the end of the events it was sent
+
+/* Key events, in microseconds. */
+typedef struct {
+    bool *key_down;
+    uint32_t *us;
+    size_t length, capacity;
+} events_t;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: stream-trace -p port [-w wpm] trace > capture\n"
+        "Options:\n"
+        "  -p port  serial port of the Arduino\n"
+        "  -w wpm   keying speed: %d, %d, %d or %d (default: %d)\n",
+        KEY_RATE_0, KEY_RATE_1, KEY_RATE_2, KEY_RATE_3, KEY_RATE_2);
+    exit(EXIT_FAILURE);
+}
+
+static void add_event(events_t *e, bool key_down, uint32_t us)
+{
+    if (e->length == e->capacity) {
+        e->capacity = e->capacity ? 2 * e->capacity : 1024;
+        e->key_down = realloc(e->key_down, e->capacity);
+        e->us = realloc(e->us, e->capacity * sizeof *e->us);
+        if (!e->key_down || !e->us) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    e->key_down[e->length] = key_down;
+    e->us[e->length++] = us;
+}
+
+/*
+ * Load a trace, between a warm-up and a flush time with the key up.
+ * The times are rounded to microseconds before taking the differences,
+ * so that the rounding errors do not accumulate.
+ */
+static bool load_trace(const char *file_name, events_t *e, int rate,
+        uint32_t warmup_tics)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f) {
+        perror(file_name);
+        return false;
+    }
+    uint64_t tics = warmup_tics, last_us = 0;
+    bool key_down = false;
+    trace_record_t r;
+    for (;;) {
+        bool more = trace_read(f, &r);
+        if (more && (r.type != KEY_EVENT || r.tics == 0))
+            continue;
+        if (!more || r.key_down != key_down) {
+            uint64_t us = tics * 1e6 / TIC_FREQ + 0.5;
+            add_event(e, key_down, us - last_us);
+            last_us = us;
+        }
+        if (!more)
+            break;
+        key_down = r.key_down;
+        tics += r.tics;
+    }
+    fclose(f);
+    add_event(e, false, 8 * DOT_TIME(rate) * 1e6 / TIC_FREQ);  // flush
+    return true;
+}
+
+/* Monotonic time, in seconds. */
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Read a line from the Arduino, waiting at most `timeout' ms. Returns
+ * NULL on timeout or error.
+ */
+static char *read_line(int fd, char *line, size_t size, int timeout)
+{
+    static char buffer[4096];
+    static size_t length;
+    for (;;) {
+        char *end = memchr(buffer, '\n', length);
+        if (end) {
+            size_t n = end - buffer;
+            if (n >= size) n = size - 1;
+            memcpy(line, buffer, n);
+            line[n] = '\0';
+            if (n && line[n-1] == '\r')
+                line[n-1] = '\0';
+            length -= end + 1 - buffer;
+            memmove(buffer, end + 1, length);
+            return line;
+        }
+        if (length == sizeof buffer)
+            length = 0;  // garbage
+        struct pollfd p = {.fd = fd, .events = POLLIN};
+        if (poll(&p, 1, timeout) <= 0)
+            return NULL;
+        ssize_t count = read(fd, buffer + length, sizeof buffer - length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return NULL;
+        length += count;
+    }
+}
+
+/* Wait for a line starting with `prefix'. Returns false on timeout. */
+static bool wait_for(int fd, const char *prefix, char *line, size_t size)
+{
+    while (read_line(fd, line, size, TIMEOUT))
+        if (strncmp(line, prefix, strlen(prefix)) == 0)
+            return true;
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *port = NULL;
+    int rate = KEY_RATE_2;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "p:w:")) != -1) {
+        switch (opt) {
+            case 'p': port = optarg; break;
+            case 'w': rate = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    static const int rates[4] = {KEY_RATE_0, KEY_RATE_1, KEY_RATE_2,
+            KEY_RATE_3};  // as KEY_RATES in auto-test.ino
+    int rate_index = 0;
+    while (rate_index < 4 && rates[rate_index] != rate)
+        rate_index++;
+    if (!port || rate_index == 4 || optind != argc - 1)
+        usage();
+
+    /*
+     * The trace starts after a warm-up, for the decoder to boot and send
+     * its invitation to transmit at the slowest speed, as in
+     * check-equivalence.c.
+     */
+    uint32_t warmup_tics = 12 * DOT_TIME(KEY_RATE_0) + 100;
+    int64_t warmup_us = warmup_tics * 1e6 / TIC_FREQ + 0.5;
+    events_t events = {0};
+    if (!load_trace(argv[optind], &events, rate, warmup_tics))
+        return EXIT_FAILURE;
+
+    /* Open the port. Opening it resets the Arduino. */
+    int fd = open(port, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(port);
+        return EXIT_FAILURE;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, BAUD_RATE);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    char line[256];
+    if (!wait_for(fd, "# streaming", line, sizeof line)) {
+        fprintf(stderr, "%s: the Arduino is not in streaming mode.\n", port);
+        return EXIT_FAILURE;
+    }
+    dprintf(fd, "S %d\n", rate_index);
+    if (!wait_for(fd, "# ready", line, sizeof line)) {
+        fprintf(stderr, "%s: no answer from the Arduino.\n", port);
+        return EXIT_FAILURE;
+    }
+    long credit = atol(line + 7);  // in bytes
+
+    /*
+     * Stream the events, then the end command, as long as the serial
+     * buffer of the Arduino has room for them, and pass on what comes
+     * back. The Arduino plays the events back to back, and only reads
+     * more once it has room to queue them: during a long key up, it may
+     * say nothing until the end of all the events it was sent. The
+     * answer is thus waited for until then, plus TIMEOUT.
+     */
+    printf("# Trace %s played at %d wpm\n", argv[optind], rate);
+    double end = now();  // of the events sent so far, at the latest
+    size_t sent = 0;
+    bool end_sent = false;
+    unsigned long received = 0;
+    bool underrun = false;
+    for (;;) {
+        char buffer[256];
+        size_t length = 0;
+        while (!end_sent) {
+            char command[16];
+            int n = sent < events.length
+                ? sprintf(command, "%c %" PRIu32 "\n",
+                        events.key_down[sent] ? 'D' : 'U', events.us[sent])
+                : sprintf(command, "E\n");
+            if (n > credit)
+                break;
+            memcpy(buffer + length, command, n);
+            length += n;
+            credit -= n;
+            if (sent < events.length)
+                end += events.us[sent++] * 1e-6;
+            else
+                end_sent = true;
+        }
+        if (length && write(fd, buffer, length) != (ssize_t) length) {
+            perror(port);
+            return EXIT_FAILURE;
+        }
+        double wait = end - now();
+        int timeout = TIMEOUT + (wait > 0 ? wait * 1000 : 0);
+        if (!read_line(fd, line, sizeof line, timeout)) {
+            fprintf(stderr, "%s: no answer from the Arduino.\n", port);
+            return EXIT_FAILURE;
+        }
+        if (line[0] == '+') {
+            credit += atol(line + 1);
+        } else if (strncmp(line, "# end", 5) == 0) {
+            break;
+        } else if (strncmp(line, "# underrun", 10) == 0) {
+            underrun = true;
+            break;
+        } else if (line[0] == '#') {
+            printf("%s\n", line);
+        } else {
+            long long t;
+            unsigned byte;
+            if (sscanf(line, "%lld %u", &t, &byte) == 2) {
+                printf("%lld %u\n", t - warmup_us, byte);
+                received++;
+            }
+        }
+    }
+    fprintf(stderr, "%zu key events sent, %lu bytes received\n", sent,
+            received);
+    if (underrun) {
+        fprintf(stderr, "The Arduino ran out of key events %.3f s into "
+                "the trace.\n", (atoll(line + 10) - warmup_us) * 1e-6);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+/*
+ * Store decoded text in a compressed archive, and read it back.
+ *
+ * The text is appended from a capture, in the format written by
+ * replay-serial: one line per character, with its time in microseconds
+ * and its value, optionally followed by a confidence from 0 to 255. It
+ * is read back for a given time range, only decompressing the blocks
+ * that overlap the range. See text-archive.h for the format.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include "text-archive.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: text-archive -a [-o offset] archive < capture\n"
+        "       text-archive [-f from] [-t to] [-v] archive\n"
+        "       text-archive -x archive\n"
+        "Options:\n"
+        "  -a         append a capture to the archive\n"
+        "  -o offset  add offset, in seconds, to the capture times\n"
+        "  -f from    start of the time range to read, in seconds\n"
+        "  -t to      end of the time range to read, in seconds\n"
+        "  -v         print the time and confidence of every character\n"
+        "  -x         rebuild the index from the data file\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/***********************************************************************
+ * Appending.
+ */
+
+static FILE *data, *index_file;
+static uint64_t data_size;
+
+/* Write one block and its index entry. */
+static bool write_block(const archive_entry_t *e, size_t count)
+{
+    static uint8_t block[ARCHIVE_MAX_BLOCK];
+    size_t size = archive_encode(e, count, block);
+    archive_index_t entry = {
+        .first_time = e[0].time,
+        .last_time = e[count-1].time,
+        .offset = data_size,
+        .count = count,
+        .size = size
+    };
+    if (fwrite(block, size, 1, data) != 1
+            || fwrite(&entry, sizeof entry, 1, index_file) != 1)
+        return false;
+    data_size += size;
+    return true;
+}
+
+static int append(const char *archive, double offset)
+{
+    char *idx = archive_file_name(archive, ARCHIVE_INDEX_SUFFIX);
+    data = fopen(archive, "ab");
+    index_file = fopen(idx, "ab+");
+    if (!data || !index_file) {
+        perror(data ? idx : archive);
+        return EXIT_FAILURE;
+    }
+    fseek(data, 0, SEEK_END);
+    data_size = ftell(data);
+
+    /* Times must not go backwards: start after the last block. */
+    uint64_t last_time = 0;
+    archive_index_t entry;
+    if (fseek(index_file, -(long) sizeof entry, SEEK_END) == 0
+            && fread(&entry, sizeof entry, 1, index_file) == 1)
+        last_time = entry.last_time;
+    fseek(index_file, 0, SEEK_END);
+
+    static archive_entry_t entries[ARCHIVE_BLOCK_CHARS];
+    size_t count = 0;
+    unsigned long total = 0;
+    char line[128];
+    while (fgets(line, sizeof line, stdin)) {
+        uint64_t t;
+        unsigned c, confidence = 255;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%" SCNu64 " %u %u", &t, &c, &confidence) < 2
+                || c > 255 || confidence > 255) {
+            fprintf(stderr, "Invalid line: %s", line);
+            continue;
+        }
+        t += offset * 1e6;
+        if (t < last_time)
+            t = last_time;
+        last_time = t;
+        entries[count++] = (archive_entry_t) {
+            .time = t, .c = c, .confidence = confidence
+        };
+        total++;
+        if (count == ARCHIVE_BLOCK_CHARS) {
+            if (!write_block(entries, count)) break;
+            count = 0;
+        }
+    }
+    if (count)
+        write_block(entries, count);
+    if (fclose(data) != 0 || fclose(index_file) != 0) {
+        perror(archive);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%lu characters appended, archive size %" PRIu64
+            " bytes\n", total, data_size);
+    return EXIT_SUCCESS;
+}
+
+
+/***********************************************************************
+ * Reading.
+ */
+
+static int read_range(const char *archive, double from, double to,
+        bool verbose)
+{
+    size_t data_length, index_length;
+    const uint8_t *blocks = archive_map(archive, &data_length);
+    char *idx = archive_file_name(archive, ARCHIVE_INDEX_SUFFIX);
+    const archive_index_t *index = archive_map(idx, &index_length);
+    free(idx);
+    if (!blocks || !index)
+        return data_length || index_length ? EXIT_FAILURE : EXIT_SUCCESS;
+    size_t count = index_length / sizeof *index;
+    uint64_t start = from * 1e6;
+    uint64_t end = to < UINT64_MAX / 1e6 ? to * 1e6 : UINT64_MAX;
+
+    static archive_entry_t entries[ARCHIVE_BLOCK_CHARS];
+    for (size_t i = archive_find(index, count, start);
+            i < count && index[i].first_time <= end; i++) {
+        if (index[i].offset + index[i].size > data_length) {
+            fprintf(stderr, "Block %zu is truncated.\n", i);
+            return EXIT_FAILURE;
+        }
+        long n = archive_decode(blocks + index[i].offset, index[i].size,
+                entries);
+        if (n < 0) {
+            fprintf(stderr, "Block %zu is corrupted.\n", i);
+            return EXIT_FAILURE;
+        }
+        for (long k = 0; k < n; k++) {
+            const archive_entry_t *e = &entries[k];
+            if (e->time < start || e->time > end)
+                continue;
+            if (verbose)
+                printf("%" PRIu64 ".%06" PRIu64 " %c %u\n",
+                        e->time / 1000000, e->time % 1000000, e->c,
+                        e->confidence);
+            else
+                putchar(e->c);
+        }
+    }
+    if (!verbose)
+        putchar('\n');
+    return EXIT_SUCCESS;
+}
+
+/* Rebuild the index by walking through the blocks. */
+static int rebuild_index(const char *archive)
+{
+    size_t length;
+    const uint8_t *blocks = archive_map(archive, &length);
+    char *idx = archive_file_name(archive, ARCHIVE_INDEX_SUFFIX);
+    FILE *f = fopen(idx, "wb");
+    if (!f) {
+        perror(idx);
+        return EXIT_FAILURE;
+    }
+    static archive_entry_t entries[ARCHIVE_BLOCK_CHARS];
+    size_t offset = 0, block_count = 0;
+    while (blocks && offset < length) {
+        long n = archive_decode(blocks + offset, length - offset, entries);
+        if (n <= 0) {
+            fprintf(stderr, "Corrupted block at offset %zu: the rest of "
+                    "the archive is not indexed.\n", offset);
+            break;
+        }
+        archive_block_header_t header;
+        memcpy(&header, blocks + offset, sizeof header);
+        archive_index_t entry = {
+            .first_time = entries[0].time,
+            .last_time = entries[n-1].time,
+            .offset = offset,
+            .count = n,
+            .size = header.size
+        };
+        fwrite(&entry, sizeof entry, 1, f);
+        offset += header.size;
+        block_count++;
+    }
+    if (fclose(f) != 0) {
+        perror(idx);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%zu blocks indexed\n", block_count);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    enum {READ, APPEND, REBUILD} mode = READ;
+    double offset = 0, from = 0, to = HUGE_VAL;
+    bool verbose = false;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "ao:f:t:vx")) != -1) {
+        switch (opt) {
+            case 'a': mode = APPEND; break;
+            case 'o': offset = atof(optarg); break;
+            case 'f': from = atof(optarg); break;
+            case 't': to = atof(optarg); break;
+            case 'v': verbose = true; break;
+            case 'x': mode = REBUILD; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || from < 0 || to < from)
+        usage();
+    const char *archive = argv[optind];
+
+    switch (mode) {
+        case APPEND: return append(archive, offset);
+        case REBUILD: return rebuild_index(archive);
+        default: return read_range(archive, from, to, verbose);
+    }
+}
@@ -0,0 +1,459 @@
+/*
+ * Compressed archive of decoded text, with timestamps.
+ *
+ * An archive is made of two files. The data file is a sequence of
+ * self-contained blocks, each holding up to ARCHIVE_BLOCK_CHARS
+ * characters together with their times of reception, in microseconds,
+ * and optionally a confidence byte per character. The index file,
+ * named after the data file with the suffix ".idx", has one fixed-size
+ * entry per block, giving its time range and position in the data
+ * file. Both files are only ever appended to, and the index can be
+ * rebuilt from the data file. Binary data is in the host's byte order.
+ *
+ * Within a block, the characters are coded as symbols of a 64-letter
+ * alphabet: the 59 characters ' ' to 'Z' that code_to_char() can
+ * return, '_', and an escape for any other byte. The symbols are
+ * compressed with a Huffman code computed for every block, stored as
+ * 64 code lengths of 4 bits. The times are stored as differences from
+ * the previous character, as variable-length integers (LEB128).
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ARCHIVE_BLOCK_CHARS 4096
+#define ARCHIVE_BLOCK_MAGIC 0x42444d54  // "TMDB" in little endian
+#define ARCHIVE_INDEX_SUFFIX ".idx"
+
+/* Largest possible block: header, lengths, and worst case payload. */
+#define ARCHIVE_MAX_BLOCK (sizeof(archive_block_header_t) + 32 + 4 \
+        + ARCHIVE_BLOCK_CHARS * (3 + 10 + 1))
+
+/* Symbols. */
+#define SYMBOL_COUNT 64
+#define SYMBOL_UNDERSCORE 59
+#define SYMBOL_ESCAPE 63  // followed by the byte, on 8 bits
+#define MAX_CODE_LENGTH 15
+
+typedef struct {
+    uint64_t time;       // in microseconds
+    char c;
+    uint8_t confidence;  // 255 = certain
+} archive_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;       // of characters
+    uint32_t size;        // of the block, header included
+    uint32_t flags;
+    uint64_t first_time;  // time of the first character
+} archive_block_header_t;
+
+#define BLOCK_HAS_CONFIDENCE 1  // flag
+
+/* Index entry. */
+typedef struct {
+    uint64_t first_time, last_time;
+    uint64_t offset;  // of the block in the data file
+    uint32_t count;   // of characters
+    uint32_t size;    // of the block
+} archive_index_t;
+
+static inline int archive_symbol(char c)
+{
+    if (c >= ' ' && c <= 'Z')
+        return c - ' ';
+    if (c == '_')
+        return SYMBOL_UNDERSCORE;
+    return SYMBOL_ESCAPE;
+}
+
+static inline char archive_char(int symbol)
+{
+    return symbol == SYMBOL_UNDERSCORE ? '_' : ' ' + symbol;
+}
+
+
+/***********************************************************************
+ * Bit streams, most significant bit first.
+ */
+
+typedef struct {
+    uint8_t *p;
+    uint32_t bits;  // pending bits, at the low end
+    int count;      // number of pending bits
+} bit_writer_t;
+
+static inline void put_bits(bit_writer_t *w, uint32_t value, int count)
+{
+    w->bits = w->bits << count | value;
+    w->count += count;
+    while (w->count >= 8) {
+        w->count -= 8;
+        *w->p++ = w->bits >> w->count;
+    }
+}
+
+static inline void flush_bits(bit_writer_t *w)
+{
+    if (w->count)
+        put_bits(w, 0, 8 - w->count);
+}
+
+typedef struct {
+    const uint8_t *p, *end;
+    int bit;  // next bit of *p, 7 = most significant
+} bit_reader_t;
+
+/* Returns -1 past the end of the stream. */
+static inline int get_bit(bit_reader_t *r)
+{
+    if (r->p == r->end)
+        return -1;
+    int b = *r->p >> r->bit & 1;
+    if (r->bit-- == 0) {
+        r->bit = 7;
+        r->p++;
+    }
+    return b;
+}
+
+
+/***********************************************************************
+ * Huffman coding.
+ */
+
+/*
+ * Compute the code lengths for the given symbol frequencies. If the
+ * longest code is too long, the frequencies are flattened until it
+ * fits.
+ */
+static inline void huffman_lengths(const uint32_t *frequency,
+        uint8_t *length)
+{
+    uint32_t f[SYMBOL_COUNT];
+    memcpy(f, frequency, sizeof f);
+    for (;;) {
+        /* Tree nodes: the symbols first, then the internal nodes. */
+        uint32_t weight[2 * SYMBOL_COUNT];
+        int parent[2 * SYMBOL_COUNT];
+        bool done[2 * SYMBOL_COUNT];
+        int nodes = SYMBOL_COUNT, used = 0;
+        for (int i = 0; i < SYMBOL_COUNT; i++) {
+            weight[i] = f[i];
+            parent[i] = -1;
+            done[i] = f[i] == 0;
+            used += f[i] != 0;
+        }
+
+        /* Merge the two lightest nodes until only one is left. */
+        for (int k = 1; k < used; k++) {
+            int a = -1, b = -1;
+            for (int i = 0; i < nodes; i++) {
+                if (done[i]) continue;
+                if (a < 0 || weight[i] < weight[a]) {
+                    b = a;
+                    a = i;
+                } else if (b < 0 || weight[i] < weight[b]) {
+                    b = i;
+                }
+            }
+            weight[nodes] = weight[a] + weight[b];
+            parent[nodes] = -1;
+            done[nodes] = false;
+            parent[a] = parent[b] = nodes;
+            done[a] = done[b] = true;
+            nodes++;
+        }
+
+        /* Code length = depth in the tree, at least 1. */
+        int longest = 0;
+        for (int i = 0; i < SYMBOL_COUNT; i++) {
+            int depth = 0;
+            for (int n = i; parent[n] >= 0; n = parent[n])
+                depth++;
+            length[i] = f[i] ? (depth ? depth : 1) : 0;
+            if (length[i] > longest) longest = length[i];
+        }
+        if (longest <= MAX_CODE_LENGTH)
+            return;
+        for (int i = 0; i < SYMBOL_COUNT; i++)
+            if (f[i]) f[i] = (f[i] + 1) / 2;
+    }
+}
+
+/* Canonical codes for the given lengths. */
+static inline void huffman_codes(const uint8_t *length, uint16_t *code)
+{
+    uint16_t next = 0;
+    for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+        for (int i = 0; i < SYMBOL_COUNT; i++)
+            if (length[i] == len)
+                code[i] = next++;
+        next <<= 1;
+    }
+}
+
+/* Decoding tables for canonical codes. */
+typedef struct {
+    uint16_t count[MAX_CODE_LENGTH + 1];  // of codes of each length
+    uint8_t symbols[SYMBOL_COUNT];        // by length, then by value
+} huffman_decoder_t;
+
+static inline void huffman_decoder_init(huffman_decoder_t *h,
+        const uint8_t *length)
+{
+    int n = 0;
+    memset(h->count, 0, sizeof h->count);
+    for (int len = 1; len <= MAX_CODE_LENGTH; len++)
+        for (int i = 0; i < SYMBOL_COUNT; i++)
+            if (length[i] == len) {
+                h->count[len]++;
+                h->symbols[n++] = i;
+            }
+}
+
+/* Returns the next symbol, or -1 on error. */
+static inline int huffman_decode(const huffman_decoder_t *h,
+        bit_reader_t *r)
+{
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+        int b = get_bit(r);
+        if (b < 0)
+            return -1;
+        code |= b;
+        int count = h->count[len];
+        if (code - first < count)
+            return h->symbols[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+
+/***********************************************************************
+ * Blocks.
+ */
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t x)
+{
+    while (x >= 0x80) {
+        *p++ = x | 0x80;
+        x >>= 7;
+    }
+    *p++ = x;
+    return p;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *p,
+        const uint8_t *end, uint64_t *x)
+{
+    *x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        *x |= (uint64_t) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+/*
+ * Encode `count' entries, at most ARCHIVE_BLOCK_CHARS, into a block.
+ * The buffer should have room for ARCHIVE_MAX_BLOCK bytes. The times
+ * should not decrease. Returns the size of the block.
+ */
+static inline size_t archive_encode(const archive_entry_t *e, size_t count,
+        uint8_t *block)
+{
+    archive_block_header_t header = {
+        .magic = ARCHIVE_BLOCK_MAGIC,
+        .count = count,
+        .first_time = count ? e[0].time : 0
+    };
+    uint8_t *p = block + sizeof header;
+
+    /* Code lengths, two per byte. */
+    uint32_t frequency[SYMBOL_COUNT] = {0};
+    for (size_t i = 0; i < count; i++) {
+        frequency[archive_symbol(e[i].c)]++;
+        if (e[i].confidence != 255)
+            header.flags |= BLOCK_HAS_CONFIDENCE;
+    }
+    uint8_t length[SYMBOL_COUNT];
+    uint16_t code[SYMBOL_COUNT];
+    huffman_lengths(frequency, length);
+    huffman_codes(length, code);
+    for (int i = 0; i < SYMBOL_COUNT; i += 2)
+        *p++ = length[i] << 4 | length[i+1];
+
+    /* Text, preceded by its size in bytes. */
+    uint8_t *text_size = p;
+    bit_writer_t w = {.p = p + 4};
+    for (size_t i = 0; i < count; i++) {
+        int s = archive_symbol(e[i].c);
+        put_bits(&w, code[s], length[s]);
+        if (s == SYMBOL_ESCAPE)
+            put_bits(&w, (uint8_t) e[i].c, 8);
+    }
+    flush_bits(&w);
+    uint32_t size = w.p - (p + 4);
+    memcpy(text_size, &size, 4);
+    p = w.p;
+
+    /* Times, then confidences. */
+    for (size_t i = 1; i < count; i++)
+        p = put_varint(p, e[i].time - e[i-1].time);
+    if (header.flags & BLOCK_HAS_CONFIDENCE)
+        for (size_t i = 0; i < count; i++)
+            *p++ = e[i].confidence;
+
+    header.size = p - block;
+    memcpy(block, &header, sizeof header);
+    return header.size;
+}
+
+/*
+ * Decode a block of `size' bytes. The output array should have room
+ * for ARCHIVE_BLOCK_CHARS entries. Returns the number of entries, or
+ * -1 if the block is corrupted.
+ */
+static inline long archive_decode(const uint8_t *block, size_t size,
+        archive_entry_t *e)
+{
+    archive_block_header_t header;
+    if (size < sizeof header + 36)  // code lengths and text size
+        return -1;
+    memcpy(&header, block, sizeof header);
+    if (header.magic != ARCHIVE_BLOCK_MAGIC || header.size > size
+            || header.size < sizeof header + 36
+            || header.count > ARCHIVE_BLOCK_CHARS)
+        return -1;
+    const uint8_t *p = block + sizeof header, *end = block + header.size;
+
+    uint8_t length[SYMBOL_COUNT];
+    for (int i = 0; i < SYMBOL_COUNT; i += 2) {
+        length[i] = *p >> 4;
+        length[i+1] = *p++ & 15;
+    }
+    huffman_decoder_t h;
+    huffman_decoder_init(&h, length);
+
+    uint32_t text_size;
+    memcpy(&text_size, p, 4);
+    p += 4;
+    if (text_size > (size_t) (end - p))
+        return -1;
+    bit_reader_t r = {.p = p, .end = p + text_size, .bit = 7};
+    for (size_t i = 0; i < header.count; i++) {
+        int s = huffman_decode(&h, &r);
+        if (s < 0)
+            return -1;
+        if (s == SYMBOL_ESCAPE) {
+            int c = 0;
+            for (int k = 0; k < 8; k++) {
+                int b = get_bit(&r);
+                if (b < 0)
+                    return -1;
+                c = c << 1 | b;
+            }
+            e[i].c = c;
+        } else {
+            e[i].c = archive_char(s);
+        }
+    }
+    p += text_size;
+
+    uint64_t time = header.first_time;
+    for (size_t i = 0; i < header.count; i++) {
+        if (i) {
+            uint64_t delta;
+            p = get_varint(p, end, &delta);
+            if (!p)
+                return -1;
+            time += delta;
+        }
+        e[i].time = time;
+    }
+    bool has_confidence = header.flags & BLOCK_HAS_CONFIDENCE;
+    if (has_confidence && (size_t) (end - p) < header.count)
+        return -1;
+    for (size_t i = 0; i < header.count; i++)
+        e[i].confidence = has_confidence ? *p++ : 255;
+    return header.count;
+}
+
+/*
+ * Find, by binary search in the index, the first block that may hold
+ * characters at or after `time'. Returns `count' if there is none.
+ */
+static inline size_t archive_find(const archive_index_t *index,
+        size_t count, uint64_t time)
+{
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (index[mid].last_time < time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+/***********************************************************************
+ * Files.
+ */
+
+/*
+ * Map a whole file in memory, read-only. Returns NULL on error, or if
+ * the file is empty, in which case *size is 0.
+ */
+static inline const void *archive_map(const char *name, size_t *size)
+{
+    *size = 0;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        return NULL;
+    }
+    struct stat st;
+    void *p = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            perror(name);
+            p = NULL;
+        } else {
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return p;
+}
+
+/* Name of a companion file of the archive, e.g. its index. */
+static inline char *archive_file_name(const char *archive, const char *suffix)
+{
+    char *name = malloc(strlen(archive) + strlen(suffix) + 1);
+    if (!name) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return strcat(strcpy(name, archive), suffix);
+}
@@ -0,0 +1,525 @@
+/*
+ * Search a text archive, as written by text-archive, for a string such
+ * as a callsign, and print the times at which it was received.
+ *
+ * The search uses a trigram index, stored next to the archive with the
+ * suffix ".tri". For every sequence of three symbols (see
+ * text-archive.h), the index holds the "posting list" of the archive
+ * blocks where it appears. A query only decompresses the blocks whose
+ * posting lists contain all the trigrams of the searched string, and
+ * checks them for actual matches.
+ *
+ * The index is a sequence of segments, each covering a contiguous range
+ * of blocks. Updating the index adds a segment for the blocks appended
+ * to the archive since the last update. To keep the number of segments
+ * logarithmic in the size of the archive, the new segment absorbs the
+ * previous segments that are no larger than itself, as the carries of a
+ * binary counter. A segment is:
+ *
+ *   - a header (segment_header_t)
+ *   - a directory: one entry (directory_entry_t) per trigram present,
+ *     sorted by trigram
+ *   - the posting lists: block numbers, as differences from the previous
+ *     one (the first from the start of the segment), coded as LEB128.
+ *
+ * A match may straddle two blocks. The trigrams that straddle the
+ * boundary are posted to the later block, so the trigrams of a match are
+ * all in the block where it ends, or in the previous one. This is why a
+ * block is a candidate if all the trigrams are in it or in the previous
+ * block.
+ *
+ * Blocks appended since the last update are not indexed, and are
+ * searched exhaustively.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "text-archive.h"
+
+#define TRIGRAM_SUFFIX ".tri"
+#define TRIGRAM_COUNT (SYMBOL_COUNT * SYMBOL_COUNT * SYMBOL_COUNT)
+#define SEGMENT_MAGIC 0x4a544d54  // "TMTJ" in little endian
+#define MAX_SEGMENTS 64
+#define MAX_QUERY 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t first_block;
+    uint32_t block_count;
+    uint32_t trigram_count;  // entries in the directory
+    uint64_t size;           // of the segment, header included
+} segment_header_t;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t offset;  // of the posting list, from the end of the directory
+    uint32_t count;   // of blocks in the posting list
+} directory_entry_t;
+
+/* A segment of the mapped index. */
+typedef struct {
+    segment_header_t header;
+    const directory_entry_t *directory;
+    const uint8_t *postings, *end;
+    size_t position;  // in the index file
+} segment_t;
+
+static segment_t segments[MAX_SEGMENTS];
+static size_t segment_count;
+
+/* The archive. */
+static const uint8_t *blocks;
+static const archive_index_t *block_index;
+static size_t blocks_length, block_count;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: text-search -u archive\n"
+        "       text-search [-l] archive text\n"
+        "Options:\n"
+        "  -u   update the index of the archive\n"
+        "  -l   only print the last occurrence\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *checked_realloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static inline uint32_t trigram(char a, char b, char c)
+{
+    return archive_symbol(a) << 12 | archive_symbol(b) << 6
+            | archive_symbol(c);
+}
+
+/* Map the archive. Returns false on error. */
+static bool map_archive(const char *archive)
+{
+    size_t index_length;
+    blocks = archive_map(archive, &blocks_length);
+    block_index = archive_map(archive_file_name(archive,
+            ARCHIVE_INDEX_SUFFIX), &index_length);
+    block_count = block_index ? index_length / sizeof *block_index : 0;
+    for (size_t i = 0; i < block_count; i++)
+        if (block_index[i].offset + block_index[i].size > blocks_length) {
+            fprintf(stderr, "%s: the index does not match the data.\n",
+                    archive);
+            return false;
+        }
+    return true;
+}
+
+/* Decode a block of the archive. Exits on error. */
+static long decode_block(size_t i, archive_entry_t *e)
+{
+    long n = archive_decode(blocks + block_index[i].offset,
+            block_index[i].size, e);
+    if (n < 0) {
+        fprintf(stderr, "Block %zu is corrupted.\n", i);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+/*
+ * Map the trigram index and parse its segments. A truncated or
+ * corrupted segment, and everything after it, is ignored: its blocks
+ * will be indexed again by the next update. Returns the number of
+ * blocks indexed.
+ */
+static size_t map_index(const char *file_name)
+{
+    size_t length;
+    const uint8_t *p = archive_map(file_name, &length);
+    size_t position = 0, indexed = 0;
+    segment_count = 0;
+    while (p && position + sizeof(segment_header_t) <= length
+            && segment_count < MAX_SEGMENTS) {
+        segment_t *s = &segments[segment_count];
+        memcpy(&s->header, p + position, sizeof s->header);
+        size_t directory_size = s->header.trigram_count
+                * sizeof(directory_entry_t);
+        if (s->header.magic != SEGMENT_MAGIC
+                || s->header.first_block != indexed
+                || s->header.size > length - position
+                || sizeof s->header + directory_size > s->header.size)
+            break;
+        s->directory = (const void *) (p + position + sizeof s->header);
+        s->postings = p + position + sizeof s->header + directory_size;
+        s->end = p + position + s->header.size;
+        s->position = position;
+        position += s->header.size;
+        indexed += s->header.block_count;
+        segment_count++;
+    }
+    return indexed;
+}
+
+/*
+ * Get the posting list of a trigram in a segment, as absolute block
+ * numbers appended to `list'. Returns the new length of the list.
+ */
+static size_t get_postings(const segment_t *s, uint32_t t,
+        uint32_t **list, size_t length, size_t *capacity)
+{
+    const directory_entry_t *d = s->directory;
+    size_t low = 0, high = s->header.trigram_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (d[mid].trigram < t)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == s->header.trigram_count || d[low].trigram != t)
+        return length;
+    if (length + d[low].count > *capacity) {
+        *capacity = (length + d[low].count) * 2;
+        *list = checked_realloc(*list, *capacity * sizeof **list);
+    }
+    const uint8_t *p = s->postings + d[low].offset;
+    uint64_t block = s->header.first_block;
+    for (uint32_t i = 0; i < d[low].count; i++) {
+        uint64_t delta;
+        p = get_varint(p, s->end, &delta);
+        if (!p)
+            break;
+        block += delta;
+        (*list)[length++] = block;
+    }
+    return length;
+}
+
+
+/***********************************************************************
+ * Updating the index.
+ */
+
+static int compare_pairs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int update(const char *archive)
+{
+    if (!map_archive(archive))
+        return EXIT_FAILURE;
+    char *file_name = archive_file_name(archive, TRIGRAM_SUFFIX);
+    if (access(file_name, F_OK) != 0) {
+        FILE *f = fopen(file_name, "w");
+        if (!f) {
+            perror(file_name);
+            return EXIT_FAILURE;
+        }
+        fclose(f);
+    }
+    size_t indexed = map_index(file_name);
+    if (indexed > block_count) {
+        fprintf(stderr, "%s: the index is ahead of the archive.\n",
+                file_name);
+        return EXIT_FAILURE;
+    }
+    if (indexed == block_count) {
+        fprintf(stderr, "%zu blocks, all indexed\n", block_count);
+        return EXIT_SUCCESS;
+    }
+
+    /* Absorb the previous segments that are no larger. */
+    size_t first = segment_count;
+    size_t new_blocks = block_count - indexed;
+    while (first > 0 && segments[first-1].header.block_count <= new_blocks) {
+        first--;
+        new_blocks += segments[first].header.block_count;
+    }
+    if (segment_count == MAX_SEGMENTS && first == segment_count)
+        first--;  // no room for a new segment: merge with the last
+
+    /*
+     * Collect the (trigram, block) pairs, as trigram << 32 | block, from
+     * the absorbed segments and the new blocks.
+     */
+    uint64_t *pairs = NULL;
+    size_t pair_count = 0, capacity = 0;
+    uint32_t *list = NULL;
+    size_t list_capacity = 0;
+    for (size_t k = first; k < segment_count; k++) {
+        const segment_t *s = &segments[k];
+        for (uint32_t i = 0; i < s->header.trigram_count; i++) {
+            uint32_t t = s->directory[i].trigram;
+            size_t n = get_postings(s, t, &list, 0, &list_capacity);
+            if (pair_count + n > capacity) {
+                capacity = (pair_count + n) * 2;
+                pairs = checked_realloc(pairs, capacity * sizeof *pairs);
+            }
+            for (size_t j = 0; j < n; j++)
+                pairs[pair_count++] = (uint64_t) t << 32 | list[j];
+        }
+    }
+    static archive_entry_t entries[2 + ARCHIVE_BLOCK_CHARS];
+    static uint32_t last_seen[TRIGRAM_COUNT];  // block + 1
+
+    /*
+     * The last two characters of the previous block are kept before the
+     * decoded block, for the trigrams that straddle the boundary.
+     */
+    archive_entry_t previous[2];
+    size_t tail = 0;
+    if (indexed > 0) {
+        long n = decode_block(indexed - 1, entries + 2);
+        tail = n < 2 ? n : 2;
+        memcpy(previous, entries + 2 + n - tail, tail * sizeof *previous);
+    }
+    for (size_t b = indexed; b < block_count; b++) {
+        archive_entry_t *e = entries + 2 - tail;
+        memcpy(e, previous, tail * sizeof *e);
+        long n = tail + decode_block(b, entries + 2);
+        if (pair_count + n > capacity) {
+            capacity = (pair_count + n) * 2;
+            pairs = checked_realloc(pairs, capacity * sizeof *pairs);
+        }
+        for (long i = 2; i < n; i++) {
+            uint32_t t = trigram(e[i-2].c, e[i-1].c, e[i].c);
+            if (last_seen[t] == b + 1)
+                continue;
+            last_seen[t] = b + 1;
+            pairs[pair_count++] = (uint64_t) t << 32 | b;
+        }
+        tail = n < 2 ? n : 2;
+        memcpy(previous, e + n - tail, tail * sizeof *previous);
+    }
+    qsort(pairs, pair_count, sizeof *pairs, compare_pairs);
+
+    /* Build the new segment. */
+    uint32_t first_block = first < segment_count
+            ? segments[first].header.first_block : indexed;
+    directory_entry_t *directory = NULL;
+    uint8_t *postings = malloc(pair_count * 5 + 1);
+    if (!postings) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t trigram_count = 0, directory_capacity = 0;
+    uint8_t *p = postings;
+    for (size_t i = 0; i < pair_count; i++) {
+        uint32_t t = pairs[i] >> 32, block = pairs[i];
+        if (i == 0 || t != pairs[i-1] >> 32) {
+            if (trigram_count == directory_capacity) {
+                directory_capacity = directory_capacity * 2 + 1024;
+                directory = checked_realloc(directory,
+                        directory_capacity * sizeof *directory);
+            }
+            directory[trigram_count++] = (directory_entry_t) {
+                .trigram = t, .offset = p - postings, .count = 0
+            };
+            p = put_varint(p, block - first_block);
+        } else {
+            p = put_varint(p, block - (uint32_t) pairs[i-1]);
+        }
+        directory[trigram_count-1].count++;
+    }
+    segment_header_t header = {
+        .magic = SEGMENT_MAGIC,
+        .first_block = first_block,
+        .block_count = block_count - first_block,
+        .trigram_count = trigram_count,
+        .size = sizeof header + trigram_count * sizeof *directory
+                + (p - postings)
+    };
+
+    /* Replace the absorbed segments. */
+    size_t position = first < segment_count ? segments[first].position
+            : segment_count ? segments[segment_count-1].position
+                + segments[segment_count-1].header.size : 0;
+    FILE *f = fopen(file_name, "r+");
+    if (!f || truncate(file_name, position) != 0
+            || fseek(f, position, SEEK_SET) != 0
+            || fwrite(&header, sizeof header, 1, f) != 1
+            || fwrite(directory, sizeof *directory, trigram_count, f)
+                != trigram_count
+            || fwrite(postings, 1, p - postings, f) != (size_t) (p - postings)
+            || fclose(f) != 0) {
+        perror(file_name);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%zu blocks indexed, %zu segments, segment of %"
+            PRIu32 " blocks written, %zu bytes\n", block_count,
+            first + 1, header.block_count, (size_t) header.size);
+    return EXIT_SUCCESS;
+}
+
+
+/***********************************************************************
+ * Searching.
+ */
+
+/*
+ * Replace a sorted list of blocks by the blocks that are in it, or
+ * follow one that is. Returns the new length.
+ */
+static size_t dilate(uint32_t *list, size_t length, uint32_t *tmp)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (n == 0 || tmp[n-1] != list[i])
+            tmp[n++] = list[i];
+        tmp[n++] = list[i] + 1;
+    }
+    memcpy(list, tmp, n * sizeof *list);
+    return n;
+}
+
+/* Intersect two sorted lists, in place in the first. */
+static size_t intersect(uint32_t *a, size_t na, const uint32_t *b,
+        size_t nb)
+{
+    size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else {
+            a[n++] = a[i++];
+            j++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Look for the query in block b, including the matches that start in
+ * block b-1. Print them, or only the last one if `last_only'. Returns
+ * the number of matches.
+ */
+static size_t search_block(size_t b, const char *query, bool last_only)
+{
+    static archive_entry_t entries[MAX_QUERY + ARCHIVE_BLOCK_CHARS];
+    size_t length = strlen(query), tail = 0;
+    if (b > 0) {
+        static archive_entry_t previous[ARCHIVE_BLOCK_CHARS];
+        size_t n = decode_block(b - 1, previous);
+        tail = n < length - 1 ? n : length - 1;
+        memcpy(entries, previous + n - tail, tail * sizeof *entries);
+    }
+    size_t n = tail + decode_block(b, entries + tail);
+    size_t matches = 0;
+    const archive_entry_t *found = NULL;
+    for (size_t i = 0; i + length <= n; i++) {
+        size_t k = 0;
+        while (k < length && entries[i+k].c == query[k])
+            k++;
+        if (k < length)
+            continue;
+        matches++;
+        found = &entries[i];
+        if (!last_only)
+            printf("%.6f %.6f\n", found[0].time / 1e6,
+                    found[length-1].time / 1e6);
+    }
+    if (last_only && found)
+        printf("%.6f %.6f\n", found[0].time / 1e6,
+                found[length-1].time / 1e6);
+    return matches;
+}
+
+static int search(const char *archive, const char *text, bool last_only)
+{
+    char query[MAX_QUERY + 1];
+    size_t length = strlen(text);
+    if (length < 3 || length > MAX_QUERY) {
+        fprintf(stderr, "The text should have 3 to %d characters.\n",
+                MAX_QUERY);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i <= length; i++)
+        query[i] = toupper((unsigned char) text[i]);
+    if (!map_archive(archive))
+        return EXIT_FAILURE;
+    size_t indexed = map_index(archive_file_name(archive, TRIGRAM_SUFFIX));
+    if (indexed > block_count) {
+        fprintf(stderr, "The index is ahead of the archive.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Candidates: blocks with all the trigrams in them or before. */
+    uint32_t *candidates = NULL, *list = NULL, *tmp = NULL;
+    size_t candidate_count = 0, list_capacity = 0;
+    for (size_t i = 0; i + 2 < length; i++) {
+        uint32_t t = trigram(query[i], query[i+1], query[i+2]);
+        size_t n = 0;
+        for (size_t k = 0; k < segment_count; k++)
+            n = get_postings(&segments[k], t, &list, n, &list_capacity);
+        if (2 * n > list_capacity) {
+            list_capacity = 2 * n;
+            list = checked_realloc(list, list_capacity * sizeof *list);
+        }
+        tmp = checked_realloc(tmp, (2 * n + 1) * sizeof *tmp);
+        n = dilate(list, n, tmp);
+        if (i == 0) {
+            candidates = checked_realloc(candidates, (n + 1) * sizeof *list);
+            memcpy(candidates, list, n * sizeof *list);
+            candidate_count = n;
+        } else {
+            candidate_count = intersect(candidates, candidate_count,
+                    list, n);
+        }
+        if (candidate_count == 0)
+            break;
+    }
+
+    /* Drop the candidates past the indexed blocks, add the others. */
+    while (candidate_count && candidates[candidate_count-1] >= indexed)
+        candidate_count--;
+    candidates = checked_realloc(candidates, (candidate_count + block_count
+            - indexed + 1) * sizeof *candidates);
+    for (size_t b = indexed; b < block_count; b++)
+        candidates[candidate_count++] = b;
+
+    /* Check them, from the last one if only the last match is wanted. */
+    size_t matches = 0;
+    for (size_t i = 0; i < candidate_count; i++) {
+        size_t b = candidates[last_only ? candidate_count - 1 - i : i];
+        matches += search_block(b, query, last_only);
+        if (last_only && matches)
+            break;
+    }
+    fprintf(stderr, "%zu matches, %zu of %zu blocks searched\n", matches,
+            candidate_count, block_count);
+    return matches ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    bool update_index = false, last_only = false;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "ul")) != -1) {
+        switch (opt) {
+            case 'u': update_index = true; break;
+            case 'l': last_only = true; break;
+            default: usage();
+        }
+    }
+    if (update_index) {
+        if (optind != argc - 1)
+            usage();
+        return update(argv[optind]);
+    }
+    if (optind != argc - 2)
+        usage();
+    return search(argv[optind], argv[optind+1], last_only);
+}
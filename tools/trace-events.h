@@ -0,0 +1,150 @@
+/*
+ * Optional tracing of the host pipeline, in the Chrome trace format.
+ *
+ * The stages of the pipeline are bracketed by TRACE_BEGIN() and
+ * TRACE_END(), and queue depths are recorded with TRACE_COUNTER(). The
+ * events are stored in per-thread buffers, which need no locking, and
+ * are written out at the end by trace_dump() as a JSON file that can be
+ * opened with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Tracing is compiled in only if TRACE_EVENTS is defined (make
+ * TRACE=1). Otherwise all the macros expand to nothing.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifdef TRACE_EVENTS
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Capacity of each per-thread buffer. Later events are dropped. */
+#define TRACE_BUFFER_EVENTS (1 << 20)
+
+typedef struct {
+    const char *name;  // must be a string literal
+    char phase;        // 'B' (begin), 'E' (end) or 'C' (counter)
+    uint64_t time;     // in ns
+    int64_t value;     // of a counter, or argument of a begin event
+} trace_event_t;
+
+typedef struct trace_buffer {
+    struct trace_buffer *next;  // list of all the buffers
+    long tid;
+    size_t length, dropped;
+    trace_event_t events[TRACE_BUFFER_EVENTS];
+} trace_buffer_t;
+
+static trace_buffer_t *trace_buffers;
+static __thread trace_buffer_t *trace_buffer;
+
+/*
+ * Allocate the buffer of the calling thread, and push it on the list.
+ * This is the only operation that touches shared data, and it is done
+ * once per thread with an atomic compare and swap.
+ */
+static inline trace_buffer_t *trace_new_buffer(void)
+{
+    trace_buffer_t *b = calloc(1, sizeof *b);
+    if (!b)
+        return NULL;
+    b->tid = syscall(SYS_gettid);
+    b->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_buffers, &b->next, b,
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return trace_buffer = b;
+}
+
+static inline void trace_event(const char *name, char phase, int64_t value)
+{
+    trace_buffer_t *b = trace_buffer ? trace_buffer : trace_new_buffer();
+    if (!b)
+        return;
+    if (b->length == TRACE_BUFFER_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    b->events[b->length++] = (trace_event_t) {
+        .name = name,
+        .phase = phase,
+        .time = t.tv_sec * UINT64_C(1000000000) + t.tv_nsec,
+        .value = value
+    };
+}
+
+/*
+ * Write all the events to a file. This should be called once the other
+ * threads have stopped recording. Returns false on error.
+ */
+static inline bool trace_dump(const char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f) {
+        perror(file_name);
+        return false;
+    }
+    fprintf(f, "{\"traceEvents\":[\n");
+    const char *separator = "";
+    long pid = getpid();
+    trace_buffer_t *list =
+            __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for (trace_buffer_t *b = list; b; b = b->next) {
+        for (size_t i = 0; i < b->length; i++) {
+            const trace_event_t *e = &b->events[i];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":%ld,\"tid\":%ld", separator, e->name,
+                    e->phase, e->time / 1e3, pid, b->tid);
+            if (e->phase == 'C')
+                fprintf(f, ",\"args\":{\"value\":%" PRId64 "}", e->value);
+            else if (e->phase == 'B' && e->value >= 0)
+                fprintf(f, ",\"args\":{\"n\":%" PRId64 "}", e->value);
+            fprintf(f, "}");
+            separator = ",\n";
+        }
+        if (b->dropped)
+            fprintf(stderr, "Trace buffer full: %zu events dropped.\n",
+                    b->dropped);
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
+
+/* Begin a stage. */
+#define TRACE_BEGIN(name) trace_event(name, 'B', -1)
+
+/* Same, with a numeric argument, e.g. a channel number. */
+#define TRACE_BEGIN_N(name, n) trace_event(name, 'B', n)
+
+/* End a stage. The name should match the one given to TRACE_BEGIN(). */
+#define TRACE_END(name) trace_event(name, 'E', 0)
+
+/* Record the value of a counter, e.g. a queue depth. */
+#define TRACE_COUNTER(name, value) trace_event(name, 'C', value)
+
+#else  // TRACE_EVENTS not defined
+
+#define TRACE_BEGIN(name)          ((void) 0)
+#define TRACE_BEGIN_N(name, n)     ((void) 0)
+#define TRACE_END(name)            ((void) 0)
+#define TRACE_COUNTER(name, value) ((void) 0)
+
+static inline bool trace_dump(const char *file_name)
+{
+    fprintf(stderr, "%s not written: tracing was not compiled in.\n",
+            file_name);
+    return false;
+}
+
+#endif  // TRACE_EVENTS
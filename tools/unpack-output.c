@@ -0,0 +1,212 @@
+/*
+ * Unpack the serial output of decoders built with PACKED_OUTPUT.
+ *
+ * The raw bytes are read from the standard input, or from the given
+ * file, and the text of the frames is written on the standard output.
+ * See internals.md for the frame format. The characters are written,
+ * and flushed, as they arrive, so that this can be used on a live
+ * serial port.
+ *
+ * Copyright (c) 2018 Edgar Bonet Orozco.
+ * This file is part of tiny-morse-decoder, licensed under the terms of
+ * the MIT license. See file LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#define SYNC_BYTE     0xff
+#define END_SYMBOL    60   // closes a frame
+#define CHANNEL_COUNT 7    // channel 7 is reserved
+#define DELTA_UNIT    (256 / 9600.0)  // 256 tics, in seconds
+
+typedef struct {
+    int channel;
+    int delta;
+    int length;          // characters
+    int byte_count;      // bytes, from sync to padding
+    size_t capacity;
+    char *text;
+} frame_t;
+
+/* Error counts. */
+static unsigned long skipped_bytes, truncated_frames, bad_frames;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: unpack-output [-c channel] [-t] [file]\n"
+        "Options:\n"
+        "  -c channel  only output this channel (0 to 6)\n"
+        "  -t          one line per frame: time, channel and text\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Inverse of the mapping done by packed_putchar(). */
+static char symbol_to_char(int symbol)
+{
+    if (symbol == 59)
+        return '_';
+    return ' ' + symbol;
+}
+
+/*
+ * Read the next byte of a frame. Returns false on end of file, or if
+ * the byte is a sync, which is then left for the next frame.
+ */
+static bool read_byte(FILE *f, int *byte)
+{
+    int c = getc(f);
+    if (c == EOF)
+        return false;
+    if (c == SYNC_BYTE) {
+        ungetc(c, f);
+        truncated_frames++;
+        return false;
+    }
+    *byte = c;
+    return true;
+}
+
+/* Append a character to the text of the frame. */
+static void append_char(frame_t *frame, char c)
+{
+    if (frame->length + 1 >= (int) frame->capacity) {
+        size_t capacity = frame->capacity ? 2 * frame->capacity : 64;
+        char *text = realloc(frame->text, capacity);
+        if (!text) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        frame->text = text;
+        frame->capacity = capacity;
+    }
+    frame->text[frame->length++] = c;
+    frame->text[frame->length] = '\0';
+}
+
+/*
+ * Read the next valid frame. Bytes outside frames, truncated frames and
+ * frames with an invalid header or symbol are counted and skipped. If
+ * `echo' is set, the characters of the frames of that channel (or of
+ * all channels if it is negative) are written as they arrive, even if
+ * the frame later turns out to be bad. Returns false at the end of the
+ * input.
+ */
+static bool read_frame(FILE *f, frame_t *frame, bool echo, int channel)
+{
+    for (;;) {
+        int c = getc(f);
+        if (c == EOF)
+            return false;
+        if (c != SYNC_BYTE) {
+            skipped_bytes++;
+            continue;
+        }
+
+        /* Header and time delta. */
+        int header;
+        if (!read_byte(f, &header) || !read_byte(f, &frame->delta))
+            continue;
+        frame->channel = header >> 4;
+        frame->length = 0;
+        frame->byte_count = 3;
+        bool ok = frame->channel < CHANNEL_COUNT;
+        echo = echo && ok && (channel < 0 || frame->channel == channel);
+
+        /* Symbols, packed least significant bit first, up to the end. */
+        uint16_t bits = 0;
+        int bit_count = 0, symbol = 0;
+        while (symbol != END_SYMBOL) {
+            if (bit_count < 6) {
+                int byte;
+                if (!read_byte(f, &byte))
+                    break;
+                bits |= byte << bit_count;
+                bit_count += 8;
+                frame->byte_count++;
+            }
+            symbol = bits & 0x3f;
+            bits >>= 6;
+            bit_count -= 6;
+            if (symbol > END_SYMBOL)
+                ok = false;
+            else if (symbol != END_SYMBOL) {
+                char c = symbol_to_char(symbol);
+                append_char(frame, c);
+                if (echo) {
+                    putchar(c);
+                    fflush(stdout);
+                }
+            }
+        }
+        if (symbol != END_SYMBOL)
+            continue;
+        if (!ok || bits != 0) {  // the padding should be zero
+            bad_frames++;
+            continue;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int channel = -1;
+    bool timestamps = false;
+
+    /* Parse the command line. */
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t")) != -1) {
+        switch (opt) {
+            case 'c': channel = atoi(optarg); break;
+            case 't': timestamps = true; break;
+            default: usage();
+        }
+    }
+    if (channel >= CHANNEL_COUNT || optind < argc - 1)
+        usage();
+    FILE *f = stdin;
+    if (optind < argc) {
+        f = fopen(argv[optind], "rb");
+        if (!f) {
+            perror(argv[optind]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /*
+     * Every channel keeps its own time, as the sum of its deltas, i.e.
+     * the time since its decoder booted, modulo 6.8 s per frame.
+     */
+    double time[CHANNEL_COUNT] = {0};
+    unsigned long frame_count = 0, char_count = 0, byte_count = 0;
+    frame_t frame = {0};
+    while (read_frame(f, &frame, !timestamps, channel)) {
+        frame_count++;
+        char_count += frame.length;
+        byte_count += frame.byte_count;
+        time[frame.channel] += frame.delta * DELTA_UNIT;
+        if (!timestamps || (channel >= 0 && frame.channel != channel))
+            continue;
+        printf("%.2f %d \"%s\"\n", time[frame.channel], frame.channel,
+                frame.length ? frame.text : "");
+        fflush(stdout);
+    }
+    if (!timestamps) {
+        putchar('\n');
+        fflush(stdout);
+    }
+    free(frame.text);
+
+    fprintf(stderr, "%lu frames, %lu characters in %lu bytes\n",
+            frame_count, char_count, byte_count);
+    if (skipped_bytes || truncated_frames || bad_frames)
+        fprintf(stderr, "%lu bytes skipped, %lu truncated frames, "
+                "%lu bad frames\n", skipped_bytes, truncated_frames,
+                bad_frames);
+    return EXIT_SUCCESS;
+}